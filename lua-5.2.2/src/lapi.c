@@ -40,6 +40,9 @@ const char lua_ident[] =
 /* corresponding test */
 #define isvalid(o)	((o) != luaO_nilobject)
 
+/* pinned key handle -> interned string */
+#define key2ts(k)	cast(TString *, cast(void *, (k)))
+
 /* test for pseudo index */
 #define ispseudo(i)		((i) <= LUA_REGISTRYINDEX)
 
@@ -599,6 +602,14 @@ LUA_API int lua_pushthread (lua_State *L) {
 }
 
 
+LUA_API void lua_pushkey (lua_State *L, lua_Key k) {
+  lua_lock(L);
+  setsvalue2s(L, L->top, key2ts(k));
+  api_incr_top(L);
+  lua_unlock(L);
+}
+
+
 
 /*
 ** get functions (Lua -> stack)
@@ -636,6 +647,18 @@ LUA_API void lua_getfield (lua_State *L, int idx, const char *k) {
 }
 
 
+/* same as lua_getfield, but the key is already interned (and hashed) */
+LUA_API void lua_getfieldh (lua_State *L, int idx, lua_Key k) {
+  StkId t;
+  lua_lock(L);
+  t = index2addr(L, idx);
+  setsvalue2s(L, L->top, key2ts(k));
+  api_incr_top(L);
+  luaV_gettable(L, t, L->top - 1, L->top - 1);
+  lua_unlock(L);
+}
+
+
 LUA_API void lua_rawget (lua_State *L, int idx) {
   StkId t;
   lua_lock(L);
@@ -678,7 +701,7 @@ LUA_API void lua_createtable (lua_State *L, int narray, int nrec) {
   sethvalue(L, L->top, t);
   api_incr_top(L);
   if (narray > 0 || nrec > 0)
-    luaH_resize(L, t, narray, nrec);
+    luaH_presize(L, t, narray, nrec);
   lua_unlock(L);
 }
 
@@ -767,13 +790,29 @@ LUA_API void lua_setfield (lua_State *L, int idx, const char *k) {
 }
 
 
+/* same as lua_setfield, but the key is already interned (and hashed) */
+LUA_API void lua_setfieldh (lua_State *L, int idx, lua_Key k) {
+  StkId t;
+  lua_lock(L);
+  api_checknelems(L, 1);
+  t = index2addr(L, idx);
+  setsvalue2s(L, L->top++, key2ts(k));
+  luaV_settable(L, t, L->top - 1, L->top - 2);
+  L->top -= 2;  /* pop value and key */
+  lua_unlock(L);
+}
+
+
 LUA_API void lua_rawset (lua_State *L, int idx) {
   StkId t;
+  TValue *cell;
   lua_lock(L);
   api_checknelems(L, 2);
   t = index2addr(L, idx);
   api_check(L, ttistable(t), "table expected");
-  setobj2t(L, luaH_set(L, hvalue(t), L->top-2), L->top-1);
+  cell = luaH_set(L, hvalue(t), L->top-2);
+  setobj2t(L, cell, L->top-1);
+  updateborder(hvalue(t), cell);
   invalidateTMcache(hvalue(t));
   luaC_barrierback(L, gcvalue(t), L->top-1);
   L->top -= 2;
@@ -781,6 +820,16 @@ LUA_API void lua_rawset (lua_State *L, int idx) {
 }
 
 
+LUA_API void lua_cleartable (lua_State *L, int idx) {
+  StkId t;
+  lua_lock(L);
+  t = index2addr(L, idx);
+  api_check(L, ttistable(t), "table expected");
+  luaH_clear(L, hvalue(t));
+  lua_unlock(L);
+}
+
+
 LUA_API void lua_rawseti (lua_State *L, int idx, int n) {
   StkId t;
   lua_lock(L);
@@ -824,6 +873,7 @@ LUA_API int lua_setmetatable (lua_State *L, int objindex) {
   switch (ttypenv(obj)) {
     case LUA_TTABLE: {
       hvalue(obj)->metatable = mt;
+      hvalue(obj)->epoch++;  /* invalidate __index chains through it */
       if (mt) {
         luaC_objbarrierback(L, gcvalue(obj), mt);
         luaC_checkfinalizer(L, gcvalue(obj), mt);
@@ -867,6 +917,26 @@ LUA_API void lua_setuservalue (lua_State *L, int idx) {
 }
 
 
+/*
+** pinned keys
+*/
+
+/*
+** Interns 'k' once and fixes it, so it is never collected before the state
+** is closed.  The returned handle lets lua_getfieldh/lua_setfieldh/lua_pushkey
+** skip luaS_new (hashing plus a string-table lookup) on every access.
+*/
+LUA_API lua_Key lua_pinkey (lua_State *L, const char *k) {
+  TString *ts;
+  lua_lock(L);
+  ts = luaS_new(L, k);
+  luaS_fix(ts);
+  lua_unlock(L);
+  return cast(lua_Key, ts);
+}
+
+
+
 /*
 ** `load' and `call' functions (run Lua code)
 */
@@ -1096,6 +1166,41 @@ LUA_API int lua_gc (lua_State *L, int what, int data) {
 }
 
 
+LUA_API void lua_setgchook (lua_State *L, lua_GCHook f, void *ud) {
+  global_State *g;
+  lua_lock(L);
+  g = G(L);
+  g->gchook = f;
+  g->gchookud = ud;
+  lua_unlock(L);
+}
+
+
+LUA_API void lua_walkheap (lua_State *L, lua_HeapObject object,
+                           lua_HeapRef ref, void *ud) {
+  lua_lock(L);
+  luaC_walkheap(L, object, ref, ud);
+  lua_unlock(L);
+}
+
+
+LUA_API void lua_settablepool (lua_State *L, int max) {
+  lua_lock(L);
+  luaH_setpool(L, max);
+  lua_unlock(L);
+}
+
+
+LUA_API void lua_gettablepool (lua_State *L, lua_TablePoolStats *stats) {
+  global_State *g;
+  lua_lock(L);
+  g = G(L);
+  *stats = g->tablepoolstats;
+  stats->size = g->ntablepool;
+  lua_unlock(L);
+}
+
+
 
 /*
 ** miscellaneous functions
@@ -1282,3 +1387,74 @@ LUA_API void lua_upvaluejoin (lua_State *L, int fidx1, int n1,
   luaC_objbarrier(L, f1, *up2);
 }
 
+
+LUA_API void lua_copyfunction (lua_State *L, int funcindex, int n) {
+  StkId fi;
+  LClosure *f;
+  Closure *ncl;
+  int i;
+  lua_lock(L);
+  fi = index2addr(L, funcindex);
+  api_check(L, ttisLclosure(fi), "Lua function expected");
+  f = clLvalue(fi);
+  ncl = luaF_newLclosure(L, f->nupvalues);
+  ncl->l.p = f->p;
+  for (i = 0; i < f->nupvalues; i++)  /* share all upvalues... */
+    ncl->l.upvals[i] = f->upvals[i];
+  if (n != 0) {  /* ...except 'n', which gets a new one */
+    UpVal *uv;
+    api_checknelems(L, 1);
+    api_check(L, (1 <= n && n <= f->nupvalues), "invalid upvalue index");
+    uv = luaF_newupval(L);
+    ncl->l.upvals[n - 1] = uv;
+    setobj(L, uv->v, L->top - 1);
+    luaC_barrier(L, uv, L->top - 1);
+    setclLvalue(L, L->top - 1, ncl);  /* replace the value */
+  }
+  else {
+    setclLvalue(L, L->top, ncl);
+    api_incr_top(L);
+  }
+  luaC_checkGC(L);
+  lua_unlock(L);
+}
+
+
+
+#if defined(LUA_COVERAGE)
+static void reportcoverage (const Proto *p, lua_CoverageLine f, void *ud) {
+  const char *source = (p->source) ? getstr(p->source) : "=?";
+  int line = 0;
+  int hit = 0;
+  int pc;
+  for (pc = 0; pc < p->sizecode; pc++) {
+    int pcline = getfuncline(p, pc);
+    if (pcline != line) {
+      if (line > 0) f(ud, source, line, hit);
+      line = pcline;
+      hit = 0;
+    }
+    if (p->coverage != NULL && luaF_coveragehit(p, pc)) hit = 1;
+  }
+  if (line > 0) f(ud, source, line, hit);
+  for (pc = 0; pc < p->sizep; pc++)
+    reportcoverage(p->p[pc], f, ud);
+}
+#endif
+
+
+LUA_API int lua_getcoverage (lua_State *L, int funcindex,
+                             lua_CoverageLine f, void *ud) {
+#if defined(LUA_COVERAGE)
+  StkId fi;
+  lua_lock(L);
+  fi = index2addr(L, funcindex);
+  api_check(L, ttisLclosure(fi), "Lua function expected");
+  reportcoverage(clLvalue(fi)->p, f, ud);
+  lua_unlock(L);
+  return 1;
+#else
+  UNUSED(L); UNUSED(funcindex); UNUSED(f); UNUSED(ud);
+  return 0;
+#endif
+}
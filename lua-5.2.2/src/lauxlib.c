@@ -426,7 +426,10 @@ LUALIB_API lua_Unsigned luaL_optunsigned (lua_State *L, int narg,
 
 /*
 ** check whether buffer is using a userdata on the stack as a temporary
-** buffer
+** buffer. The strbufs of lstrlib.c rely on this: after luaL_buffinit they
+** set 'b', 'size' and 'n' to the characters of a userdata they pushed, so
+** these functions must take any 'b' other than 'initb' as the userdata on
+** the top of the stack, and grow it by replacing it there
 */
 #define buffonstack(B)	((B)->b != (B)->initb)
 
@@ -6,6 +6,7 @@
 
 
 #include <stddef.h>
+#include <string.h>
 
 #define lfunc_c
 #define LUA_CORE
@@ -16,6 +17,7 @@
 #include "lgc.h"
 #include "lmem.h"
 #include "lobject.h"
+#include "lopcodes.h"
 #include "lstate.h"
 
 
@@ -128,6 +130,12 @@ Proto *luaF_newproto (lua_State *L) {
   f->linedefined = 0;
   f->lastlinedefined = 0;
   f->source = NULL;
+  f->icache = NULL;
+  f->icacheidx = NULL;
+  f->sizeicache = 0;
+#if defined(LUA_COVERAGE)
+  f->coverage = NULL;
+#endif
   return f;
 }
 
@@ -139,10 +147,89 @@ void luaF_freeproto (lua_State *L, Proto *f) {
   luaM_freearray(L, f->lineinfo, f->sizelineinfo);
   luaM_freearray(L, f->locvars, f->sizelocvars);
   luaM_freearray(L, f->upvalues, f->sizeupvalues);
+  if (f->icache != NULL) {
+    int i;
+    for (i = 0; i < f->sizeicache; i++)
+      luaM_freearray(L, f->icache[i].chains, ICACHE_WAYS);  /* may be NULL */
+    luaM_freearray(L, f->icache, f->sizeicache);
+  }
+  if (f->icacheidx != NULL)
+    luaM_freearray(L, f->icacheidx, f->sizecode);
+#if defined(LUA_COVERAGE)
+  luaM_freearray(L, f->coverage, luaF_coveragesize(f));
+#endif
   luaM_free(L, f);
 }
 
 
+/* most inline caches a function can have ('icacheidx' must count them) */
+#define MAXICACHE	0xffff
+
+
+/*
+** whether instruction 'i' accesses a table, in which case 'constkey'
+** tells whether the key is a constant short string of 'f'
+*/
+static int tableaccess (const Proto *f, Instruction i, int *constkey) {
+  int rk;
+  switch (GET_OPCODE(i)) {
+    case OP_GETTABUP: case OP_GETTABLE: case OP_SELF:
+      rk = GETARG_C(i);
+      break;
+    case OP_SETTABUP: case OP_SETTABLE:
+      rk = GETARG_B(i);
+      break;
+    default: return 0;
+  }
+  *constkey = ISK(rk) && ttisshrstring(&f->k[INDEXK(rk)]);
+  return 1;
+}
+
+
+/*
+** give 'f', if it accesses tables, an inline cache for each access with
+** a constant short string key (up to MAXICACHE), and the index of the
+** cache of each instruction. Other accesses share cache 0: they seldom
+** have short string keys, and a cache checks everything it returns
+*/
+void luaF_initicache (lua_State *L, Proto *f) {
+  int pc, constkey;
+  int accesses = 0;
+  int n = 1;  /* (cache 0) */
+  for (pc = 0; pc < f->sizecode; pc++) {
+    if (tableaccess(f, f->code[pc], &constkey)) {
+      accesses = 1;
+      if (constkey && n < MAXICACHE) n++;
+    }
+  }
+  if (!accesses) return;
+  f->icache = luaM_newvector(L, n, ICache);
+  f->sizeicache = n;
+  for (n = 0; n < f->sizeicache; n++) {
+    f->icache[n].node = -1;
+    f->icache[n].shape = NULL;
+    f->icache[n].chains = NULL;
+  }
+  f->icacheidx = luaM_newvector(L, f->sizecode, unsigned short);
+  for (pc = 0, n = 1; pc < f->sizecode; pc++) {
+    if (tableaccess(f, f->code[pc], &constkey) && constkey &&
+        n < f->sizeicache)
+      f->icacheidx[pc] = cast(unsigned short, n++);
+    else
+      f->icacheidx[pc] = 0;
+  }
+}
+
+
+#if defined(LUA_COVERAGE)
+void luaF_initcoverage (lua_State *L, Proto *f) {
+  int n = luaF_coveragesize(f);
+  f->coverage = luaM_newvector(L, n, lu_byte);
+  memset(f->coverage, 0, n);
+}
+#endif
+
+
 /*
 ** Look for n-th local variable at line `line' in function `func'.
 ** Returns NULL if not found.
@@ -28,6 +28,17 @@ LUAI_FUNC void luaF_freeproto (lua_State *L, Proto *f);
 LUAI_FUNC void luaF_freeupval (lua_State *L, UpVal *uv);
 LUAI_FUNC const char *luaF_getlocalname (const Proto *func, int local_number,
                                          int pc);
+LUAI_FUNC void luaF_initicache (lua_State *L, Proto *f);
+
+#if defined(LUA_COVERAGE)
+#define luaF_coveragesize(f)	(((f)->sizecode + 7) / 8)
+#define luaF_coveragehit(f,pc)	((f)->coverage[(pc) >> 3] & (1 << ((pc) & 7)))
+#define luaF_markcoverage(f,pc) \
+	{ lu_byte *c_ = &(f)->coverage[(pc) >> 3]; \
+	  lu_byte b_ = cast_byte(1 << ((pc) & 7)); \
+	  if (!(*c_ & b_)) *c_ |= b_; }
+LUAI_FUNC void luaF_initcoverage (lua_State *L, Proto *f);
+#endif
 
 
 #endif
@@ -81,6 +81,10 @@
 static void reallymarkobject (global_State *g, GCObject *o);
 
 
+/* report collector work to the profiler (just a test when not profiling) */
+#define gchook(g,ev,b)	{ if ((g)->gchook) (g)->gchook((g)->gchookud, (ev), (b)); }
+
+
 /*
 ** {======================================================
 ** Generic functions
@@ -88,12 +92,6 @@ static void reallymarkobject (global_State *g, GCObject *o);
 */
 
 
-/*
-** one after last element in a hash array
-*/
-#define gnodelast(h)	gnode(h, cast(size_t, sizenode(h)))
-
-
 /*
 ** link table 'h' into list pointed by 'p'
 */
@@ -223,6 +221,18 @@ GCObject *luaC_newobj (lua_State *L, int tt, size_t sz, GCObject **list,
   return o;
 }
 
+
+/*
+** links again an object freed by the collector but kept (see the table
+** pool in ltable.c), as a new object
+*/
+void luaC_relink (lua_State *L, GCObject *o) {
+  global_State *g = G(L);
+  gch(o)->marked = luaC_white(g);
+  gch(o)->next = g->allgc;
+  g->allgc = o;
+}
+
 /* }====================================================== */
 
 
@@ -305,6 +315,32 @@ static void markmt (global_State *g) {
 }
 
 
+/*
+** frees the shapes in list 'p' (and below) that no table has used in this
+** cycle and that have no longer shapes left, and marks the keys of the
+** others. A table gets a shape after its traversal only through 'addslot',
+** which flags it. A generational collection does not traverse old tables,
+** so it keeps all shapes. (Recursion is at most LUAI_MAXSHAPESLOTS deep.)
+*/
+static void sweepshapes (lua_State *L, Shape **p, int keepall) {
+  global_State *g = G(L);
+  Shape *s;
+  while ((s = *p) != NULL) {
+    sweepshapes(L, &s->child, keepall);
+    if (keepall || s->inuse || s->child != NULL) {
+      /* other keys are last keys of shorter shapes */
+      markobject(g, s->keys[s->n - 1]);
+      s->inuse = 0;
+      p = &s->sibling;
+    }
+    else {
+      *p = s->sibling;
+      luaH_freeshape(L, s);
+    }
+  }
+}
+
+
 /*
 ** mark all objects in list of being-finalized
 */
@@ -353,19 +389,27 @@ static void restartcollection (global_State *g) {
 */
 
 static void traverseweakvalue (global_State *g, Table *h) {
-  Node *n, *limit = gnodelast(h);
+  Table *p;
   /* if there is array part, assume it may have white values (do not
      traverse it just to check) */
   int hasclears = (h->sizearray > 0);
-  for (n = gnode(h, 0); n < limit; n++) {
-    checkdeadkey(n);
-    if (ttisnil(gval(n)))  /* entry is empty? */
-      removeentry(n);  /* remove it */
-    else {
-      lua_assert(!ttisnil(gkey(n)));
-      markvalue(g, gkey(n));  /* mark key */
-      if (!hasclears && iscleared(g, gval(n)))  /* is there a white value? */
-        hasclears = 1;  /* table will have to be cleared */
+  int i;
+  for (i = 0; !hasclears && i < numslots(h); i++) {  /* keys are strings */
+    if (iscleared(g, &h->slots[i]))  /* is there a white value? */
+      hasclears = 1;  /* table will have to be cleared */
+  }
+  for (p = h; p != NULL; p = p->old) {  /* hash part and old one */
+    Node *n, *limit = gnodelimit(h, p);
+    for (n = gnode(p, 0); n < limit; n++) {
+      checkdeadkey(n);
+      if (ttisnil(gval(n)))  /* entry is empty? */
+        removeentry(n);  /* remove it */
+      else {
+        lua_assert(!ttisnil(gkey(n)));
+        markvalue(g, gkey(n));  /* mark key */
+        if (!hasclears && iscleared(g, gval(n)))  /* a white value? */
+          hasclears = 1;  /* table will have to be cleared */
+      }
     }
   }
   if (hasclears)
@@ -379,7 +423,7 @@ static int traverseephemeron (global_State *g, Table *h) {
   int marked = 0;  /* true if an object is marked in this traversal */
   int hasclears = 0;  /* true if table has white keys */
   int prop = 0;  /* true if table has entry "white-key -> white-value" */
-  Node *n, *limit = gnodelast(h);
+  Table *p;
   int i;
   /* traverse array part (numeric keys are 'strong') */
   for (i = 0; i < h->sizearray; i++) {
@@ -388,19 +432,29 @@ static int traverseephemeron (global_State *g, Table *h) {
       reallymarkobject(g, gcvalue(&h->array[i]));
     }
   }
-  /* traverse hash part */
-  for (n = gnode(h, 0); n < limit; n++) {
-    checkdeadkey(n);
-    if (ttisnil(gval(n)))  /* entry is empty? */
-      removeentry(n);  /* remove it */
-    else if (iscleared(g, gkey(n))) {  /* key is not marked (yet)? */
-      hasclears = 1;  /* table must be cleared */
-      if (valiswhite(gval(n)))  /* value not marked yet? */
-        prop = 1;  /* must propagate again */
-    }
-    else if (valiswhite(gval(n))) {  /* value not marked yet? */
+  /* traverse shape (string keys are 'strong' too) */
+  for (i = 0; i < numslots(h); i++) {
+    if (valiswhite(&h->slots[i])) {
       marked = 1;
-      reallymarkobject(g, gcvalue(gval(n)));  /* mark it now */
+      reallymarkobject(g, gcvalue(&h->slots[i]));
+    }
+  }
+  /* traverse hash part (and old one) */
+  for (p = h; p != NULL; p = p->old) {
+    Node *n, *limit = gnodelimit(h, p);
+    for (n = gnode(p, 0); n < limit; n++) {
+      checkdeadkey(n);
+      if (ttisnil(gval(n)))  /* entry is empty? */
+        removeentry(n);  /* remove it */
+      else if (iscleared(g, gkey(n))) {  /* key is not marked (yet)? */
+        hasclears = 1;  /* table must be cleared */
+        if (valiswhite(gval(n)))  /* value not marked yet? */
+          prop = 1;  /* must propagate again */
+      }
+      else if (valiswhite(gval(n))) {  /* value not marked yet? */
+        marked = 1;
+        reallymarkobject(g, gcvalue(gval(n)));  /* mark it now */
+      }
     }
   }
   if (prop)
@@ -413,21 +467,41 @@ static int traverseephemeron (global_State *g, Table *h) {
 }
 
 
+/*
+** flags a table with a hash part mostly empty, so that its next new key
+** shrinks it (see 'luaH_newkey'). Not now: shrinking drops the keys with
+** nil values and reorders the others, and 'next' may be going through
+** them, while after a new key 'next' is undefined anyway
+*/
+static void checkshrink (Table *h, int nuse) {
+  h->sparse = (h->old == NULL && sizenode(h) >= LUAI_MINSHRINKSIZE &&
+               nuse <= sizenode(h) / 4);
+}
+
+
 static void traversestrongtable (global_State *g, Table *h) {
-  Node *n, *limit = gnodelast(h);
+  Table *p;
   int i;
+  int nuse = 0;  /* entries in the hash part */
   for (i = 0; i < h->sizearray; i++)  /* traverse array part */
     markvalue(g, &h->array[i]);
-  for (n = gnode(h, 0); n < limit; n++) {  /* traverse hash part */
-    checkdeadkey(n);
-    if (ttisnil(gval(n)))  /* entry is empty? */
-      removeentry(n);  /* remove it */
-    else {
-      lua_assert(!ttisnil(gkey(n)));
-      markvalue(g, gkey(n));  /* mark key */
-      markvalue(g, gval(n));  /* mark value */
+  for (i = 0; i < numslots(h); i++)  /* traverse shape (keys are marked */
+    markvalue(g, &h->slots[i]);      /* with the shapes in use in 'atomic') */
+  for (p = h; p != NULL; p = p->old) {  /* traverse hash part (and old) */
+    Node *n, *limit = gnodelimit(h, p);
+    for (n = gnode(p, 0); n < limit; n++) {
+      checkdeadkey(n);
+      if (ttisnil(gval(n)))  /* entry is empty? */
+        removeentry(n);  /* remove it */
+      else {
+        lua_assert(!ttisnil(gkey(n)));
+        markvalue(g, gkey(n));  /* mark key */
+        markvalue(g, gval(n));  /* mark value */
+        nuse++;
+      }
     }
   }
+  checkshrink(h, nuse);
 }
 
 
@@ -435,6 +509,8 @@ static lu_mem traversetable (global_State *g, Table *h) {
   const char *weakkey, *weakvalue;
   const TValue *mode = gfasttm(g, h->metatable, TM_MODE);
   markobject(g, h->metatable);
+  if (h->shape != NULL)
+    h->shape->inuse = 1;
   if (mode && ttisstring(mode) &&  /* is there a weak mode? */
       ((weakkey = strchr(svalue(mode), 'k')),
        (weakvalue = strchr(svalue(mode), 'v')),
@@ -450,7 +526,10 @@ static lu_mem traversetable (global_State *g, Table *h) {
   else  /* not weak */
     traversestrongtable(g, h);
   return sizeof(Table) + sizeof(TValue) * h->sizearray +
-                         sizeof(Node) * cast(size_t, sizenode(h));
+                         sizeof(TValue) * h->sizeslots +
+                         sizeof(Node) * cast(size_t, sizenode(h)) +
+         ((h->old == NULL) ? 0 : sizeof(Table) +
+                         sizeof(Node) * cast(size_t, sizenode(h->old)));
 }
 
 
@@ -618,11 +697,14 @@ static void convergeephemerons (global_State *g) {
 static void clearkeys (global_State *g, GCObject *l, GCObject *f) {
   for (; l != f; l = gco2t(l)->gclist) {
     Table *h = gco2t(l);
-    Node *n, *limit = gnodelast(h);
-    for (n = gnode(h, 0); n < limit; n++) {
-      if (!ttisnil(gval(n)) && (iscleared(g, gkey(n)))) {
-        setnilvalue(gval(n));  /* remove value ... */
-        removeentry(n);  /* and remove entry from table */
+    Table *p;
+    for (p = h; p != NULL; p = p->old) {  /* hash part and old one */
+      Node *n, *limit = gnodelimit(h, p);
+      for (n = gnode(p, 0); n < limit; n++) {
+        if (!ttisnil(gval(n)) && (iscleared(g, gkey(n)))) {
+          setnilvalue(gval(n));  /* remove value ... */
+          removeentry(n);  /* and remove entry from table */
+        }
       }
     }
   }
@@ -636,17 +718,25 @@ static void clearkeys (global_State *g, GCObject *l, GCObject *f) {
 static void clearvalues (global_State *g, GCObject *l, GCObject *f) {
   for (; l != f; l = gco2t(l)->gclist) {
     Table *h = gco2t(l);
-    Node *n, *limit = gnodelast(h);
+    Table *p;
     int i;
     for (i = 0; i < h->sizearray; i++) {
       TValue *o = &h->array[i];
       if (iscleared(g, o))  /* value was collected? */
         setnilvalue(o);  /* remove value */
     }
-    for (n = gnode(h, 0); n < limit; n++) {
-      if (!ttisnil(gval(n)) && iscleared(g, gval(n))) {
-        setnilvalue(gval(n));  /* remove value ... */
-        removeentry(n);  /* and remove entry from table */
+    for (i = 0; i < numslots(h); i++) {
+      TValue *o = &h->slots[i];
+      if (iscleared(g, o))  /* value was collected? */
+        setnilvalue(o);  /* remove value */
+    }
+    for (p = h; p != NULL; p = p->old) {  /* hash part and old one */
+      Node *n, *limit = gnodelimit(h, p);
+      for (n = gnode(p, 0); n < limit; n++) {
+        if (!ttisnil(gval(n)) && iscleared(g, gval(n))) {
+          setnilvalue(gval(n));  /* remove value ... */
+          removeentry(n);  /* and remove entry from table */
+        }
       }
     }
   }
@@ -1018,6 +1108,8 @@ static l_mem atomic (lua_State *L) {
   work -= g->GCmemtrav;  /* restart counting */
   convergeephemerons(g);
   /* at this point, all resurrected objects are marked. */
+  if (g->rootshape != NULL)  /* free the shapes no table uses */
+    sweepshapes(L, &g->rootshape->child, isgenerational(g));
   /* remove dead objects from weak tables */
   clearkeys(g, g->ephemeron, NULL);  /* clear keys from all ephemeron tables */
   clearkeys(g, g->allweak, NULL);  /* clear keys from all allweak tables */
@@ -1052,7 +1144,9 @@ static lu_mem singlestep (lua_State *L) {
         int sw;
         g->gcstate = GCSatomic;  /* finish mark phase */
         g->GCestimate = g->GCmemtrav;  /* save what was counted */;
+        gchook(g, LUA_GCEVATOMIC, 1);
         work = atomic(L);  /* add what was traversed by 'atomic' */
+        gchook(g, LUA_GCEVATOMIC, 0);
         g->GCestimate += work;  /* estimate of total memory traversed */ 
         sw = entersweep(L);
         return work + sw * GCSWEEPCOST;
@@ -1156,8 +1250,10 @@ static void incstep (lua_State *L) {
 void luaC_forcestep (lua_State *L) {
   global_State *g = G(L);
   int i;
+  gchook(g, LUA_GCEVSTEP, 1);
   if (isgenerational(g)) generationalcollection(L);
   else incstep(L);
+  gchook(g, LUA_GCEVSTEP, 0);
   /* run a few finalizers (or all of them at the end of a collect cycle) */
   for (i = 0; g->tobefnz && (i < GCFINALIZENUM || g->gcstate == GCSpause); i++)
     GCTM(L, 1);  /* call one finalizer */
@@ -1183,6 +1279,7 @@ void luaC_fullgc (lua_State *L, int isemergency) {
   global_State *g = G(L);
   int origkind = g->gckind;
   lua_assert(origkind != KGC_EMERGENCY);
+  gchook(g, LUA_GCEVFULL, 1);
   if (isemergency)  /* do not run finalizers during emergency GC */
     g->gckind = KGC_EMERGENCY;
   else {
@@ -1204,6 +1301,7 @@ void luaC_fullgc (lua_State *L, int isemergency) {
   }
   g->gckind = origkind;
   setpause(g, gettotalbytes(g));
+  gchook(g, LUA_GCEVFULL, 0);
   if (!isemergency)   /* do not run finalizers during emergency GC */
     callallpendingfinalizers(L, 1);
 }
@@ -1211,3 +1309,198 @@ void luaC_fullgc (lua_State *L, int isemergency) {
 /* }====================================================== */
 
 
+
+
+/*
+** {======================================================
+** Heap walk (see lua_walkheap)
+** =======================================================
+*/
+
+typedef struct HeapWalk {
+  lua_HeapObject object;
+  lua_HeapRef ref;
+  void *ud;
+} HeapWalk;
+
+
+static void walkgcref (HeapWalk *w, const void *from, GCObject *o,
+                       const char *name) {
+  if (o != NULL) w->ref(w->ud, from, o, name);
+}
+
+
+static void walkref (HeapWalk *w, const void *from, const TValue *v,
+                     const char *name) {
+  if (iscollectable(v)) w->ref(w->ud, from, gcvalue(v), name);
+}
+
+
+static const char *strname (TString *ts) {
+  return (ts != NULL) ? getstr(ts) : NULL;
+}
+
+
+static void walktable (HeapWalk *w, Table *h) {
+  Table *p;
+  size_t size = sizeof(Table) + sizeof(TValue) * h->sizearray +
+                sizeof(TValue) * h->sizeslots +
+                sizeof(Node) * cast(size_t, sizenode(h));
+  int i;
+  if (h->old != NULL)
+    size += sizeof(Table) + sizeof(Node) * cast(size_t, sizenode(h->old));
+  w->object(w->ud, h, "table", size);
+  walkgcref(w, h, obj2gco(h->metatable), "(metatable)");
+  for (i = 0; i < h->sizearray; i++)
+    walkref(w, h, &h->array[i], NULL);
+  for (i = 0; i < numslots(h); i++) {
+    if (!ttisnil(&h->slots[i])) {
+      TString *key = h->shape->keys[i];
+      walkgcref(w, h, obj2gco(key), "(key)");
+      walkref(w, h, &h->slots[i], getstr(key));
+    }
+  }
+  for (p = h; p != NULL; p = p->old) {  /* hash part and old one */
+    Node *n, *limit = gnodelimit(h, p);
+    for (n = gnode(p, 0); n < limit; n++) {
+      if (!ttisnil(gval(n)) && !ttisdeadkey(gkey(n))) {
+        const char *name = ttisstring(gkey(n)) ? svalue(gkey(n)) : NULL;
+        walkref(w, h, gkey(n), "(key)");
+        walkref(w, h, gval(n), name);
+      }
+    }
+  }
+}
+
+
+static void walkproto (HeapWalk *w, Proto *f) {
+  int i;
+  size_t size = sizeof(Proto) + sizeof(Instruction) * f->sizecode +
+                sizeof(Proto *) * f->sizep + sizeof(TValue) * f->sizek +
+                sizeof(int) * f->sizelineinfo +
+                sizeof(LocVar) * f->sizelocvars +
+                sizeof(Upvaldesc) * f->sizeupvalues;
+  if (f->icache != NULL) {
+    size += sizeof(ICache) * f->sizeicache;
+    for (i = 0; i < f->sizeicache; i++)
+      if (f->icache[i].chains != NULL)
+        size += sizeof(IndexChain) * ICACHE_WAYS;
+  }
+  if (f->icacheidx != NULL)
+    size += sizeof(unsigned short) * f->sizecode;
+  w->object(w->ud, f, "proto", size);
+  walkgcref(w, f, obj2gco(f->source), "(source)");
+  for (i = 0; i < f->sizek; i++)
+    walkref(w, f, &f->k[i], "(constant)");
+  for (i = 0; i < f->sizep; i++)
+    walkgcref(w, f, obj2gco(f->p[i]), "(proto)");
+  for (i = 0; i < f->sizeupvalues; i++)
+    walkgcref(w, f, obj2gco(f->upvalues[i].name), "(name)");
+  for (i = 0; i < f->sizelocvars; i++)
+    walkgcref(w, f, obj2gco(f->locvars[i].varname), "(name)");
+  /* 'cache' is a weak reference */
+}
+
+
+static void walkupval (HeapWalk *w, UpVal *uv) {
+  w->object(w->ud, uv, "upvalue", sizeof(UpVal));
+  walkref(w, uv, uv->v, NULL);
+}
+
+
+static void walkthread (HeapWalk *w, lua_State *th) {
+  StkId o;
+  CallInfo *ci;
+  GCObject *uv;
+  size_t size = sizeof(lua_State) + sizeof(TValue) * th->stacksize;
+  for (ci = th->base_ci.next; ci != NULL; ci = ci->next)
+    size += sizeof(CallInfo);
+  w->object(w->ud, th, "thread", size);
+  for (o = th->stack; o < th->top; o++)
+    walkref(w, th, o, NULL);
+  /* open upvalues live in the thread, not in 'allgc' */
+  for (uv = th->openupval; uv != NULL; uv = gch(uv)->next) {
+    walkupval(w, gco2uv(uv));
+    walkgcref(w, th, uv, "(open upvalue)");
+  }
+}
+
+
+static void walkobject (HeapWalk *w, global_State *g, GCObject *o) {
+  int i;
+  if (isdead(g, o)) return;  /* garbage not swept yet */
+  switch (gch(o)->tt) {
+    case LUA_TSHRSTR: case LUA_TLNGSTR:
+      w->object(w->ud, o, "string", sizestring(gco2ts(o)));
+      break;
+    case LUA_TTABLE:
+      walktable(w, gco2t(o));
+      break;
+    case LUA_TLCL: {
+      LClosure *cl = gco2lcl(o);
+      w->object(w->ud, o, "function", sizeLclosure(cl->nupvalues));
+      walkgcref(w, o, obj2gco(cl->p), "(proto)");
+      for (i = 0; i < cl->nupvalues; i++)
+        walkgcref(w, o, obj2gco(cl->upvals[i]),
+                  (i < cl->p->sizeupvalues) ? strname(cl->p->upvalues[i].name)
+                                            : NULL);
+      break;
+    }
+    case LUA_TCCL: {
+      CClosure *cl = gco2ccl(o);
+      w->object(w->ud, o, "cfunction", sizeCclosure(cl->nupvalues));
+      for (i = 0; i < cl->nupvalues; i++)
+        walkref(w, o, &cl->upvalue[i], NULL);
+      break;
+    }
+    case LUA_TUSERDATA: {
+      Udata *u = rawgco2u(o);
+      w->object(w->ud, o, "userdata", sizeudata(gco2u(o)));
+      walkgcref(w, o, obj2gco(u->uv.metatable), "(metatable)");
+      walkgcref(w, o, obj2gco(u->uv.env), "(uservalue)");
+      break;
+    }
+    case LUA_TTHREAD:
+      walkthread(w, gco2th(o));
+      break;
+    case LUA_TPROTO:
+      walkproto(w, gco2p(o));
+      break;
+    case LUA_TUPVAL:
+      walkupval(w, gco2uv(o));
+      break;
+    default: lua_assert(0);
+  }
+}
+
+
+static void walklist (HeapWalk *w, global_State *g, GCObject *o) {
+  for (; o != NULL; o = gch(o)->next)
+    walkobject(w, g, o);
+}
+
+
+void luaC_walkheap (lua_State *L, lua_HeapObject object, lua_HeapRef ref,
+                    void *ud) {
+  global_State *g = G(L);
+  HeapWalk w;
+  int i;
+  w.object = object;
+  w.ref = ref;
+  w.ud = ud;
+  /* roots */
+  ref(ud, NULL, g->mainthread, "(main thread)");
+  walkref(&w, NULL, &g->l_registry, "(registry)");
+  for (i = 0; i < LUA_NUMTAGS; i++)
+    walkgcref(&w, NULL, obj2gco(g->mt[i]), "(type metatable)");
+  /* objects */
+  walkobject(&w, g, obj2gco(g->mainthread));
+  walklist(&w, g, g->allgc);
+  walklist(&w, g, g->finobj);
+  walklist(&w, g, g->tobefnz);
+  for (i = 0; i < g->strt.size; i++)
+    walklist(&w, g, g->strt.hash[i]);
+}
+
+/* }====================================================== */
+
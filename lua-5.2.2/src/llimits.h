@@ -151,6 +151,13 @@ typedef lu_int32 Instruction;
 #endif
 
 
+/* the collector flags for shrinking hash parts of at least
+   LUAI_MINSHRINKSIZE nodes, at most a quarter in use */
+#if !defined(LUAI_MINSHRINKSIZE)
+#define LUAI_MINSHRINKSIZE	64
+#endif
+
+
 #if !defined(lua_lock)
 #define lua_lock(L)     ((void) 0)
 #define lua_unlock(L)   ((void) 0)
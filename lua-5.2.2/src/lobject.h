@@ -480,9 +480,15 @@ typedef struct Proto {
   int sizelineinfo;
   int sizep;  /* size of `p' */
   int sizelocvars;
+  int sizeicache;  /* size of 'icache' */
   int linedefined;
   int lastlinedefined;
   GCObject *gclist;
+  struct ICache *icache;  /* inline caches of table accesses (see lvm.c) */
+  unsigned short *icacheidx;  /* index in 'icache' per instruction */
+#if defined(LUA_COVERAGE)
+  lu_byte *coverage;  /* bit per instruction executed (NULL until first call) */
+#endif
   lu_byte numparams;  /* number of fixed parameters */
   lu_byte is_vararg;
   lu_byte maxstacksize;  /* maximum stack used by this function */
@@ -557,19 +563,67 @@ typedef struct Node {
 } Node;
 
 
+/*
+** Shapes of tables (see ltable.c)
+*/
+typedef struct Shape {
+  struct Shape *child;  /* first shape with one more key than this one */
+  struct Shape *sibling;  /* next shape with the same parent */
+  int n;  /* number of keys */
+  lu_byte inuse;  /* some table had it in this GC cycle (see 'sweepshapes') */
+  TString *keys[1];  /* keys, in the order of their slots */
+} Shape;
+
+#define sizeShape(n)	(sizeof(Shape) + sizeof(TString *) * ((n) > 0 ? (n)-1 : 0))
+
+
 typedef struct Table {
   CommonHeader;
   lu_byte flags;  /* 1<<p means tagmethod(p) is not present */
   lu_byte lsizenode;  /* log2 of size of `node' array */
+  lu_byte incache;  /* true if some __index chain cache refers to it */
+  lu_byte sizeslots;  /* size of `slots' array */
+  lu_byte sparse;  /* true if the collector found the hash part mostly empty */
   struct Table *metatable;
   TValue *array;  /* array part */
   Node *node;
   Node *lastfree;  /* any free position is before this position */
+  Shape *shape;  /* keys of `slots' (NULL if keys are in `node') */
+  TValue *slots;  /* values of the keys in `shape' */
+  struct Table *old;  /* previous hash part, during an incremental rehash */
   GCObject *gclist;
   int sizearray;  /* size of `array' array */
+  int border;  /* hint for `#': a border of the array part, if still true */
+  unsigned int epoch;  /* changes whenever a string key or the metatable does */
 } Table;
 
 
+/*
+** Inline caches of an instruction (see lvm.c)
+*/
+#define ICACHE_WAYS	4	/* metatables remembered by an instruction */
+#define ICACHE_DEPTH	3	/* __index tables followed */
+
+typedef struct IndexChain {
+  Table *mt;  /* metatable of the indexed value */
+  Table *holder;  /* last __index table, where the key was found */
+  int node;  /* index of the key's node in 'holder' ... */
+  Shape *shape;  /* ... or shape of 'holder' and the key's slot */
+  int slot;
+  Table *t[2 * ICACHE_DEPTH - 1];  /* metatables and __index tables before */
+  unsigned int epoch[2 * ICACHE_DEPTH - 1];  /* ...and their epochs */
+  unsigned int gen;  /* 'icachegen' when filled */
+  int n;  /* number of tables in 't' */
+} IndexChain;
+
+typedef struct ICache {
+  int node;  /* index of the node where the key was last found ... */
+  Shape *shape;  /* ... or shape of the table and the key's slot */
+  int slot;
+  IndexChain *chains;  /* ICACHE_WAYS chains (NULL until needed) */
+} ICache;
+
+
 
 /*
 ** `module' operation for hashing (size is always a power of 2)
@@ -184,6 +184,7 @@ static void f_luaopen (lua_State *L, void *ud) {
   global_State *g = G(L);
   UNUSED(ud);
   stack_init(L, L);  /* init stack */
+  luaH_initshapes(L);
   init_registry(L, g);
   luaS_resize(L, MINSTRTABSIZE);  /* initial size of string table */
   luaT_init(L);
@@ -222,6 +223,8 @@ static void close_state (lua_State *L) {
   global_State *g = G(L);
   luaF_close(L, L->stack);  /* close all upvalues for this thread */
   luaC_freeallobjects(L);  /* collect all objects */
+  luaH_setpool(L, 0);  /* free pooled tables */
+  luaH_freeshapes(L);
   luaM_freearray(L, G(L)->strt.hash, G(L)->strt.size);
   luaZ_freebuffer(L, &g->buff);
   freestack(L);
@@ -277,16 +280,25 @@ LUA_API lua_State *lua_newstate (lua_Alloc f, void *ud) {
   g->ud = ud;
   g->mainthread = L;
   g->seed = makeseed(L);
+  g->icachegen = 0;
+  g->rootshape = NULL;
+  g->nshapes = 0;
+  g->tablepool = NULL;
+  g->ntablepool = g->maxtablepool = 0;
+  memset(&g->tablepoolstats, 0, sizeof(g->tablepoolstats));
   g->uvhead.u.l.prev = &g->uvhead;
   g->uvhead.u.l.next = &g->uvhead;
   g->gcrunning = 0;  /* no GC while building state */
   g->GCestimate = 0;
   g->strt.size = 0;
   g->strt.nuse = 0;
+  g->strt.splitsize = g->strt.nsplit = 0;
   g->strt.hash = NULL;
   setnilvalue(&g->l_registry);
   luaZ_initbuffer(L, &g->buff);
   g->panic = NULL;
+  g->gchook = NULL;
+  g->gchookud = NULL;
   g->version = lua_version(NULL);
   g->gcstate = GCSpause;
   g->allgc = NULL;
@@ -60,6 +60,8 @@ typedef struct stringtable {
   GCObject **hash;
   lu_int32 nuse;  /* number of elements */
   int size;
+  int splitsize;  /* size before growing, while it grows (see lstring.c) */
+  int nsplit;  /* buckets of 'splitsize' already split */
 } stringtable;
 
 
@@ -119,6 +121,13 @@ typedef struct global_State {
   stringtable strt;  /* hash table for strings */
   TValue l_registry;
   unsigned int seed;  /* randomized seed for hashes */
+  unsigned int icachegen;  /* changes whenever a table 'incache' is freed */
+  Shape *rootshape;  /* shape of new tables, root of all shapes (or NULL) */
+  int nshapes;  /* number of shapes */
+  struct Table *tablepool;  /* freed tables kept for reuse (see ltable.c) */
+  int ntablepool;  /* number of tables in 'tablepool' */
+  int maxtablepool;  /* most tables 'tablepool' keeps (0: no pool) */
+  lua_TablePoolStats tablepoolstats;
   lu_byte currentwhite;
   lu_byte gcstate;  /* state of garbage collector */
   lu_byte gckind;  /* kind of GC running */
@@ -140,6 +149,8 @@ typedef struct global_State {
   int gcmajorinc;  /* pause between major collections (only in gen. mode) */
   int gcstepmul;  /* GC `granularity' */
   lua_CFunction panic;  /* to be called in unprotected errors */
+  lua_GCHook gchook;  /* GC event hook (NULL when not profiling) */
+  void *gchookud;  /* auxiliary data to 'gchook' */
   struct lua_State *mainthread;
   const lua_Number *version;  /* pointer to version number */
   TString *memerrmsg;  /* memory-error message */
@@ -19,11 +19,12 @@
 
 
 /*
-** Lua will use at most ~(2^LUAI_HASHLIMIT) bytes from a string to
-** compute its hash
+** buckets moved to their place in a grown string table for each new
+** string, while the table grows (at least 2, so that growing is over
+** before the table is crowded again)
 */
-#if !defined(LUAI_HASHLIMIT)
-#define LUAI_HASHLIMIT		5
+#if !defined(LUAI_STRSPLITSTEP)
+#define LUAI_STRSPLITSTEP	4
 #endif
 
 
@@ -48,24 +49,96 @@ int luaS_eqstr (TString *a, TString *b) {
 }
 
 
+/*
+** MurmurHash3 (32 bits) of the whole string, 4 bytes at a time, so that
+** strings differing anywhere get unrelated hashes; 'seed' is the state's
+** (or, for a long string, the one it got when created)
+*/
+#define rotl(x,n)	(((x) << (n)) | ((x) >> (32 - (n))))
+#define mixword(k)	(rotl((k) * 0xcc9e2d51u, 15) * 0x1b873593u)
+
 unsigned int luaS_hash (const char *str, size_t l, unsigned int seed) {
+  const unsigned char *s = cast(const unsigned char *, str);
   unsigned int h = seed ^ cast(unsigned int, l);
-  size_t l1;
-  size_t step = (l >> LUAI_HASHLIMIT) + 1;
-  for (l1 = l; l1 >= step; l1 -= step)
-    h = h ^ ((h<<5) + (h>>2) + cast_byte(str[l1 - 1]));
+  unsigned int k;
+  size_t i;
+  int shift;
+  for (i = 0; i + 4 <= l; i += 4) {
+    memcpy(&k, s + i, 4);
+    h ^= mixword(k);
+    h = rotl(h, 13) * 5 + 0xe6546b64u;
+  }
+  for (k = 0, shift = 0; i < l; i++, shift += 8)  /* last 1-3 bytes */
+    k |= cast(unsigned int, s[i]) << shift;
+  if (shift > 0)
+    h ^= mixword(k);
+  h ^= h >> 16;
+  h *= 0x85ebca6bu;
+  h ^= h >> 13;
+  h *= 0xc2b2ae35u;
+  h ^= h >> 16;
   return h;
 }
 
 
 /*
-** resizes the string table
+** The string table grows by doubling its size incrementally: a string
+** of bucket 'i' of the old size goes to 'i' or 'i + splitsize' of the
+** new one, so buckets below 'nsplit' are in place and the others still
+** keep their strings by the old size. Strings only move up, so sweeping
+** in the middle of it misses none.
+*/
+#define bucket(tb,h) \
+	(((tb)->splitsize != 0 && \
+	  lmod(h, (tb)->splitsize) >= (tb)->nsplit) ? \
+	 &(tb)->hash[lmod(h, (tb)->splitsize)] : &(tb)->hash[lmod(h, (tb)->size)])
+
+
+/*
+** moves the strings of up to 'n' buckets of the old size to their place
+*/
+static void splitbuckets (stringtable *tb, int n) {
+  while (tb->splitsize != 0 && n-- > 0) {
+    int i = tb->nsplit++;
+    GCObject *p = tb->hash[i];
+    tb->hash[i] = NULL;
+    while (p) {  /* for each node in the list */
+      GCObject *next = gch(p)->next;  /* save next */
+      unsigned int h = lmod(gco2ts(p)->hash, tb->size);  /* new position */
+      gch(p)->next = tb->hash[h];  /* chain it */
+      tb->hash[h] = p;
+      resetoldbit(p);  /* see MOVE OLD rule */
+      p = next;
+    }
+    if (tb->nsplit == tb->splitsize)  /* all buckets in place? */
+      tb->splitsize = 0;
+  }
+}
+
+
+/*
+** doubles the size of the string table, leaving its strings where they
+** are (see 'bucket')
+*/
+static void growstrtab (lua_State *L, stringtable *tb) {
+  int i;
+  luaM_reallocvector(L, tb->hash, tb->size, tb->size * 2, GCObject *);
+  for (i = tb->size; i < tb->size * 2; i++) tb->hash[i] = NULL;
+  tb->splitsize = tb->size;
+  tb->nsplit = 0;
+  tb->size *= 2;
+}
+
+
+/*
+** resizes the string table at once
 */
 void luaS_resize (lua_State *L, int newsize) {
   int i;
   stringtable *tb = &G(L)->strt;
   /* cannot resize while GC is traversing strings */
   luaC_runtilstate(L, ~bitmask(GCSsweepstring));
+  splitbuckets(tb, MAX_INT);  /* finish growing */
   if (newsize > tb->size) {
     luaM_reallocvector(L, tb->hash, tb->size, newsize, GCObject *);
     for (i = tb->size; i < newsize; i++) tb->hash[i] = NULL;
@@ -118,9 +191,11 @@ static TString *newshrstr (lua_State *L, const char *str, size_t l,
   GCObject **list;  /* (pointer to) list where it will be inserted */
   stringtable *tb = &G(L)->strt;
   TString *s;
-  if (tb->nuse >= cast(lu_int32, tb->size) && tb->size <= MAX_INT/2)
-    luaS_resize(L, tb->size*2);  /* too crowded */
-  list = &tb->hash[lmod(h, tb->size)];
+  if (tb->splitsize != 0)  /* growing? */
+    splitbuckets(tb, LUAI_STRSPLITSTEP);
+  else if (tb->nuse >= cast(lu_int32, tb->size) && tb->size <= MAX_INT/2)
+    growstrtab(L, tb);  /* too crowded */
+  list = bucket(tb, h);
   s = createstrobj(L, str, l, LUA_TSHRSTR, h, list);
   tb->nuse++;
   return s;
@@ -134,7 +209,7 @@ static TString *internshrstr (lua_State *L, const char *str, size_t l) {
   GCObject *o;
   global_State *g = G(L);
   unsigned int h = luaS_hash(str, l, g->seed);
-  for (o = g->strt.hash[lmod(h, g->strt.size)];
+  for (o = *bucket(&g->strt, h);
        o != NULL;
        o = gch(o)->next) {
     TString *ts = rawgco2ts(o);
@@ -105,18 +105,21 @@ static int str_upper (lua_State *L) {
 /* reasonable limit to avoid arithmetic overflow */
 #define MAXSIZE		((~(size_t)0) >> 1)
 
-static int str_rep (lua_State *L) {
+/*
+** adds to 'b' the copies of the string at 'arg' asked by the arguments
+** after it (count and separator)
+*/
+static void addrep (lua_State *L, luaL_Buffer *b, int arg) {
   size_t l, lsep;
-  const char *s = luaL_checklstring(L, 1, &l);
-  int n = luaL_checkint(L, 2);
-  const char *sep = luaL_optlstring(L, 3, "", &lsep);
-  if (n <= 0) lua_pushliteral(L, "");
+  const char *s = luaL_checklstring(L, arg, &l);
+  int n = luaL_checkint(L, arg + 1);
+  const char *sep = luaL_optlstring(L, arg + 2, "", &lsep);
+  if (n <= 0) return;
   else if (l + lsep < l || l + lsep >= MAXSIZE / n)  /* may overflow? */
-    return luaL_error(L, "resulting string too large");
+    luaL_error(L, "resulting string too large");
   else {
     size_t totallen = n * l + (n - 1) * lsep;
-    luaL_Buffer b;
-    char *p = luaL_buffinitsize(L, &b, totallen);
+    char *p = luaL_prepbuffsize(b, totallen);
     while (n-- > 1) {  /* first n-1 copies (followed by separator) */
       memcpy(p, s, l * sizeof(char)); p += l;
       if (lsep > 0) {  /* avoid empty 'memcpy' (may be expensive) */
@@ -124,8 +127,16 @@ static int str_rep (lua_State *L) {
       }
     }
     memcpy(p, s, l * sizeof(char));  /* last copy (not followed by separator) */
-    luaL_pushresultsize(&b, totallen);
+    luaL_addsize(b, totallen);
   }
+}
+
+
+static int str_rep (lua_State *L) {
+  luaL_Buffer b;
+  luaL_buffinit(L, &b);
+  addrep(L, &b, 1);
+  luaL_pushresult(&b);
   return 1;
 }
 
@@ -889,22 +900,22 @@ static void addlenmod (char *form, const char *lenmod) {
 }
 
 
-static int str_format (lua_State *L) {
-  int top = lua_gettop(L);
-  int arg = 1;
+/*
+** adds to 'b' the format at 'arg' applied to the values after it, up to
+** 'top'
+*/
+static void addformat (lua_State *L, luaL_Buffer *b, int arg, int top) {
   size_t sfl;
   const char *strfrmt = luaL_checklstring(L, arg, &sfl);
   const char *strfrmt_end = strfrmt+sfl;
-  luaL_Buffer b;
-  luaL_buffinit(L, &b);
   while (strfrmt < strfrmt_end) {
     if (*strfrmt != L_ESC)
-      luaL_addchar(&b, *strfrmt++);
+      luaL_addchar(b, *strfrmt++);
     else if (*++strfrmt == L_ESC)
-      luaL_addchar(&b, *strfrmt++);  /* %% */
+      luaL_addchar(b, *strfrmt++);  /* %% */
     else { /* format item */
       char form[MAX_FORMAT];  /* to store the format (`%...') */
-      char *buff = luaL_prepbuffsize(&b, MAX_ITEM);  /* to put formatted item */
+      char *buff = luaL_prepbuffsize(b, MAX_ITEM);  /* to put formatted item */
       int nb = 0;  /* number of bytes in added item */
       if (++arg > top)
         luaL_argerror(L, arg, "no value");
@@ -944,7 +955,7 @@ static int str_format (lua_State *L) {
           break;
         }
         case 'q': {
-          addquoted(L, &b, arg);
+          addquoted(L, b, arg);
           break;
         }
         case 's': {
@@ -953,7 +964,7 @@ static int str_format (lua_State *L) {
           if (!strchr(form, '.') && l >= 100) {
             /* no precision and string is too long to be formatted;
                keep original string */
-            luaL_addvalue(&b);
+            luaL_addvalue(b);
             break;
           }
           else {
@@ -963,13 +974,22 @@ static int str_format (lua_State *L) {
           }
         }
         default: {  /* also treat cases `pnLlh' */
-          return luaL_error(L, "invalid option " LUA_QL("%%%c") " to "
-                               LUA_QL("format"), *(strfrmt - 1));
+          luaL_error(L, "invalid option " LUA_QL("%%%c") " to "
+                        LUA_QL("format"), *(strfrmt - 1));
+          break;
         }
       }
-      luaL_addsize(&b, nb);
+      luaL_addsize(b, nb);
     }
   }
+}
+
+
+static int str_format (lua_State *L) {
+  int top = lua_gettop(L);
+  luaL_Buffer b;
+  luaL_buffinit(L, &b);
+  addformat(L, &b, 1, top);
   luaL_pushresult(&b);
   return 1;
 }
@@ -977,6 +997,161 @@ static int str_format (lua_State *L) {
 /* }====================================================== */
 
 
+/*
+** {======================================================
+** STRBUF
+** =======================================================
+*/
+
+/*
+** A strbuf keeps its characters in a userdata, the first element of its
+** uservalue, and adds to them with the functions of luaL_Buffer: pushed
+** on the top of the stack, that userdata is the one the luaL_Buffer
+** takes as its own, and the one it replaces when it must grow (by twice
+** the size). So appending to a strbuf takes no string but the pieces.
+*/
+
+#define STRBUFHANDLE	"strbuf"
+
+/* size of the characters of a new strbuf */
+#define MINSTRBUF	32
+
+typedef struct StrBuf {
+  char *b;  /* characters (in the userdata) */
+  size_t size;  /* size of that userdata */
+  size_t n;  /* number of characters in use */
+} StrBuf;
+
+#define tostrbuf(L)	((StrBuf *)luaL_checkudata(L, 1, STRBUFHANDLE))
+
+
+/*
+** gets 'b' ready to add to the strbuf at index 1, pushing its characters
+*/
+static StrBuf *openbuf (lua_State *L, luaL_Buffer *b) {
+  StrBuf *sb = tostrbuf(L);
+  lua_getuservalue(L, 1);
+  lua_rawgeti(L, -1, 1);  /* characters */
+  lua_remove(L, -2);
+  luaL_buffinit(L, b);
+  b->b = sb->b;
+  b->size = sb->size;
+  b->n = sb->n;
+  return sb;
+}
+
+
+/*
+** keeps in the strbuf what was added to 'b', whose characters (new ones
+** if it grew) are on the top; returns the strbuf
+*/
+static int closebuf (lua_State *L, StrBuf *sb, luaL_Buffer *b) {
+  if (b->b != sb->b) {  /* did it grow? */
+    lua_getuservalue(L, 1);
+    lua_insert(L, -2);
+    lua_rawseti(L, -2, 1);  /* keep new characters */
+    sb->b = b->b;
+    sb->size = b->size;
+  }
+  lua_pop(L, 1);
+  sb->n = b->n;
+  lua_settop(L, 1);
+  return 1;
+}
+
+
+static int strbuf_new (lua_State *L) {
+  StrBuf *sb = (StrBuf *)lua_newuserdata(L, sizeof(StrBuf));
+  sb->b = NULL;
+  sb->size = sb->n = 0;
+  luaL_setmetatable(L, STRBUFHANDLE);
+  lua_createtable(L, 1, 0);
+  sb->b = (char *)lua_newuserdata(L, MINSTRBUF * sizeof(char));
+  sb->size = MINSTRBUF;
+  lua_rawseti(L, -2, 1);
+  lua_setuservalue(L, -2);
+  return 1;
+}
+
+
+static int strbuf_append (lua_State *L) {
+  int top = lua_gettop(L);
+  int i;
+  luaL_Buffer b;
+  StrBuf *sb = openbuf(L, &b);
+  for (i = 2; i <= top; i++) {
+    size_t l;
+    const char *s = luaL_checklstring(L, i, &l);
+    luaL_addlstring(&b, s, l);
+  }
+  return closebuf(L, sb, &b);
+}
+
+
+static int strbuf_appendf (lua_State *L) {
+  int top = lua_gettop(L);
+  luaL_Buffer b;
+  StrBuf *sb = openbuf(L, &b);
+  addformat(L, &b, 2, top);
+  return closebuf(L, sb, &b);
+}
+
+
+static int strbuf_rep (lua_State *L) {
+  luaL_Buffer b;
+  StrBuf *sb;
+  lua_settop(L, 4);  /* no separator is nil, not the pushed characters */
+  sb = openbuf(L, &b);
+  addrep(L, &b, 2);
+  return closebuf(L, sb, &b);
+}
+
+
+static int strbuf_clear (lua_State *L) {
+  StrBuf *sb = tostrbuf(L);
+  sb->n = 0;  /* keep the characters for what comes next */
+  lua_settop(L, 1);
+  return 1;
+}
+
+
+static int strbuf_len (lua_State *L) {
+  StrBuf *sb = tostrbuf(L);
+  lua_pushinteger(L, (lua_Integer)sb->n);
+  return 1;
+}
+
+
+static int strbuf_tostring (lua_State *L) {
+  StrBuf *sb = tostrbuf(L);
+  lua_pushlstring(L, sb->b, sb->n);
+  return 1;
+}
+
+
+static const luaL_Reg sblib[] = {
+  {"append", strbuf_append},
+  {"appendf", strbuf_appendf},
+  {"clear", strbuf_clear},
+  {"rep", strbuf_rep},
+  {"tostring", strbuf_tostring},
+  {"__len", strbuf_len},
+  {"__tostring", strbuf_tostring},
+  {NULL, NULL}
+};
+
+
+static void createstrbufmeta (lua_State *L) {
+  luaL_newmetatable(L, STRBUFHANDLE);  /* create metatable for strbufs */
+  lua_pushvalue(L, -1);  /* push metatable */
+  lua_setfield(L, -2, "__index");  /* metatable.__index = metatable */
+  luaL_setfuncs(L, sblib, 0);  /* add strbuf methods to new metatable */
+  lua_pop(L, 1);  /* pop new metatable */
+}
+
+/* }====================================================== */
+
+
 static const luaL_Reg strlib[] = {
   {"byte", str_byte},
   {"char", str_char},
@@ -990,6 +1165,7 @@ static const luaL_Reg strlib[] = {
   {"match", str_match},
   {"rep", str_rep},
   {"reverse", str_reverse},
+  {"strbuf", strbuf_new},
   {"sub", str_sub},
   {"upper", str_upper},
   {NULL, NULL}
@@ -1014,6 +1190,7 @@ static void createmetatable (lua_State *L) {
 LUAMOD_API int luaopen_string (lua_State *L) {
   luaL_newlib(L, strlib);
   createmetatable(L);
+  createstrbufmeta(L);
   return 1;
 }
 
@@ -16,6 +16,11 @@
 ** in its main position (i.e. the `original' position that its hash gives
 ** to it), then the colliding element is in its own main position.
 ** Hence even when the load factor reaches 100%, performance remains good.
+** Optionally the hash part uses open addressing probed through control
+** bytes instead (see LUA_USE_SWISSTABLE below).
+** A table whose hash part would only hold short strings may instead keep
+** them in a shape (see below). A large hash part grows incrementally: the
+** old one stays in use while new keys move its nodes to the new one.
 */
 
 #include <string.h>
@@ -48,6 +53,52 @@
 #define MAXASIZE	(1 << MAXBITS)
 
 
+/*
+** returns the index for `key' if `key' is an appropriate key to live in
+** the array part of the table, -1 otherwise.
+*/
+static int arrayindex (const TValue *key) {
+  if (ttisnumber(key)) {
+    lua_Number n = nvalue(key);
+    int k;
+    lua_number2int(k, n);
+    if (luai_numeq(cast_num(k), n))
+      return k;
+  }
+  return -1;  /* `key' did not match some condition */
+}
+
+
+
+/*
+** {=============================================================
+** Hash part
+** ==============================================================
+*/
+
+/*
+** The hash part is a chained scatter table with Brent's variation or,
+** defining LUA_USE_SWISSTABLE as 1, an open addressing table probed
+** through a vector of control bytes, matching a whole group of them at
+** once with SSE2 or NEON when the compiler targets either. The latter
+** follows no chains but mixes hashes, so keys made in sequence (integers,
+** objects allocated together) lose the locality chains give them. Both
+** give the same interface: 'dummynode', 'isdummy', 'mainposition', the
+** search functions (for a part alone, without 'old'), 'findnode' (for
+** traversals), 'setnodevector', 'clearnodes' (which empties a part),
+** 'freenodes', 'maxload' and 'insertkey' (which assumes the key is not in
+** 't').
+*/
+#if !defined(LUA_USE_SWISSTABLE)
+#define LUA_USE_SWISSTABLE	0
+#endif
+
+
+static void rehash (lua_State *L, Table *t, const TValue *ek);
+
+
+#if !LUA_USE_SWISSTABLE  /* { */
+
 #define hashpow2(t,n)		(gnode(t, lmod((n), sizenode(t))))
 
 #define hashstr(t,str)		hashpow2(t, (str)->tsv.hash)
@@ -121,25 +172,635 @@ static Node *mainposition (const Table *t, const TValue *key) {
 
 
 /*
-** returns the index for `key' if `key' is an appropriate key to live in
-** the array part of the table, -1 otherwise.
+** search functions for the hash part of 't' alone (or for an old hash
+** part); return NULL if the key is not there
 */
-static int arrayindex (const TValue *key) {
-  if (ttisnumber(key)) {
-    lua_Number n = nvalue(key);
-    int k;
-    lua_number2int(k, n);
-    if (luai_numeq(cast_num(k), n))
-      return k;
+static Node *searchint (const Table *t, lua_Number nk) {
+  Node *n = hashnum(t, nk);
+  do {  /* check whether `key' is somewhere in the chain */
+    if (ttisnumber(gkey(n)) && luai_numeq(nvalue(gkey(n)), nk))
+      return n;  /* that's it */
+    else n = gnext(n);
+  } while (n);
+  return NULL;
+}
+
+
+static Node *searchshrstr (const Table *t, TString *key) {
+  Node *n = hashstr(t, key);
+  do {  /* check whether `key' is somewhere in the chain */
+    if (ttisshrstring(gkey(n)) && eqshrstr(rawtsvalue(gkey(n)), key))
+      return n;  /* that's it */
+    else n = gnext(n);
+  } while (n);
+  return NULL;
+}
+
+
+static Node *searchgeneric (const Table *t, const TValue *key) {
+  Node *n = mainposition(t, key);
+  do {  /* check whether `key' is somewhere in the chain */
+    if (luaV_rawequalobj(gkey(n), key))
+      return n;  /* that's it */
+    else n = gnext(n);
+  } while (n);
+  return NULL;
+}
+
+
+static Node *findnode (const Table *t, StkId key) {
+  Node *n = mainposition(t, key);
+  do {  /* check whether `key' is somewhere in the chain */
+    /* key may be dead already, but it is ok to use it in `next' */
+    if (luaV_rawequalobj(gkey(n), key) ||
+          (ttisdeadkey(gkey(n)) && iscollectable(key) &&
+           deadvalue(gkey(n)) == gcvalue(key)))
+      return n;
+    else n = gnext(n);
+  } while (n);
+  return NULL;
+}
+
+
+static void clearnodes (Table *t) {
+  int i;
+  int size = sizenode(t);
+  for (i=0; i<size; i++) {
+    Node *n = gnode(t, i);
+    gnext(n) = NULL;
+    setnilvalue(gkey(n));
+    setnilvalue(gval(n));
   }
-  return -1;  /* `key' did not match some condition */
+  t->lastfree = gnode(t, size);  /* all positions are free */
+}
+
+
+static void setnodevector (lua_State *L, Table *t, int size) {
+  int lsize;
+  if (size == 0) {  /* no elements to hash part? */
+    t->node = cast(Node *, dummynode);  /* use common `dummynode' */
+    lsize = 0;
+  }
+  else {
+    lsize = luaO_ceillog2(size);
+    if (lsize > MAXBITS)
+      luaG_runerror(L, "table overflow");
+    size = twoto(lsize);
+    t->node = luaM_newvector(L, size, Node);
+  }
+  t->lsizenode = cast_byte(lsize);
+  if (!isdummy(t->node))
+    clearnodes(t);
+  else
+    t->lastfree = t->node;  /* no free positions */
+}
+
+
+#define sizenodes(size)	(sizeof(Node) * (size))
+#define freenodes(L,n,size)	luaM_freearray(L, n, cast(size_t, size))
+
+/* keys a part of 'size' nodes may take (chains fill it up) */
+#define maxload(size)	(size)
+
+
+static Node *getfreepos (Table *t) {
+  while (t->lastfree > t->node) {
+    t->lastfree--;
+    if (ttisnil(gkey(t->lastfree)))
+      return t->lastfree;
+  }
+  return NULL;  /* could not find a free place */
+}
+
+
+/*
+** inserts a new key into a hash table; first, check whether key's main
+** position is free. If not, check whether colliding node is in its main
+** position or not: if it is not, move colliding node to an empty place and
+** put new key in its main position; otherwise (colliding node is in its main
+** position), new key goes to an empty position.
+*/
+static TValue *insertkey (lua_State *L, Table *t, const TValue *key) {
+  Node *mp = mainposition(t, key);
+  if (!ttisnil(gval(mp)) || isdummy(mp)) {  /* main position is taken? */
+    Node *othern;
+    Node *n = getfreepos(t);  /* get a free place */
+    if (n == NULL) {  /* cannot find a free place? */
+      rehash(L, t, key);  /* grow table */
+      /* whatever called 'newkey' take care of TM cache and GC barrier */
+      return luaH_set(L, t, key);  /* insert key into grown table */
+    }
+    lua_assert(!isdummy(n));
+    othern = mainposition(t, gkey(mp));
+    if (othern != mp) {  /* is colliding node out of its main position? */
+      /* yes; move colliding node into free position */
+      while (gnext(othern) != mp) othern = gnext(othern);  /* find previous */
+      gnext(othern) = n;  /* redo the chain with `n' in place of `mp' */
+      *n = *mp;  /* copy colliding node into free pos. (mp->next also goes) */
+      gnext(mp) = NULL;  /* now `mp' is free */
+      setnilvalue(gval(mp));
+    }
+    else {  /* colliding node is in its own main position */
+      /* new node will go into free position */
+      gnext(n) = gnext(mp);  /* chain new position */
+      gnext(mp) = n;
+      mp = n;
+    }
+  }
+  setobj2t(L, gkey(mp), key);
+  luaC_barrierback(L, obj2gco(t), key);
+  lua_assert(ttisnil(gval(mp)));
+  return gval(mp);
+}
+
+
+#else  /* }{ */
+
+/*
+** Each node vector is followed by one control byte per node: CTRL_EMPTY
+** for a free node or the top 7 bits of the (mixed) hash of its key, then
+** CTRL_END up to a whole group. Nodes are probed by aligned groups of
+** CTRLGROUP, from the one of the key's position on, matching the byte of
+** the key against all the group at once, till a group with a free node.
+** Keys (dead ones included) stay in their nodes until the next rehash,
+** so traversals and the collector see nodes just as with chains. Here
+** 'lastfree' counts down the free nodes new keys may still take, leaving
+** an eighth of a part with more groups free so that every probe ends.
+*/
+
+#define CTRLGROUP	16
+#define CTRL_EMPTY	0x80
+#define CTRL_END	0xFF
+
+#define gctrl(t)	cast(lu_byte *, gnodelast(t))
+#define nextgroup(t,g)	lmod((g) + CTRLGROUP, sizenode(t))
+
+#define sizectrl(size)	((size) < CTRLGROUP ? CTRLGROUP : (size))
+#define sizenodes(size)	(sizeof(Node) * (size) + sizectrl(size))
+#define maxload(size)	((size) <= CTRLGROUP ? (size) - ((size) >> 4) : \
+                                              (size) - ((size) >> 3))
+
+#define freenodes(L,n,size)	luaM_freemem(L, n, sizenodes(size))
+
+
+#if defined(__SSE2__)
+
+#include <emmintrin.h>
+
+typedef unsigned int GroupMask;  /* bit 'i' for byte 'i' of the group */
+#define MASKSHIFT	0
+
+static GroupMask matchbyte (const lu_byte *c, lu_byte b) {
+  __m128i g = _mm_loadu_si128(cast(const __m128i *, c));
+  __m128i m = _mm_cmpeq_epi8(g, _mm_set1_epi8(cast(char, b)));
+  return cast(GroupMask, _mm_movemask_epi8(m));
+}
+
+/* bytes with the high bit set: CTRL_EMPTY or CTRL_END */
+static GroupMask matchstop (const lu_byte *c) {
+  __m128i g = _mm_loadu_si128(cast(const __m128i *, c));
+  return cast(GroupMask, _mm_movemask_epi8(g));
+}
+
+#elif defined(__ARM_NEON) || defined(__ARM_NEON__)
+
+#include <arm_neon.h>
+
+typedef uint64_t GroupMask;  /* bit '4*i+3' for byte 'i' of the group */
+#define MASKSHIFT	2
+
+static GroupMask tomask (uint8x16_t m) {
+  uint8x8_t nibbles = vshrn_n_u16(vreinterpretq_u16_u8(m), 4);
+  return vget_lane_u64(vreinterpret_u64_u8(nibbles), 0) &
+         cast(GroupMask, 0x8888888888888888ULL);
+}
+
+static GroupMask matchbyte (const lu_byte *c, lu_byte b) {
+  return tomask(vceqq_u8(vld1q_u8(c), vdupq_n_u8(b)));
+}
+
+/* bytes with the high bit set: CTRL_EMPTY or CTRL_END */
+static GroupMask matchstop (const lu_byte *c) {
+  return tomask(vcltq_s8(vreinterpretq_s8_u8(vld1q_u8(c)), vdupq_n_s8(0)));
+}
+
+#else
+
+typedef unsigned int GroupMask;  /* bit 'i' for byte 'i' of the group */
+#define MASKSHIFT	0
+
+static GroupMask matchbyte (const lu_byte *c, lu_byte b) {
+  GroupMask m = 0;
+  int i;
+  for (i = 0; i < CTRLGROUP; i++) {
+    if (c[i] == b) m |= cast(GroupMask, 1) << i;
+  }
+  return m;
+}
+
+/* bytes with the high bit set: CTRL_EMPTY or CTRL_END */
+static GroupMask matchstop (const lu_byte *c) {
+  GroupMask m = 0;
+  int i;
+  for (i = 0; i < CTRLGROUP; i++) {
+    if (c[i] & 0x80) m |= cast(GroupMask, 1) << i;
+  }
+  return m;
+}
+
+#endif
+
+
+/* index in its group of the first byte in (non-zero) mask 'm' */
+#if defined(__GNUC__)
+#define firstbyte(m)	(__builtin_ctzll(m) >> MASKSHIFT)
+#else
+static int firstbyte (GroupMask m) {
+  int i = 0;
+  while (!(m & 1)) { m >>= 1; i++; }
+  return i >> MASKSHIFT;
+}
+#endif
+
+
+#define dummynode		(&dummy_.node)
+
+#define isdummy(n)		((n) == dummynode)
+
+static const struct {
+  Node node;
+  lu_byte ctrl[CTRLGROUP];  /* right after 'node', as 'gctrl' wants */
+} dummy_ = {
+  {{NILCONSTANT}, {{NILCONSTANT, NULL}}},
+  {CTRL_END, CTRL_END, CTRL_END, CTRL_END, CTRL_END, CTRL_END, CTRL_END,
+   CTRL_END, CTRL_END, CTRL_END, CTRL_END, CTRL_END, CTRL_END, CTRL_END,
+   CTRL_END, CTRL_END}
+};
+
+
+/*
+** spreads all bits of hash 'h' over the top ones (for the control byte)
+** and the bottom ones (for the position): as groups are probed in turn,
+** positions must not cluster
+*/
+static unsigned int mixhash (unsigned int h) {
+  h ^= h >> 16;
+  h *= 0x85ebca6bu;
+  h ^= h >> 13;
+  h *= 0xc2b2ae35u;
+  h ^= h >> 16;
+  return h;
+}
+
+#define ctrlbyte(h)		cast_byte((h) >> 25)
+#define hashpos(t,h)		lmod(h, sizenode(t))
+
+
+static unsigned int hashnum (lua_Number n) {
+  int i;
+  luai_hashnum(i, n);
+  return mixhash(cast(unsigned int, i));
+}
+
+
+static unsigned int hashkey (const TValue *key) {
+  switch (ttype(key)) {
+    case LUA_TNUMBER:
+      return hashnum(nvalue(key));
+    case LUA_TLNGSTR: {
+      TString *s = rawtsvalue(key);
+      if (s->tsv.extra == 0) {  /* no hash? */
+        s->tsv.hash = luaS_hash(getstr(s), s->tsv.len, s->tsv.hash);
+        s->tsv.extra = 1;  /* now it has its hash */
+      }
+      return mixhash(s->tsv.hash);
+    }
+    case LUA_TSHRSTR:
+      return mixhash(rawtsvalue(key)->tsv.hash);
+    case LUA_TBOOLEAN:
+      return mixhash(cast(unsigned int, bvalue(key)));
+    case LUA_TLIGHTUSERDATA:
+      return mixhash(IntPoint(pvalue(key)));
+    case LUA_TLCF:
+      return mixhash(IntPoint(fvalue(key)));
+    default:
+      return mixhash(IntPoint(gcvalue(key)));
+  }
+}
+
+
+#define mainposition(t,key)	gnode(t, hashpos(t, hashkey(key)))
+
+
+/*
+** returns from the enclosing function the node 'n' of 't' for which
+** 'cond' holds, or NULL if the probe for hash 'h' ends without one. New
+** keys take their own position when it is free, so that one is tried
+** first, before matching control bytes
+*/
+#define probe(t,h,cond) { \
+	int p_ = hashpos(t, h); \
+	lu_byte b_ = ctrlbyte(h); \
+	Node *n = gnode(t, p_); \
+	if (cond) return n; \
+	p_ &= ~(CTRLGROUP - 1); \
+	for (;;) { \
+	  const lu_byte *c_ = gctrl(t) + p_; \
+	  GroupMask m_; \
+	  for (m_ = matchbyte(c_, b_); m_ != 0; m_ &= m_ - 1) { \
+	    n = gnode(t, p_ + firstbyte(m_)); \
+	    if (cond) return n; \
+	  } \
+	  if (matchstop(c_) != 0) return NULL; \
+	  p_ = nextgroup(t, p_); \
+	} }
+
+
+/*
+** search functions for the hash part of 't' alone (or for an old hash
+** part); return NULL if the key is not there
+*/
+static Node *searchint (const Table *t, lua_Number nk) {
+  unsigned int h = hashnum(nk);
+  probe(t, h, ttisnumber(gkey(n)) && luai_numeq(nvalue(gkey(n)), nk));
+}
+
+
+static Node *searchshrstr (const Table *t, TString *key) {
+  unsigned int h = mixhash(key->tsv.hash);
+  probe(t, h, ttisshrstring(gkey(n)) && eqshrstr(rawtsvalue(gkey(n)), key));
 }
 
 
+static Node *searchgeneric (const Table *t, const TValue *key) {
+  unsigned int h = hashkey(key);
+  probe(t, h, luaV_rawequalobj(gkey(n), key));
+}
+
+
+static Node *searchdead (const Table *t, StkId key) {
+  unsigned int h = hashkey(key);
+  probe(t, h, ttisdeadkey(gkey(n)) && deadvalue(gkey(n)) == gcvalue(key));
+}
+
+
+/*
+** key may be dead already, but it is ok to use it in `next'. A key
+** removed and set again gets a new node, leaving the dead one where it
+** was, so a live node with the key comes first
+*/
+static Node *findnode (const Table *t, StkId key) {
+  Node *n = searchgeneric(t, key);
+  if (n == NULL && iscollectable(key))
+    n = searchdead(t, key);
+  return n;
+}
+
+
+static void clearnodes (Table *t) {
+  int i;
+  int size = sizenode(t);
+  for (i=0; i<size; i++) {
+    Node *n = gnode(t, i);
+    gnext(n) = NULL;
+    setnilvalue(gkey(n));
+    setnilvalue(gval(n));
+  }
+  memset(gctrl(t), CTRL_EMPTY, size);
+  memset(gctrl(t) + size, CTRL_END, sizectrl(size) - size);
+  t->lastfree = gnode(t, maxload(size));
+}
+
+
+static void setnodevector (lua_State *L, Table *t, int size) {
+  int lsize;
+  if (size == 0) {  /* no elements to hash part? */
+    t->node = cast(Node *, dummynode);  /* use common `dummynode' */
+    lsize = 0;
+  }
+  else {
+    lsize = luaO_ceillog2(size);
+    if (maxload(twoto(lsize)) < size)  /* would not keep its free nodes? */
+      lsize++;
+    if (lsize > MAXBITS)
+      luaG_runerror(L, "table overflow");
+    size = twoto(lsize);
+    if (cast(size_t, size) + CTRLGROUP > MAX_SIZET / (sizeof(Node) + 1))
+      luaM_toobig(L);
+    t->node = cast(Node *, luaM_malloc(L, sizenodes(size)));
+  }
+  t->lsizenode = cast_byte(lsize);
+  if (!isdummy(t->node))
+    clearnodes(t);
+  else
+    t->lastfree = t->node;  /* no free positions */
+}
+
+
+/*
+** inserts a new key into the first free node of its probe, growing the
+** table when no free node is left for it
+*/
+static TValue *insertkey (lua_State *L, Table *t, const TValue *key) {
+  unsigned int h;
+  int p;
+  Node *n;
+  if (t->lastfree == t->node) {  /* cannot take a free place? */
+    rehash(L, t, key);  /* grow table */
+    /* whatever called 'newkey' take care of TM cache and GC barrier */
+    return luaH_set(L, t, key);  /* insert key into grown table */
+  }
+  h = hashkey(key);
+  p = hashpos(t, h);
+  if (gctrl(t)[p] != CTRL_EMPTY) {  /* own position is taken? */
+    GroupMask m;
+    p &= ~(CTRLGROUP - 1);
+    while ((m = matchbyte(gctrl(t) + p, CTRL_EMPTY)) == 0)
+      p = nextgroup(t, p);
+    p += firstbyte(m);
+  }
+  t->lastfree--;
+  gctrl(t)[p] = ctrlbyte(h);
+  n = gnode(t, p);
+  setobj2t(L, gkey(n), key);
+  luaC_barrierback(L, obj2gco(t), key);
+  lua_assert(ttisnil(gval(n)));
+  return gval(n);
+}
+
+#endif  /* } */
+
+/* }============================================================= */
+
+
+/*
+** during an incremental rehash, a key not in the hash part may be in the
+** old one, in a node not moved yet
+*/
+#define searchold(t,search,k) \
+	((t)->old != NULL ? unmoved((t)->old, search((t)->old, k)) : NULL)
+
+static Node *unmoved (const Table *o, Node *n) {
+  return (n != NULL && n < o->lastfree) ? n : NULL;
+}
+
+
+/*
+** {=============================================================
+** Shapes
+** ==============================================================
+*/
+
+/*
+** A table starts with the (empty) root shape and, as long as it only gets
+** short string keys outside its array part, keeps them in a shape rather
+** than in a hash part: the shape lists the keys in the order they were
+** added and is shared by all tables that got the same keys in the same
+** order, the table only keeps their values, in 'slots'. The table leaves
+** its shape for good (moving the keys to a hash part) when it gets some
+** other key in the hash part, more than LUAI_MAXSHAPESLOTS keys, or a new
+** shape when there are already LUAI_MAXSHAPES. Shapes form a tree, each
+** one a child of the shape with its keys but the last; the collector
+** frees those no table uses any more (see 'sweepshapes' in lgc.c), so
+** that a long-running state does not use up LUAI_MAXSHAPES for good.
+*/
+
+
+static void setnodevector (lua_State *L, Table *t, int size);
+
+
+static Shape *newshape (lua_State *L, Shape *parent, TString *key) {
+  int n = (parent != NULL) ? parent->n + 1 : 0;
+  Shape *s = cast(Shape *, luaM_malloc(L, sizeShape(n)));
+  s->sibling = NULL;
+  if (parent != NULL) {
+    memcpy(s->keys, parent->keys, (n - 1) * sizeof(TString *));
+    s->keys[n - 1] = key;
+    s->sibling = parent->child;
+    parent->child = s;
+  }
+  s->child = NULL;
+  s->n = n;
+  s->inuse = 1;  /* keep it until its table gets it */
+  G(L)->nshapes++;
+  return s;
+}
+
+
+static int slotindex (const Shape *s, const TString *key) {
+  int i;
+  for (i = 0; i < s->n; i++) {
+    if (s->keys[i] == key)
+      return i;
+  }
+  return -1;
+}
+
+
+static void setslotvector (lua_State *L, Table *t, int size) {
+  luaM_reallocvector(L, t->slots, t->sizeslots, size, TValue);
+  t->sizeslots = cast_byte(size);
+}
+
+
+/*
+** gives 't' the shape with 'key' after its current keys; returns the
+** (nil) value of the new key, or NULL if the table cannot keep a shape
+*/
+static TValue *addslot (lua_State *L, Table *t, TString *key) {
+  Shape *s = t->shape;
+  Shape *c;
+  int n = s->n;
+  if (n >= LUAI_MAXSHAPESLOTS)
+    return NULL;
+  for (c = s->child; c != NULL; c = c->sibling) {
+    if (c->keys[n] == key) break;
+  }
+  if (c == NULL) {  /* no table got this key after these ones yet? */
+    if (G(L)->nshapes >= LUAI_MAXSHAPES)
+      return NULL;
+    c = newshape(L, s, key);
+  }
+  if (n == t->sizeslots)  /* no free slot? */
+    setslotvector(L, t, (n == 0) ? 4 : (2*n > LUAI_MAXSHAPESLOTS) ?
+                                       LUAI_MAXSHAPESLOTS : 2*n);
+  t->shape = c;
+  c->inuse = 1;  /* 't' may have been traversed already */
+  setnilvalue(&t->slots[n]);
+  return &t->slots[n];
+}
+
+
+/*
+** moves the keys of 't' from its shape to a hash part (with no free
+** positions left); returns the number of keys moved
+*/
+static int unshape (lua_State *L, Table *t) {
+  Shape *s = t->shape;
+  TValue *slots = t->slots;
+  int size = t->sizeslots;
+  int i, n = 0;
+  lua_assert(isdummy(t->node));
+  for (i = 0; i < s->n; i++) {
+    if (!ttisnil(&slots[i])) n++;
+  }
+  setnodevector(L, t, n);
+  t->shape = NULL;
+  t->slots = NULL;
+  t->sizeslots = 0;
+  for (i = 0; i < s->n; i++) {
+    if (!ttisnil(&slots[i])) {
+      TValue k;
+      setsvalue(L, &k, s->keys[i]);
+      /* doesn't need barrier/invalidate cache, as entry was
+         already present in the table */
+      setobjt2t(L, luaH_set(L, t, &k), &slots[i]);
+    }
+  }
+  luaM_freearray(L, slots, size);
+  return n;
+}
+
+
+void luaH_initshapes (lua_State *L) {
+  if (LUAI_MAXSHAPES > 0)
+    G(L)->rootshape = newshape(L, NULL, NULL);
+}
+
+
+void luaH_freeshape (lua_State *L, Shape *s) {
+  lua_assert(s->child == NULL);
+  G(L)->nshapes--;
+  luaM_freemem(L, s, sizeShape(s->n));
+}
+
+
+static void freetree (lua_State *L, Shape *s) {
+  while (s != NULL) {
+    Shape *next = s->sibling;
+    freetree(L, s->child);  /* at most LUAI_MAXSHAPESLOTS levels deep */
+    s->child = NULL;
+    luaH_freeshape(L, s);
+    s = next;
+  }
+}
+
+
+void luaH_freeshapes (lua_State *L) {
+  global_State *g = G(L);
+  freetree(L, g->rootshape);
+  g->rootshape = NULL;
+  lua_assert(g->nshapes == 0);
+}
+
+/* }============================================================= */
+
+
 /*
 ** returns the index of a `key' for table traversals. First goes all
-** elements in the array part, then elements in the hash part. The
-** beginning of a traversal is signaled by -1.
+** elements in the array part, then elements in the shape, then in the
+** hash part, then in the old hash part. The beginning of a traversal is
+** signaled by -1.
 */
 static int findindex (lua_State *L, Table *t, StkId key) {
   int i;
@@ -147,21 +808,20 @@ static int findindex (lua_State *L, Table *t, StkId key) {
   i = arrayindex(key);
   if (0 < i && i <= t->sizearray)  /* is `key' inside array part? */
     return i-1;  /* yes; that's the index (corrected to C) */
+  else if (t->shape != NULL) {
+    if (!ttisshrstring(key) || (i = slotindex(t->shape, rawtsvalue(key))) < 0)
+      luaG_runerror(L, "invalid key to " LUA_QL("next"));  /* key not found */
+    return i + t->sizearray;  /* slots are numbered after array elements */
+  }
   else {
-    Node *n = mainposition(t, key);
-    for (;;) {  /* check whether `key' is somewhere in the chain */
-      /* key may be dead already, but it is ok to use it in `next' */
-      if (luaV_rawequalobj(gkey(n), key) ||
-            (ttisdeadkey(gkey(n)) && iscollectable(key) &&
-             deadvalue(gkey(n)) == gcvalue(key))) {
-        i = cast_int(n - gnode(t, 0));  /* key index in hash table */
-        /* hash elements are numbered after array ones */
-        return i + t->sizearray;
-      }
-      else n = gnext(n);
-      if (n == NULL)
-        luaG_runerror(L, "invalid key to " LUA_QL("next"));  /* key not found */
-    }
+    Node *n = findnode(t, key);
+    if (n != NULL)  /* hash elements are numbered after array ones */
+      return cast_int(n - gnode(t, 0)) + t->sizearray;
+    else if (t->old != NULL && unmoved(t->old, n = findnode(t->old, key)))
+      /* and old ones after them */
+      return cast_int(n - gnode(t->old, 0)) + sizenode(t) + t->sizearray;
+    luaG_runerror(L, "invalid key to " LUA_QL("next"));  /* key not found */
+    return 0;  /* to avoid warnings */
   }
 }
 
@@ -175,13 +835,31 @@ int luaH_next (lua_State *L, Table *t, StkId key) {
       return 1;
     }
   }
-  for (i -= t->sizearray; i < sizenode(t); i++) {  /* then hash part */
+  for (i -= t->sizearray; i < numslots(t); i++) {  /* then shape */
+    if (!ttisnil(&t->slots[i])) {  /* a non-nil value? */
+      setsvalue2s(L, key, t->shape->keys[i]);
+      setobj2s(L, key+1, &t->slots[i]);
+      return 1;
+    }
+  }
+  /* then hash part (a table with a shape has none) */
+  for (i -= numslots(t); i < sizenode(t); i++) {
     if (!ttisnil(gval(gnode(t, i)))) {  /* a non-nil value? */
       setobj2s(L, key, gkey(gnode(t, i)));
       setobj2s(L, key+1, gval(gnode(t, i)));
       return 1;
     }
   }
+  if (t->old != NULL) {  /* then nodes not moved yet from the old part */
+    Table *o = t->old;
+    for (i -= sizenode(t); gnode(o, i) < o->lastfree; i++) {
+      if (!ttisnil(gval(gnode(o, i)))) {  /* a non-nil value? */
+        setobj2s(L, key, gkey(gnode(o, i)));
+        setobj2s(L, key+1, gval(gnode(o, i)));
+        return 1;
+      }
+    }
+  }
   return 0;  /* no more elements */
 }
 
@@ -276,36 +954,84 @@ static void setarrayvector (lua_State *L, Table *t, int size) {
 }
 
 
-static void setnodevector (lua_State *L, Table *t, int size) {
-  int lsize;
-  if (size == 0) {  /* no elements to hash part? */
-    t->node = cast(Node *, dummynode);  /* use common `dummynode' */
-    lsize = 0;
-  }
-  else {
-    int i;
-    lsize = luaO_ceillog2(size);
-    if (lsize > MAXBITS)
-      luaG_runerror(L, "table overflow");
-    size = twoto(lsize);
-    t->node = luaM_newvector(L, size, Node);
-    for (i=0; i<size; i++) {
-      Node *n = gnode(t, i);
-      gnext(n) = NULL;
-      setnilvalue(gkey(n));
-      setnilvalue(gval(n));
+static TValue *insertkey (lua_State *L, Table *t, const TValue *key);
+
+
+/*
+** moves up to 'n' nodes from the old hash part of 't' to the new one,
+** from the last down, and frees the old part once they all were moved
+*/
+static void migrate (lua_State *L, Table *t, int n) {
+  Table *o;
+  while ((o = t->old) != NULL) {  /* (a full rehash may end it meanwhile) */
+    if (o->lastfree == gnode(o, 0)) {  /* all nodes moved? */
+      if (!isdummy(o->node))
+        freenodes(L, o->node, sizenode(o));
+      luaM_free(L, o);
+      t->old = NULL;
+    }
+    else if (n-- == 0)
+      break;
+    else {
+      Node *old = --o->lastfree;  /* from now on lookups ignore it */
+      if (!ttisnil(gval(old))) {
+        TValue k, v;
+        setobj(L, &k, gkey(old));
+        setobj(L, &v, gval(old));
+        /* doesn't need barrier/invalidate cache, as entry was
+           already present in the table */
+        setobjt2t(L, insertkey(L, t, &k), &v);
+      }
+      /* the collector no longer marks its key, but old chains still go
+         through it: make it dead so that no lookup compares with it */
+      if (iscollectable(gkey(old)))
+        setdeadvalue(gkey(old));
     }
   }
-  t->lsizenode = cast_byte(lsize);
-  t->lastfree = gnode(t, size);  /* all positions are free */
+}
+
+
+/*
+** gives 't' a new hash part of 'size' (at least twice the current one)
+** keeping the current one in 't->old', from where each new key moves
+** LUAI_REHASHSTEP nodes: it is empty before the new part fills up
+*/
+static void startrehash (lua_State *L, Table *t, int size) {
+  Table *o = luaM_new(L, Table);
+  Node *nold = t->node;
+  lu_byte oldhsize = t->lsizenode;
+  o->shape = NULL;
+  o->old = NULL;
+  o->node = cast(Node *, dummynode);  /* no old nodes (until all is set) */
+  o->lsizenode = 0;
+  o->lastfree = o->node;
+  t->old = o;
+  setnodevector(L, t, size);
+  lua_assert(t->lsizenode > oldhsize);
+  o->node = nold;
+  o->lsizenode = oldhsize;
+  o->lastfree = gnodelast(o);  /* nothing moved yet */
 }
 
 
 void luaH_resize (lua_State *L, Table *t, int nasize, int nhsize) {
   int i;
   int oldasize = t->sizearray;
-  int oldhsize = t->lsizenode;
-  Node *nold = t->node;  /* save old hash ... */
+  int oldhsize;
+  Node *nold;
+  if (t->old != NULL)  /* in the middle of an incremental rehash? */
+    migrate(L, t, MAX_INT);  /* finish it */
+  if (t->shape != NULL) {  /* 'nhsize' counts keys for the shape */
+    if (nhsize > LUAI_MAXSHAPESLOTS)  /* too many for a shape? */
+      nhsize += unshape(L, t);
+    else {
+      if (nhsize > t->sizeslots)
+        setslotvector(L, t, nhsize);
+      nhsize = 0;  /* keep the hash part empty */
+    }
+  }
+  oldhsize = t->lsizenode;
+  nold = t->node;  /* save old hash ... */
   if (nasize > oldasize)  /* array part must grow? */
     setarrayvector(L, t, nasize);
   /* create new hash part with appropriate size */
@@ -319,6 +1045,8 @@ void luaH_resize (lua_State *L, Table *t, int nasize, int nhsize) {
     }
     /* shrink array */
     luaM_reallocvector(L, t->array, oldasize, nasize, TValue);
+    if (t->border > nasize)
+      t->border = nasize;
   }
   /* re-insert elements from hash part */
   for (i = twoto(oldhsize) - 1; i >= 0; i--) {
@@ -330,7 +1058,7 @@ void luaH_resize (lua_State *L, Table *t, int nasize, int nhsize) {
     }
   }
   if (!isdummy(nold))
-    luaM_freearray(L, nold, cast(size_t, twoto(oldhsize))); /* free old array */
+    freenodes(L, nold, twoto(oldhsize));  /* free old array */
 }
 
 
@@ -340,11 +1068,31 @@ void luaH_resizearray (lua_State *L, Table *t, int nasize) {
 }
 
 
+/*
+** gives 't' a hash part with room for twice the keys it has now, if
+** that is smaller than the current one (for tables the collector found
+** mostly empty); the array part is kept as is
+*/
+static void shrink (lua_State *L, Table *t) {
+  int nums[MAXBITS+1];
+  int nasize = 0;
+  int totaluse;
+  if (t->old != NULL || t->shape != NULL || isdummy(t->node))
+    return;
+  memset(nums, 0, sizeof(nums));
+  totaluse = numusehash(t, nums, &nasize);
+  if (2 * totaluse <= sizenode(t) / 2)  /* would take half the nodes? */
+    luaH_resize(L, t, t->sizearray, 2 * totaluse);
+}
+
+
 static void rehash (lua_State *L, Table *t, const TValue *ek) {
   int nasize, na;
   int nums[MAXBITS+1];  /* nums[i] = number of keys with 2^(i-1) < k <= 2^i */
   int i;
   int totaluse;
+  if (t->old != NULL)  /* in the middle of an incremental rehash? */
+    migrate(L, t, MAX_INT);  /* finish it */
   for (i=0; i<=MAXBITS; i++) nums[i] = 0;  /* reset counts */
   nasize = numusearray(t, nums);  /* count keys in array part */
   totaluse = nasize;  /* all those keys are integer keys */
@@ -354,8 +1102,13 @@ static void rehash (lua_State *L, Table *t, const TValue *ek) {
   totaluse++;
   /* compute new size for array part */
   na = computesizes(nums, &nasize);
-  /* resize the table to new computed sizes */
-  luaH_resize(L, t, nasize, totaluse - na);
+  if (t->shape != NULL && totaluse > na)  /* some key for a hash part? */
+    totaluse += unshape(L, t);
+  if (nasize == t->sizearray && t->lsizenode >= LUAI_INCREHASHLOG &&
+      totaluse - na > maxload(sizenode(t)))  /* only a large part grows? */
+    startrehash(L, t, totaluse - na);
+  else  /* resize the table to new computed sizes */
+    luaH_resize(L, t, nasize, totaluse - na);
 }
 
 
@@ -365,78 +1118,177 @@ static void rehash (lua_State *L, Table *t, const TValue *ek) {
 */
 
 
+/*
+** gives 't' room for at least 'nasize' elements in its array part and
+** 'nhsize' other keys, keeping whatever larger parts it got from the pool
+*/
+void luaH_presize (lua_State *L, Table *t, int nasize, int nhsize) {
+  int hsize = (t->shape != NULL) ? t->sizeslots :
+              isdummy(t->node) ? 0 : maxload(sizenode(t));
+  if (nasize > t->sizearray || nhsize > hsize)
+    luaH_resize(L, t, (nasize > t->sizearray) ? nasize : t->sizearray,
+                      (nhsize > hsize) ? nhsize : hsize);
+}
+
+
+/*
+** empties 't' keeping its parts (a traversal of it cannot go on)
+*/
+void luaH_clear (lua_State *L, Table *t) {
+  int i;
+  if (t->old != NULL) {  /* in the middle of an incremental rehash? */
+    if (!isdummy(t->old->node))  /* drop the old part */
+      freenodes(L, t->old->node, sizenode(t->old));
+    luaM_free(L, t->old);
+    t->old = NULL;
+  }
+  for (i = 0; i < t->sizearray; i++)
+    setnilvalue(&t->array[i]);
+  t->border = 0;
+  t->sparse = 0;
+  if (t->shape != NULL)  /* values of the shape will be nil when reused */
+    t->shape = G(L)->rootshape;
+  else if (!isdummy(t->node))
+    clearnodes(t);
+  invalidateTMcache(t);
+}
+
+
+/*
+** {=============================================================
+** Table pool: with 'maxtablepool' > 0, tables the collector frees (when
+** their parts are not larger than LUAI_MAXPOOLEDSIZE) are emptied and kept
+** in 'tablepool', linked by 'gclist', and new tables come from there.
+** Pooled memory does not count as in use for the collector's pace: it
+** is taken out of the debt when a table enters the pool and put back
+** when it leaves it.
+** ==============================================================
+*/
+
+#define poolable(t) \
+	((t)->old == NULL && (t)->sizearray <= LUAI_MAXPOOLEDSIZE && \
+	 (isdummy((t)->node) || sizenode(t) <= LUAI_MAXPOOLEDSIZE))
+
+#define nextpooled(t)	((t)->gclist != NULL ? gco2t((t)->gclist) : NULL)
+
+#define pooledbytes(t) \
+	(cast(l_mem, sizeof(Table) + \
+	             sizeof(TValue) * ((t)->sizearray + (t)->sizeslots)) + \
+	 (isdummy((t)->node) ? 0 : cast(l_mem, sizenodes(sizenode(t)))))
+
+
+static void freetable (lua_State *L, Table *t) {
+  if (!isdummy(t->node))
+    freenodes(L, t->node, sizenode(t));
+  if (t->old != NULL) {
+    if (!isdummy(t->old->node))
+      freenodes(L, t->old->node, sizenode(t->old));
+    luaM_free(L, t->old);
+  }
+  luaM_freearray(L, t->array, t->sizearray);
+  luaM_freearray(L, t->slots, t->sizeslots);
+  luaM_free(L, t);
+}
+
+
+void luaH_setpool (lua_State *L, int max) {
+  global_State *g = G(L);
+  g->maxtablepool = (max > 0) ? max : 0;
+  while (g->ntablepool > g->maxtablepool) {
+    Table *t = g->tablepool;
+    g->tablepool = nextpooled(t);
+    g->ntablepool--;
+    g->GCdebt += pooledbytes(t);
+    freetable(L, t);
+  }
+}
+
+
 Table *luaH_new (lua_State *L) {
-  Table *t = &luaC_newobj(L, LUA_TTABLE, sizeof(Table), NULL, 0)->h;
+  global_State *g = G(L);
+  Table *t = g->tablepool;
+  if (t != NULL) {  /* reuse a pooled table (already empty) */
+    g->tablepool = nextpooled(t);
+    g->ntablepool--;
+    g->tablepoolstats.reused++;
+    g->GCdebt += pooledbytes(t);
+    luaC_relink(L, obj2gco(t));
+    return t;
+  }
+  if (g->maxtablepool > 0)
+    g->tablepoolstats.created++;
+  t = &luaC_newobj(L, LUA_TTABLE, sizeof(Table), NULL, 0)->h;
   t->metatable = NULL;
   t->flags = cast_byte(~0);
+  t->incache = 0;
+  t->sparse = 0;
+  t->epoch = 0;
   t->array = NULL;
   t->sizearray = 0;
+  t->border = 0;
+  t->shape = G(L)->rootshape;
+  t->slots = NULL;
+  t->sizeslots = 0;
+  t->old = NULL;
   setnodevector(L, t, 0);
   return t;
 }
 
 
 void luaH_free (lua_State *L, Table *t) {
-  if (!isdummy(t->node))
-    luaM_freearray(L, t->node, cast(size_t, sizenode(t)));
-  luaM_freearray(L, t->array, t->sizearray);
-  luaM_free(L, t);
-}
-
-
-static Node *getfreepos (Table *t) {
-  while (t->lastfree > t->node) {
-    t->lastfree--;
-    if (ttisnil(gkey(t->lastfree)))
-      return t->lastfree;
+  global_State *g = G(L);
+  if (t->incache) {  /* its address may come back as another table */
+    g->icachegen++;
+    t->incache = 0;
+  }
+  if (g->maxtablepool == 0)
+    freetable(L, t);
+  else if (g->ntablepool < g->maxtablepool && poolable(t)) {
+    luaH_clear(L, t);
+    t->metatable = NULL;
+    t->flags = cast_byte(~0);
+    t->gclist = (g->tablepool != NULL) ? obj2gco(g->tablepool) : NULL;
+    g->tablepool = t;
+    g->ntablepool++;
+    g->tablepoolstats.pooled++;
+    g->GCdebt -= pooledbytes(t);
+  }
+  else {
+    g->tablepoolstats.dropped++;
+    freetable(L, t);
   }
-  return NULL;  /* could not find a free place */
 }
 
+/* }============================================================= */
 
 
 /*
-** inserts a new key into a hash table; first, check whether key's main
-** position is free. If not, check whether colliding node is in its main
-** position or not: if it is not, move colliding node to an empty place and
-** put new key in its main position; otherwise (colliding node is in its main
-** position), new key goes to an empty position.
+** inserts a new key into 't': in its shape, if it has one, else in its
+** hash part
 */
 TValue *luaH_newkey (lua_State *L, Table *t, const TValue *key) {
-  Node *mp;
   if (ttisnil(key)) luaG_runerror(L, "table index is nil");
   else if (ttisnumber(key) && luai_numisnan(L, nvalue(key)))
     luaG_runerror(L, "table index is NaN");
-  mp = mainposition(t, key);
-  if (!ttisnil(gval(mp)) || isdummy(mp)) {  /* main position is taken? */
-    Node *othern;
-    Node *n = getfreepos(t);  /* get a free place */
-    if (n == NULL) {  /* cannot find a free place? */
-      rehash(L, t, key);  /* grow table */
-      /* whatever called 'newkey' take care of TM cache and GC barrier */
-      return luaH_set(L, t, key);  /* insert key into grown table */
+  if (t->sparse) {  /* 'next' is undefined from now on, so it can shrink */
+    t->sparse = 0;
+    shrink(L, t);
+  }
+  if (t->shape != NULL) {
+    if (ttisshrstring(key)) {
+      TValue *slot = addslot(L, t, rawtsvalue(key));
+      if (slot != NULL)
+        return slot;
+      unshape(L, t);  /* go on with a (full) hash part */
     }
-    lua_assert(!isdummy(n));
-    othern = mainposition(t, gkey(mp));
-    if (othern != mp) {  /* is colliding node out of its main position? */
-      /* yes; move colliding node into free position */
-      while (gnext(othern) != mp) othern = gnext(othern);  /* find previous */
-      gnext(othern) = n;  /* redo the chain with `n' in place of `mp' */
-      *n = *mp;  /* copy colliding node into free pos. (mp->next also goes) */
-      gnext(mp) = NULL;  /* now `mp' is free */
-      setnilvalue(gval(mp));
-    }
-    else {  /* colliding node is in its own main position */
-      /* new node will go into free position */
-      gnext(n) = gnext(mp);  /* chain new position */
-      gnext(mp) = n;
-      mp = n;
+    else {  /* may go to the array part or need a hash part */
+      rehash(L, t, key);
+      return luaH_set(L, t, key);
     }
   }
-  setobj2t(L, gkey(mp), key);
-  luaC_barrierback(L, obj2gco(t), key);
-  lua_assert(ttisnil(gval(mp)));
-  return gval(mp);
+  if (t->old != NULL)  /* in the middle of an incremental rehash? */
+    migrate(L, t, LUAI_REHASHSTEP);
+  return insertkey(L, t, key);
 }
 
 
@@ -449,13 +1301,9 @@ const TValue *luaH_getint (Table *t, int key) {
     return &t->array[key-1];
   else {
     lua_Number nk = cast_num(key);
-    Node *n = hashnum(t, nk);
-    do {  /* check whether `key' is somewhere in the chain */
-      if (ttisnumber(gkey(n)) && luai_numeq(nvalue(gkey(n)), nk))
-        return gval(n);  /* that's it */
-      else n = gnext(n);
-    } while (n);
-    return luaO_nilobject;
+    Node *n = searchint(t, nk);
+    if (n == NULL) n = searchold(t, searchint, nk);
+    return (n != NULL) ? gval(n) : luaO_nilobject;
   }
 }
 
@@ -464,14 +1312,15 @@ const TValue *luaH_getint (Table *t, int key) {
 ** search function for short strings
 */
 const TValue *luaH_getstr (Table *t, TString *key) {
-  Node *n = hashstr(t, key);
+  Node *n;
   lua_assert(key->tsv.tt == LUA_TSHRSTR);
-  do {  /* check whether `key' is somewhere in the chain */
-    if (ttisshrstring(gkey(n)) && eqshrstr(rawtsvalue(gkey(n)), key))
-      return gval(n);  /* that's it */
-    else n = gnext(n);
-  } while (n);
-  return luaO_nilobject;
+  if (t->shape != NULL) {
+    int i = slotindex(t->shape, key);
+    return (i >= 0) ? &t->slots[i] : luaO_nilobject;
+  }
+  n = searchshrstr(t, key);
+  if (n == NULL) n = searchold(t, searchshrstr, key);
+  return (n != NULL) ? gval(n) : luaO_nilobject;
 }
 
 
@@ -491,13 +1340,9 @@ const TValue *luaH_get (Table *t, const TValue *key) {
       /* else go through */
     }
     default: {
-      Node *n = mainposition(t, key);
-      do {  /* check whether `key' is somewhere in the chain */
-        if (luaV_rawequalobj(gkey(n), key))
-          return gval(n);  /* that's it */
-        else n = gnext(n);
-      } while (n);
-      return luaO_nilobject;
+      Node *n = searchgeneric(t, key);
+      if (n == NULL) n = searchold(t, searchgeneric, key);
+      return (n != NULL) ? gval(n) : luaO_nilobject;
     }
   }
 }
@@ -526,6 +1371,7 @@ void luaH_setint (lua_State *L, Table *t, int key, TValue *value) {
     cell = luaH_newkey(L, t, &k);
   }
   setobj2t(L, cell, value);
+  updateborder(t, cell);
 }
 
 
@@ -556,17 +1402,24 @@ static int unbound_search (Table *t, unsigned int j) {
 /*
 ** Try to find a boundary in table `t'. A `boundary' is an integer index
 ** such that t[i] is non-nil and t[i+1] is nil (and 0 if t[1] is nil).
+** Raw stores keep 't->border' at the boundary of the array part as long
+** as it only grows or shrinks at its end, so it usually needs no search.
 */
 int luaH_getn (Table *t) {
   unsigned int j = t->sizearray;
   if (j > 0 && ttisnil(&t->array[j - 1])) {
+    unsigned int i = t->border;
+    if (i < j && ttisnil(&t->array[i]) &&
+        (i == 0 || !ttisnil(&t->array[i - 1])))  /* hint still a border? */
+      return i;
     /* there is a boundary in the array part: (binary) search for it */
-    unsigned int i = 0;
+    i = 0;
     while (j - i > 1) {
       unsigned int m = (i+j)/2;
       if (ttisnil(&t->array[m - 1])) j = m;
       else i = m;
     }
+    t->border = i;
     return i;
   }
   /* else must find a boundary in hash part */
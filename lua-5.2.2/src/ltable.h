@@ -10,12 +10,63 @@
 #include "lobject.h"
 
 
+/* maximum number of keys a table keeps in a shape (at most 255) */
+#if !defined(LUAI_MAXSHAPESLOTS)
+#define LUAI_MAXSHAPESLOTS	16
+#endif
+
+/* maximum number of shapes in a state (0 disables shapes) */
+#if !defined(LUAI_MAXSHAPES)
+#define LUAI_MAXSHAPES		2048
+#endif
+
+/* hash parts with at least 2^LUAI_INCREHASHLOG nodes grow incrementally */
+#if !defined(LUAI_INCREHASHLOG)
+#define LUAI_INCREHASHLOG	12
+#endif
+
+/* tables with larger parts are freed rather than kept in the table pool */
+#if !defined(LUAI_MAXPOOLEDSIZE)
+#define LUAI_MAXPOOLEDSIZE	1024
+#endif
+
+/* old nodes moved per new key during an incremental rehash (at least 2) */
+#if !defined(LUAI_REHASHSTEP)
+#define LUAI_REHASHSTEP		32
+#endif
+
+
 #define gnode(t,i)	(&(t)->node[i])
 #define gkey(n)		(&(n)->i_key.tvk)
 #define gval(n)		(&(n)->i_val)
 #define gnext(n)	((n)->i_key.nk.next)
+#define gnodelast(t)	gnode(t, cast(size_t, sizenode(t)))  /* one after last */
+
+/*
+** one after the last node in use of part 'p' of the hash of 't' (that is
+** 't' itself or 't->old', whose nodes from 'lastfree' on were moved)
+*/
+#define gnodelimit(t,p)	((p) == (t) ? gnodelast(p) : (p)->lastfree)
+
+/* number of keys in the shape of 't' (0 when they are in its hash part) */
+#define numslots(t)	((t)->shape != NULL ? (t)->shape->n : 0)
+
+/* node of a value in the hash part ('i_val' is the first field of Node) */
+#define gnodeofval(v)	cast(Node *, (v))
+
+/*
+** after a raw store into 'cell' of 't': if it is in the array part, move
+** the border hint past an appended element or back before a removed one
+*/
+#define updateborder(t,cell) { \
+	const TValue *c_ = (cell); \
+	if (cast(size_t, c_ - (t)->array) < cast(size_t, (t)->sizearray)) { \
+	  int i_ = cast_int(c_ - (t)->array); \
+	  if (ttisnil(c_)) { if (i_ < (t)->border) (t)->border = i_; } \
+	  else if (i_ == (t)->border) (t)->border = i_ + 1; } }
 
-#define invalidateTMcache(t)	((t)->flags = 0)
+/* after a raw store: forget absent metamethods and __index chains via 't' */
+#define invalidateTMcache(t)	((t)->flags = 0, (t)->epoch++)
 
 
 LUAI_FUNC const TValue *luaH_getint (Table *t, int key);
@@ -27,9 +78,15 @@ LUAI_FUNC TValue *luaH_set (lua_State *L, Table *t, const TValue *key);
 LUAI_FUNC Table *luaH_new (lua_State *L);
 LUAI_FUNC void luaH_resize (lua_State *L, Table *t, int nasize, int nhsize);
 LUAI_FUNC void luaH_resizearray (lua_State *L, Table *t, int nasize);
+LUAI_FUNC void luaH_presize (lua_State *L, Table *t, int nasize, int nhsize);
+LUAI_FUNC void luaH_clear (lua_State *L, Table *t);
 LUAI_FUNC void luaH_free (lua_State *L, Table *t);
+LUAI_FUNC void luaH_setpool (lua_State *L, int max);
 LUAI_FUNC int luaH_next (lua_State *L, Table *t, StkId key);
 LUAI_FUNC int luaH_getn (Table *t);
+LUAI_FUNC void luaH_initshapes (lua_State *L);
+LUAI_FUNC void luaH_freeshape (lua_State *L, Shape *s);
+LUAI_FUNC void luaH_freeshapes (lua_State *L);
 
 
 #if defined(LUA_DEBUG)
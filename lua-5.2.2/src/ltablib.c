@@ -257,12 +257,39 @@ static int sort (lua_State *L) {
 /* }====================================================== */
 
 
+/*
+** {======================================================
+** Creating and emptying tables
+** =======================================================
+*/
+
+static int tnew (lua_State *L) {
+  int narr = luaL_optint(L, 1, 0);
+  int nrec = luaL_optint(L, 2, 0);
+  luaL_argcheck(L, narr >= 0, 1, "negative size");
+  luaL_argcheck(L, nrec >= 0, 2, "negative size");
+  lua_createtable(L, narr, nrec);
+  return 1;
+}
+
+
+static int tclear (lua_State *L) {
+  luaL_checktype(L, 1, LUA_TTABLE);
+  lua_cleartable(L, 1);
+  return 0;
+}
+
+/* }====================================================== */
+
+
 static const luaL_Reg tab_funcs[] = {
+  {"clear", tclear},
   {"concat", tconcat},
 #if defined(LUA_COMPAT_MAXN)
   {"maxn", maxn},
 #endif
   {"insert", tinsert},
+  {"new", tnew},
   {"pack", pack},
   {"unpack", unpack},
   {"remove", tremove},
@@ -109,6 +109,9 @@ typedef LUA_INTEGER lua_Integer;
 /* unsigned integer type */
 typedef LUA_UNSIGNED lua_Unsigned;
 
+/* handle to a pinned (pre-interned) key string, see lua_pinkey */
+typedef const struct lua_PinnedKey *lua_Key;
+
 
 
 /*
@@ -215,6 +218,7 @@ LUA_API void  (lua_pushcclosure) (lua_State *L, lua_CFunction fn, int n);
 LUA_API void  (lua_pushboolean) (lua_State *L, int b);
 LUA_API void  (lua_pushlightuserdata) (lua_State *L, void *p);
 LUA_API int   (lua_pushthread) (lua_State *L);
+LUA_API void  (lua_pushkey) (lua_State *L, lua_Key k);
 
 
 /*
@@ -223,6 +227,7 @@ LUA_API int   (lua_pushthread) (lua_State *L);
 LUA_API void  (lua_getglobal) (lua_State *L, const char *var);
 LUA_API void  (lua_gettable) (lua_State *L, int idx);
 LUA_API void  (lua_getfield) (lua_State *L, int idx, const char *k);
+LUA_API void  (lua_getfieldh) (lua_State *L, int idx, lua_Key k);
 LUA_API void  (lua_rawget) (lua_State *L, int idx);
 LUA_API void  (lua_rawgeti) (lua_State *L, int idx, int n);
 LUA_API void  (lua_rawgetp) (lua_State *L, int idx, const void *p);
@@ -238,13 +243,21 @@ LUA_API void  (lua_getuservalue) (lua_State *L, int idx);
 LUA_API void  (lua_setglobal) (lua_State *L, const char *var);
 LUA_API void  (lua_settable) (lua_State *L, int idx);
 LUA_API void  (lua_setfield) (lua_State *L, int idx, const char *k);
+LUA_API void  (lua_setfieldh) (lua_State *L, int idx, lua_Key k);
 LUA_API void  (lua_rawset) (lua_State *L, int idx);
+LUA_API void  (lua_cleartable) (lua_State *L, int idx);
 LUA_API void  (lua_rawseti) (lua_State *L, int idx, int n);
 LUA_API void  (lua_rawsetp) (lua_State *L, int idx, const void *p);
 LUA_API int   (lua_setmetatable) (lua_State *L, int objindex);
 LUA_API void  (lua_setuservalue) (lua_State *L, int idx);
 
 
+/*
+** pinned keys: intern a key once and reuse it (valid for the life of the state)
+*/
+LUA_API lua_Key (lua_pinkey) (lua_State *L, const char *k);
+
+
 /*
 ** 'load' and 'call' functions (load and run Lua code)
 */
@@ -294,6 +307,57 @@ LUA_API int  (lua_status) (lua_State *L);
 LUA_API int (lua_gc) (lua_State *L, int what, int data);
 
 
+/*
+** garbage-collection event hook (for profilers): called with begin = 1
+** before and begin = 0 after each unit of collector work.  It runs in
+** the middle of a collection, so it must not touch any Lua state.
+*/
+#define LUA_GCEVSTEP		0	/* one incremental (or generational) step */
+#define LUA_GCEVATOMIC		1	/* the atomic phase of a cycle */
+#define LUA_GCEVFULL		2	/* a full collection */
+
+typedef void (*lua_GCHook) (void *ud, int event, int begin);
+
+LUA_API void (lua_setgchook) (lua_State *L, lua_GCHook f, void *ud);
+
+
+/*
+** heap walk (for heap snapshots): calls 'object' once for every live
+** collectable object, with its type name ("table", "function",
+** "cfunction", "string", "userdata", "thread", "proto" or "upvalue")
+** and the bytes it owns, then 'ref' for each object it references.
+** 'name' is the string key, upvalue name or a "(description)" of the
+** reference, or NULL.  Roots are reported as references from NULL.
+** Neither callback may call into Lua.  Run a full collection first to
+** leave out garbage of the current cycle.
+*/
+typedef void (*lua_HeapObject) (void *ud, const void *o, const char *type,
+                                size_t size);
+typedef void (*lua_HeapRef) (void *ud, const void *from, const void *to,
+                             const char *name);
+
+LUA_API void (lua_walkheap) (lua_State *L, lua_HeapObject object,
+                             lua_HeapRef ref, void *ud);
+
+
+/*
+** table pool: with 'max' > 0, up to 'max' tables the collector frees
+** (if not too large) are emptied and kept, with their array and hash
+** parts, and new tables are taken from there.  0, the default, frees the
+** kept tables.  Counts in the statistics start with the state.
+*/
+typedef struct lua_TablePoolStats {
+  size_t reused;  /* new tables taken from the pool */
+  size_t created;  /* new tables allocated (with a pool) as it was empty */
+  size_t pooled;  /* freed tables kept in the pool */
+  size_t dropped;  /* freed tables not kept: the pool was full or too large */
+  int size;  /* tables in the pool now */
+} lua_TablePoolStats;
+
+LUA_API void (lua_settablepool) (lua_State *L, int max);
+LUA_API void (lua_gettablepool) (lua_State *L, lua_TablePoolStats *stats);
+
+
 /*
 ** miscellaneous functions
 */
@@ -389,12 +453,31 @@ LUA_API const char *(lua_setupvalue) (lua_State *L, int funcindex, int n);
 LUA_API void *(lua_upvalueid) (lua_State *L, int fidx, int n);
 LUA_API void  (lua_upvaluejoin) (lua_State *L, int fidx1, int n1,
                                                int fidx2, int n2);
+/*
+** Pushes a new closure of the Lua function at 'funcindex' that shares all
+** its upvalues except upvalue 'n'. If 'n' is not 0, the copy gets its own
+** upvalue 'n', set to the value on the top of the stack, which it replaces.
+*/
+LUA_API void  (lua_copyfunction) (lua_State *L, int funcindex, int n);
 
 LUA_API int (lua_sethook) (lua_State *L, lua_Hook func, int mask, int count);
 LUA_API lua_Hook (lua_gethook) (lua_State *L);
 LUA_API int (lua_gethookmask) (lua_State *L);
 LUA_API int (lua_gethookcount) (lua_State *L);
 
+/*
+** Line coverage (needs LUA_COVERAGE, see luaconf.h): calls 'f' once
+** per source line of the Lua function at 'funcindex' and of every
+** function nested in it, with hit = 1 if any code of that line has run.
+** A line shared by several functions may be reported more than once.
+** Returns 0 if coverage is not available. 'f' must not call into Lua.
+*/
+typedef void (*lua_CoverageLine) (void *ud, const char *source, int line,
+                                  int hit);
+
+LUA_API int (lua_getcoverage) (lua_State *L, int funcindex,
+                               lua_CoverageLine f, void *ud);
+
 
 struct lua_Debug {
   int event;
@@ -254,6 +254,15 @@
 #define LUAI_MAXSHORTLEN        40
 
 
+/*
+@@ LUA_COVERAGE makes the interpreter record which instructions of
+** each function have run, one bit per instruction, for line coverage
+** (see lua_getcoverage). It costs a test per instruction executed,
+** instead of a hook call per line, so it is off unless you define it.
+*/
+/* #define LUA_COVERAGE */
+
+
 
 /*
 ** {==================================================================
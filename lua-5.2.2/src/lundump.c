@@ -177,6 +177,7 @@ static void LoadFunction(LoadState* S, Proto* f)
  f->maxstacksize=LoadByte(S);
  LoadCode(S,f);
  LoadConstants(S,f);
+ luaF_initicache(S->L,f);
  LoadUpvalues(S,f);
  LoadDebug(S,f);
 }
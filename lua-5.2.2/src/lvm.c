@@ -18,6 +18,7 @@
 #include "ldo.h"
 #include "lfunc.h"
 #include "lgc.h"
+#include "lmem.h"
 #include "lobject.h"
 #include "lopcodes.h"
 #include "lstate.h"
@@ -152,6 +153,7 @@ void luaV_settable (lua_State *L, const TValue *t, TValue *key, StkId val) {
          (oldval = luaH_newkey(L, h, key), 1)))) {
         /* no metamethod and (now) there is an entry with given key */
         setobj2t(L, oldval, val);  /* assign new value to that entry */
+        updateborder(h, oldval);
         invalidateTMcache(h);
         luaC_barrierback(L, obj2gco(h), val);
         return;
@@ -517,6 +519,190 @@ void luaV_finishOp (lua_State *L) {
            luai_threadyield(L); )
 
 
+/*
+** Inline caches: a table access with a constant short string key has a
+** cache (see luaF_initicache) that remembers where it last found its key.
+** That is the index of a node, only trusted while it is below the size
+** of the table's current node vector and that node still holds the key
+** (a node pointer could not be checked: luaH_resize may put a smaller
+** vector where the old one was), or, for a table with a shape, the shape
+** and the key's slot (checked against the shape's size too: a freed shape
+** may come back as another one). Either way the value must not be nil, so
+** a hit costs a few compares.
+*/
+#define vmicache()	icacheat(cl->p, pcRel(ci->u.l.savedpc, cl->p))
+
+/* cache of table access 'pc' of 'p' (see luaF_initicache) */
+#define icacheat(p,pc)	(&(p)->icache[(p)->icacheidx[pc]])
+
+#define nodehit(h,i,key) \
+  (cast(unsigned int, i) < cast(unsigned int, sizenode(h)) && \
+   ttisshrstring(gkey(gnode(h, i))) && \
+   rawtsvalue(gkey(gnode(h, i))) == (key) && !ttisnil(gval(gnode(h, i))))
+
+/* 'c' is an ICache or an IndexChain (for its holder) */
+#define icachehit(h,c,key) \
+  ((h)->shape != NULL ? \
+     (h)->shape == (c)->shape && (c)->slot < (c)->shape->n && \
+     (c)->shape->keys[(c)->slot] == (key) && \
+     !ttisnil(&(h)->slots[(c)->slot]) : \
+   nodehit(h, (c)->node, key))
+
+#define icacheval(h,c) \
+  ((h)->shape != NULL ? &(h)->slots[(c)->slot] : gval(gnode(h, (c)->node)))
+
+/*
+** remember in 'c' where table 'h' keeps value 'v'; a node outside the
+** current vector (one still in 'old' during a rehash) is not remembered
+*/
+#define icachefill(h,c,v) \
+  { if ((h)->shape != NULL) { \
+      (c)->shape = (h)->shape; (c)->slot = cast_int((v) - (h)->slots); } \
+    else { Node *n_ = gnodeofval(v); \
+      (c)->node = (n_ >= (h)->node && n_ < gnodelast(h)) ? \
+                  cast_int(n_ - (h)->node) : -1; } }
+
+
+/*
+** When the key is not in the indexed value itself, a read also remembers,
+** for up to ICACHE_WAYS metatables, the __index tables it went through
+** and the node where it found the key. Such a chain is trusted while each
+** of its tables keeps its epoch (raw stores and setmetatable change it)
+** and no table known to a cache has been freed since it was filled
+** (which could bring its address back as another table).
+*/
+static int chainhit (global_State *g, const IndexChain *c, Table *mt,
+                     TString *key) {
+  int k;
+  if (c->mt != mt || c->gen != g->icachegen)
+    return 0;
+  for (k = 0; k < c->n; k++)
+    if (c->t[k]->epoch != c->epoch[k]) return 0;
+  return icachehit(c->holder, c, key);
+}
+
+
+/*
+** follow __index from metatable 'mt' the way luaV_gettable does, filling
+** 'c' on the way; returns NULL when the chain cannot be cached (it does
+** not end at a table holding the key within ICACHE_DEPTH steps)
+*/
+static const TValue *fillchain (lua_State *L, IndexChain *c, Table *mt,
+                                TString *key) {
+  Table *m = mt;
+  int n = 0;
+  int depth;
+  c->mt = NULL;  /* invalid until complete */
+  for (depth = 0; depth < ICACHE_DEPTH; depth++) {
+    const TValue *tm = fasttm(L, m, TM_INDEX);
+    const TValue *res;
+    Table *h;
+    if (tm == NULL || !ttistable(tm))  /* no __index, or a function? */
+      return NULL;
+    h = hvalue(tm);
+    c->t[n] = m; c->epoch[n++] = m->epoch;
+    res = luaH_getstr(h, key);
+    if (!ttisnil(res)) {  /* found it */
+      int k;
+      for (k = 0; k < n; k++) c->t[k]->incache = 1;
+      h->incache = 1;
+      c->mt = mt;
+      c->holder = h;
+      icachefill(h, c, res);
+      c->gen = G(L)->icachegen;
+      c->n = n;
+      return res;
+    }
+    if ((m = h->metatable) == NULL || depth == ICACHE_DEPTH - 1)
+      return NULL;
+    c->t[n] = h; c->epoch[n++] = h->epoch;
+  }
+  return NULL;
+}
+
+
+static const TValue *getchain (lua_State *L, ICache *ic, Table *mt,
+                               TString *key) {
+  global_State *g = G(L);
+  IndexChain *c = ic->chains;
+  int w;
+  if (c == NULL) {  /* first use of a chain at this instruction? */
+    c = ic->chains = luaM_newvector(L, ICACHE_WAYS, IndexChain);
+    for (w = 0; w < ICACHE_WAYS; w++) { c[w].mt = NULL; c[w].node = -1; }
+  }
+  for (w = 0; w < ICACHE_WAYS; w++)
+    if (chainhit(g, &c[w], mt, key)) return icacheval(c[w].holder, &c[w]);
+  /* refill the way of 'mt', or a free one, or else its default way */
+  for (w = 0; w < ICACHE_WAYS; w++)
+    if (c[w].mt == mt) break;
+  if (w == ICACHE_WAYS) {
+    for (w = 0; w < ICACHE_WAYS; w++)
+      if (c[w].mt == NULL || c[w].gen != g->icachegen) break;
+    if (w == ICACHE_WAYS)
+      w = lmod(IntPoint(mt) >> 4, ICACHE_WAYS);
+  }
+  return fillchain(L, &c[w], mt, key);
+}
+
+
+static void gettablecached (lua_State *L, const TValue *t, TValue *key,
+                            StkId val, ICache *ic) {
+  if (ttisshrstring(key)) {
+    TString *k = rawtsvalue(key);
+    const TValue *res;
+    Table *mt;
+    if (ttistable(t)) {
+      Table *h = hvalue(t);
+      if (icachehit(h, ic, k)) {
+        setobj2s(L, val, icacheval(h, ic));
+        return;
+      }
+      res = luaH_getstr(h, k);
+      if (!ttisnil(res)) {
+        icachefill(h, ic, res);
+        setobj2s(L, val, res);
+        return;
+      }
+      mt = h->metatable;  /* absent: may have to try __index */
+    }
+    else if (ttisuserdata(t))
+      mt = uvalue(t)->metatable;
+    else
+      mt = G(L)->mt[ttypenv(t)];
+    if (mt != NULL && (res = getchain(L, ic, mt, k)) != NULL) {
+      setobj2s(L, val, res);
+      return;
+    }
+  }
+  luaV_gettable(L, t, key, val);
+}
+
+
+static void settablecached (lua_State *L, const TValue *t, TValue *key,
+                            StkId val, ICache *ic) {
+  if (ttistable(t) && ttisshrstring(key)) {
+    Table *h = hvalue(t);
+    TValue *cell;
+    if (icachehit(h, ic, rawtsvalue(key)))
+      cell = icacheval(h, ic);
+    else {
+      const TValue *res = luaH_getstr(h, rawtsvalue(key));
+      if (ttisnil(res)) {  /* new key? may have to try metamethods */
+        luaV_settable(L, t, key, val);
+        return;
+      }
+      icachefill(h, ic, res);
+      cell = cast(TValue *, res);
+    }
+    setobj2t(L, cell, val);
+    invalidateTMcache(h);
+    luaC_barrierback(L, obj2gco(h), val);
+  }
+  else
+    luaV_settable(L, t, key, val);
+}
+
+
 #define arith_op(op,tm) { \
         TValue *rb = RKB(i); \
         TValue *rc = RKC(i); \
@@ -527,32 +713,92 @@ void luaV_finishOp (lua_State *L) {
         else { Protect(luaV_arith(L, ra, rb, rc, tm)); } }
 
 
+/*
+** Threaded dispatch: with labels as values (a GCC/Clang extension), each
+** opcode ends with its own jump through 'disptab' to the next one instead
+** of going back to a shared 'switch'. Define LUA_USE_JUMPTABLE as 0 to
+** build the 'switch' anyway.
+*/
+#if !defined(LUA_USE_JUMPTABLE)
+#if defined(__GNUC__) && !defined(LUA_ANSI)
+#define LUA_USE_JUMPTABLE	1
+#else
+#define LUA_USE_JUMPTABLE	0
+#endif
+#endif
+
+
+/* fetch the next instruction into 'i' (and its register 'ra') */
+#if defined(LUA_COVERAGE)
+#define vmcoverage()	luaF_markcoverage(cl->p, \
+                          cast_int(ci->u.l.savedpc - cl->p->code) - 1)
+#else
+#define vmcoverage()	((void)0)
+#endif
+
+#define vmfetch()	{ \
+    i = *(ci->u.l.savedpc++); \
+    vmcoverage(); \
+    if ((L->hookmask & (LUA_MASKLINE | LUA_MASKCOUNT)) && \
+        (--L->hookcount == 0 || L->hookmask & LUA_MASKLINE)) { \
+      Protect(traceexec(L)); \
+    } \
+    /* WARNING: several calls may realloc the stack and invalidate `ra' */ \
+    ra = RA(i); \
+    lua_assert(base == ci->u.l.base); \
+    lua_assert(base <= L->top && L->top < L->stack + L->stacksize); }
+
+#if LUA_USE_JUMPTABLE
+#define vmdispatch(o)	goto *disptab[o];
+#define vmcase(l,b)	L_##l: {b}  vmfetch(); vmdispatch(GET_OPCODE(i))
+#define vmcasenb(l,b)	L_##l: {b}		/* nb = no break */
+#else
 #define vmdispatch(o)	switch(o)
 #define vmcase(l,b)	case l: {b}  break;
 #define vmcasenb(l,b)	case l: {b}		/* nb = no break */
+#endif
 
 void luaV_execute (lua_State *L) {
   CallInfo *ci = L->ci;
   LClosure *cl;
   TValue *k;
   StkId base;
+#if LUA_USE_JUMPTABLE
+  static const void *const disptab[NUM_OPCODES] = {
+    [OP_MOVE] = &&L_OP_MOVE, [OP_LOADK] = &&L_OP_LOADK,
+    [OP_LOADKX] = &&L_OP_LOADKX, [OP_LOADBOOL] = &&L_OP_LOADBOOL,
+    [OP_LOADNIL] = &&L_OP_LOADNIL, [OP_GETUPVAL] = &&L_OP_GETUPVAL,
+    [OP_GETTABUP] = &&L_OP_GETTABUP, [OP_GETTABLE] = &&L_OP_GETTABLE,
+    [OP_SETTABUP] = &&L_OP_SETTABUP, [OP_SETUPVAL] = &&L_OP_SETUPVAL,
+    [OP_SETTABLE] = &&L_OP_SETTABLE, [OP_NEWTABLE] = &&L_OP_NEWTABLE,
+    [OP_SELF] = &&L_OP_SELF, [OP_ADD] = &&L_OP_ADD, [OP_SUB] = &&L_OP_SUB,
+    [OP_MUL] = &&L_OP_MUL, [OP_DIV] = &&L_OP_DIV, [OP_MOD] = &&L_OP_MOD,
+    [OP_POW] = &&L_OP_POW, [OP_UNM] = &&L_OP_UNM, [OP_NOT] = &&L_OP_NOT,
+    [OP_LEN] = &&L_OP_LEN, [OP_CONCAT] = &&L_OP_CONCAT,
+    [OP_JMP] = &&L_OP_JMP, [OP_EQ] = &&L_OP_EQ, [OP_LT] = &&L_OP_LT,
+    [OP_LE] = &&L_OP_LE, [OP_TEST] = &&L_OP_TEST,
+    [OP_TESTSET] = &&L_OP_TESTSET, [OP_CALL] = &&L_OP_CALL,
+    [OP_TAILCALL] = &&L_OP_TAILCALL, [OP_RETURN] = &&L_OP_RETURN,
+    [OP_FORLOOP] = &&L_OP_FORLOOP, [OP_FORPREP] = &&L_OP_FORPREP,
+    [OP_TFORCALL] = &&L_OP_TFORCALL, [OP_TFORLOOP] = &&L_OP_TFORLOOP,
+    [OP_SETLIST] = &&L_OP_SETLIST, [OP_CLOSURE] = &&L_OP_CLOSURE,
+    [OP_VARARG] = &&L_OP_VARARG, [OP_EXTRAARG] = &&L_OP_EXTRAARG
+  };
+#endif
  newframe:  /* reentry point when frame changes (call/return) */
   lua_assert(ci == L->ci);
   cl = clLvalue(ci->func);
+#if defined(LUA_COVERAGE)
+  if (cl->p->coverage == NULL)
+    luaF_initcoverage(L, cl->p);  /* cannot run a collection step */
+#endif
   k = cl->p->k;
   base = ci->u.l.base;
   /* main loop of interpreter */
   for (;;) {
-    Instruction i = *(ci->u.l.savedpc++);
+    Instruction i;
     StkId ra;
-    if ((L->hookmask & (LUA_MASKLINE | LUA_MASKCOUNT)) &&
-        (--L->hookcount == 0 || L->hookmask & LUA_MASKLINE)) {
-      Protect(traceexec(L));
-    }
-    /* WARNING: several calls may realloc the stack and invalidate `ra' */
-    ra = RA(i);
-    lua_assert(base == ci->u.l.base);
-    lua_assert(base <= L->top && L->top < L->stack + L->stacksize);
+    vmfetch();
     vmdispatch (GET_OPCODE(i)) {
       vmcase(OP_MOVE,
         setobjs2s(L, ra, RB(i));
@@ -583,14 +829,14 @@ void luaV_execute (lua_State *L) {
       )
       vmcase(OP_GETTABUP,
         int b = GETARG_B(i);
-        Protect(luaV_gettable(L, cl->upvals[b]->v, RKC(i), ra));
+        Protect(gettablecached(L, cl->upvals[b]->v, RKC(i), ra, vmicache()));
       )
       vmcase(OP_GETTABLE,
-        Protect(luaV_gettable(L, RB(i), RKC(i), ra));
+        Protect(gettablecached(L, RB(i), RKC(i), ra, vmicache()));
       )
       vmcase(OP_SETTABUP,
         int a = GETARG_A(i);
-        Protect(luaV_settable(L, cl->upvals[a]->v, RKB(i), RKC(i)));
+        Protect(settablecached(L, cl->upvals[a]->v, RKB(i), RKC(i), vmicache()));
       )
       vmcase(OP_SETUPVAL,
         UpVal *uv = cl->upvals[GETARG_B(i)];
@@ -598,7 +844,7 @@ void luaV_execute (lua_State *L) {
         luaC_barrier(L, uv, ra);
       )
       vmcase(OP_SETTABLE,
-        Protect(luaV_settable(L, ra, RKB(i), RKC(i)));
+        Protect(settablecached(L, ra, RKB(i), RKC(i), vmicache()));
       )
       vmcase(OP_NEWTABLE,
         int b = GETARG_B(i);
@@ -606,13 +852,13 @@ void luaV_execute (lua_State *L) {
         Table *t = luaH_new(L);
         sethvalue(L, ra, t);
         if (b != 0 || c != 0)
-          luaH_resize(L, t, luaO_fb2int(b), luaO_fb2int(c));
+          luaH_presize(L, t, luaO_fb2int(b), luaO_fb2int(c));
         checkGC(L, ra + 1);
       )
       vmcase(OP_SELF,
         StkId rb = RB(i);
         setobjs2s(L, ra+1, rb);
-        Protect(luaV_gettable(L, rb, RKC(i), ra));
+        Protect(gettablecached(L, rb, RKC(i), ra, vmicache()));
       )
       vmcase(OP_ADD,
         arith_op(luai_numadd, TM_ADD);
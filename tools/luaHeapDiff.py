@@ -0,0 +1,179 @@
+#!/usr/bin/env python
+#  luaHeapDiff.py
+#
+#  Created by pauley on 8/1/14.
+#  Copyright (c) 2014 Anki. All rights reserved.
+#
+#  Compares two heap snapshots written by LuaContext::WriteHeapSnapshot and
+#  reports the objects whose retained size grew the most, with a path from
+#  a root to each of them.
+#
+#  usage: luaHeapDiff.py before.snapshot after.snapshot [count]
+#
+#  An object retains everything it dominates: whatever would be freed if
+#  that object went away.
+
+from __future__ import print_function
+import sys
+from collections import deque
+
+ROOT = "0"
+
+
+class Snapshot(object):
+    def __init__(self, fileName):
+        self.types = {}
+        self.sizes = {}
+        self.refs = {ROOT: []}
+        with open(fileName) as snapshotFile:
+            header = snapshotFile.readline().strip()
+            if header != "lua-heap-snapshot 1":
+                raise ValueError("%s is not a heap snapshot (%s)" % (fileName, header))
+            for line in snapshotFile:
+                fields = line.rstrip("\n").split("\t")
+                if fields[0] == "o":
+                    self.types[fields[1]] = fields[2]
+                    self.sizes[fields[1]] = int(fields[3])
+                    self.refs.setdefault(fields[1], [])
+                elif fields[0] == "r":
+                    name = fields[3] if len(fields) > 3 else ""
+                    self.refs.setdefault(fields[1], []).append((fields[2], name))
+        self.sizes[ROOT] = 0
+        self.types[ROOT] = "root"
+        self._ComputeDominators()
+        self._ComputeRetainedSizes()
+        self._ComputePaths()
+
+    def Key(self, obj):
+        # Addresses get reused, only count an object as the same one if its type matches too.
+        return (obj, self.types[obj])
+
+    def _Successors(self, obj):
+        # References to objects that aren't in the snapshot (already dead) are ignored.
+        return [to for (to, _) in self.refs.get(obj, []) if to in self.sizes]
+
+    def _ComputeDominators(self):
+        # Cooper, Harvey & Kennedy, "A Simple, Fast Dominance Algorithm".
+        order = []
+        visited = set([ROOT])
+        stack = [(ROOT, iter(self._Successors(ROOT)))]
+        while stack:
+            obj, successors = stack[-1]
+            advanced = False
+            for successor in successors:
+                if successor not in visited:
+                    visited.add(successor)
+                    stack.append((successor, iter(self._Successors(successor))))
+                    advanced = True
+                    break
+            if not advanced:
+                order.append(obj)
+                stack.pop()
+        order.reverse()
+        self.reachable = order
+        postIndex = dict((obj, len(order) - 1 - i) for (i, obj) in enumerate(order))
+
+        predecessors = dict((obj, []) for obj in order)
+        for obj in order:
+            for successor in self._Successors(obj):
+                predecessors[successor].append(obj)
+
+        idom = {ROOT: ROOT}
+        changed = True
+        while changed:
+            changed = False
+            for obj in order[1:]:
+                newIdom = None
+                for predecessor in predecessors[obj]:
+                    if predecessor not in idom:
+                        continue
+                    if newIdom is None:
+                        newIdom = predecessor
+                        continue
+                    a, b = predecessor, newIdom
+                    while a != b:
+                        while postIndex[a] < postIndex[b]:
+                            a = idom[a]
+                        while postIndex[b] < postIndex[a]:
+                            b = idom[b]
+                    newIdom = a
+                if newIdom is not None and idom.get(obj) != newIdom:
+                    idom[obj] = newIdom
+                    changed = True
+        self.idom = idom
+
+    def _ComputeRetainedSizes(self):
+        retained = dict((obj, self.sizes[obj]) for obj in self.reachable)
+        # reachable is in reverse postorder (dominators first), walk it backwards.
+        for obj in reversed(self.reachable[1:]):
+            retained[self.idom[obj]] += retained[obj]
+        self.retained = retained
+
+    def _ComputePaths(self):
+        # Shortest path from a root, for display.
+        self.parent = {ROOT: None}
+        queue = deque([ROOT])
+        while queue:
+            obj = queue.popleft()
+            for (to, name) in self.refs.get(obj, []):
+                if to in self.sizes and to not in self.parent:
+                    self.parent[to] = (obj, name)
+                    queue.append(to)
+
+    def Path(self, obj):
+        names = []
+        while self.parent.get(obj) is not None:
+            obj, name = self.parent[obj]
+            names.append(name if name else "?")
+        names.reverse()
+        return ".".join(names)
+
+
+def FormatBytes(count):
+    sign = "-" if count < 0 else "+"
+    count = abs(count)
+    if count < 1024:
+        return "%s%dB" % (sign, count)
+    if count < 1024 * 1024:
+        return "%s%.1fKB" % (sign, count / 1024.0)
+    return "%s%.1fMB" % (sign, count / (1024.0 * 1024.0))
+
+
+def main(argv):
+    if len(argv) < 3:
+        print("usage: %s before.snapshot after.snapshot [count]" % argv[0])
+        return 1
+    before = Snapshot(argv[1])
+    after = Snapshot(argv[2])
+    count = int(argv[3]) if len(argv) > 3 else 20
+
+    beforeRetained = dict((before.Key(obj), size) for (obj, size) in before.retained.items())
+    growth = {}
+    for obj in after.reachable[1:]:
+        delta = after.retained[obj] - beforeRetained.get(after.Key(obj), 0)
+        if delta > 0:
+            growth[obj] = delta
+
+    # Everything above a leak in the dominator tree grows by the same amount.  Only list an object
+    #  if no single object it dominates explains (nearly) all of its growth.
+    largestChildGrowth = {}
+    for (obj, delta) in growth.items():
+        dominator = after.idom[obj]
+        largestChildGrowth[dominator] = max(largestChildGrowth.get(dominator, 0), delta)
+    culprits = [(delta, obj) for (obj, delta) in growth.items()
+                if largestChildGrowth.get(obj, 0) < 0.9 * delta]
+    culprits.sort(reverse=True)
+
+    totalBefore = before.retained[ROOT]
+    totalAfter = after.retained[ROOT]
+    print("live heap: %d -> %d bytes (%s)" % (totalBefore, totalAfter, FormatBytes(totalAfter - totalBefore)))
+    print("")
+    print("largest retained size growth:")
+    for (delta, obj) in culprits[:count]:
+        print("  %10s  %-9s %8d bytes retained  %s" % (FormatBytes(delta), after.types[obj],
+                                                        after.retained[obj], after.Path(obj)))
+    return 0
+
+
+if __name__ == "__main__":
+    sys.exit(main(sys.argv))
@@ -0,0 +1,74 @@
+#!/usr/bin/env python
+#  luaOpcodePairs.py
+#
+#  Created by pauley on 8/5/14.
+#  Copyright (c) 2014 Anki. All rights reserved.
+#
+#  Counts which pairs of adjacent instructions occur most often in compiled scripts, using the
+#  listings from "luac -l".  Run it over the game scripts before fusing a pair into a
+#  superinstruction: a pair only pays for the extra VM code if it is both frequent and hot.
+#
+#  usage: luaOpcodePairs.py [--luac path/to/luac] [--count N] script.lua...
+
+from __future__ import print_function
+import re
+import subprocess
+import sys
+from collections import Counter
+
+INSTRUCTION = re.compile(r"^\s+\d+\s+\[-?\d+\]\s+([A-Z_]+)\s")
+FUNCTION = re.compile(r"^(main|function) <")
+
+
+def ListFunctions(luac, fileName):
+    listing = subprocess.check_output([luac, "-l", "-p", fileName]).decode("utf-8", "replace")
+    functions = []
+    for line in listing.splitlines():
+        if FUNCTION.match(line):
+            functions.append([])
+            continue
+        match = INSTRUCTION.match(line)
+        if match and functions:
+            functions[-1].append(match.group(1))
+    return functions
+
+
+def main(argv):
+    luac = "luac"
+    count = 20
+    fileNames = []
+    args = iter(argv[1:])
+    for arg in args:
+        if arg == "--luac":
+            luac = next(args)
+        elif arg == "--count":
+            count = int(next(args))
+        else:
+            fileNames.append(arg)
+    if not fileNames:
+        print("usage: %s [--luac path/to/luac] [--count N] script.lua..." % argv[0])
+        return 1
+
+    opcodes = Counter()
+    pairs = Counter()
+    for fileName in fileNames:
+        for function in ListFunctions(luac, fileName):
+            opcodes.update(function)
+            pairs.update(zip(function, function[1:]))
+
+    totalOpcodes = sum(opcodes.values())
+    totalPairs = sum(pairs.values())
+    print("%d instructions, %d pairs in %d files" % (totalOpcodes, totalPairs, len(fileNames)))
+    print("")
+    print("most frequent opcodes:")
+    for (opcode, n) in opcodes.most_common(count):
+        print("  %6d  %5.1f%%  %s" % (n, 100.0 * n / totalOpcodes, opcode))
+    print("")
+    print("most frequent pairs:")
+    for ((first, second), n) in pairs.most_common(count):
+        print("  %6d  %5.1f%%  %s %s" % (n, 100.0 * n / max(totalPairs, 1), first, second))
+    return 0
+
+
+if __name__ == "__main__":
+    sys.exit(main(sys.argv))
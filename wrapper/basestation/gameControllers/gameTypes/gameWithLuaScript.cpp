@@ -7,8 +7,10 @@
 //
 
 #include "gameWithLuaScript.h"
+#include "gameWithLuaScriptInternal.h"
 #include "basestation/ui/platform/platform.h"
 #include "basestation/utils/parameters.h"
+#include "basestation/utils/timer.h"
 #include "util/parsingConstants/parsingConstants.h"
 #include "basestation/ui/messaging/messages/gameStateMessage.h"
 #include "basestation/ui/messaging/messageQueue.h"
@@ -27,12 +29,14 @@
 
 #include <boost/foreach.hpp>
 #include <boost/property_tree/ptree.hpp>
+#include <algorithm>
 
 namespace BaseStation {
   
   GameWithLuaScript::GameWithLuaScript(const MetaGame::GameSettings& settings, VehicleGameStatePtrMap &vehicleStates) : GameType(settings, vehicleStates),
   spacingScript_(NULL),
-  vehicleScript_(NULL)
+  vehicleScript_(NULL),
+  scriptThread_([this]{ RunScript(); })
   {
     std::string basestationPath = SystemParameters::getInstance()->baseConfigurationPath_;
     std::string scriptsDir = basestationPath;
@@ -45,6 +49,8 @@ namespace BaseStation {
     luaContext_->RequireModule(*gameBridge);
     luaModules_.push_back(gameBridge); // TODO Consider moving the module into the luaScript to set context upon ::Resume
     
+    // Loading the script runs its main chunk, which may already ask about the game.
+    PublishStateSnapshot();
     luaScript_ = luaContext_->CreateLuaScriptWithFile(myScript);
     
     for (VehicleGameStatePtrMap::iterator iter = vehicleStates_.begin(); iter != vehicleStates_.end(); iter ++)
@@ -57,6 +63,7 @@ namespace BaseStation {
   
   GameWithLuaScript::~GameWithLuaScript()
   {
+    SetRunScriptAsync(false);
     Anki::Util::SafeDelete( luaScript_ );
     Anki::Util::SafeDelete( luaContext_ );
     
@@ -76,15 +83,101 @@ namespace BaseStation {
       iter->second->GetParentVehicle()->operatingMode_ = VEHICLE_OPERATING_MODE_DRONE;
     }
     
+    if(scriptThread_.IsStarted()) {
+      // Tick boundary: last tick's script run has to be over before we apply what it asked for
+      //  and overwrite the snapshot it was reading.
+      scriptThread_.WaitForRun();
+      FinishScriptRun();
+      PublishStateSnapshot();
+      scriptThread_.StartRun();
+    }
+    else {
+      PublishStateSnapshot();
+      RunScript();
+      FinishScriptRun();
+    }
+  }
+  
+#pragma mark Script thread
+  void GameWithLuaScript::PublishStateSnapshot()
+  {
+    // The script has finished with everything but the published buffer, so the other one is free.
+    GameStateSnapshot& snapshot = stateSnapshots_.GetNext();
+    
+    snapshot.gameTime = BaseStationTimer::getInstance()->GetCurrentTimeInSeconds();
+    snapshot.vehiclesInFormation = vehiclesAreInFormation();
+    snapshot.timeInFormation = timeInFormation();
+    snapshot.allVehiclesLocalized = true;
+    snapshot.vehicles.clear();
+    for (VehicleGameStatePtrMap::iterator iter = vehicleStates_.begin(); iter != vehicleStates_.end(); iter ++)
+    {
+      VehicleGameState* vehicleState = iter->second;
+      Vehicle* vehicle = vehicleState->GetParentVehicle();
+      if(!vehicleState->IsLocalized()) {
+        snapshot.allVehiclesLocalized = false;
+      }
+      VehicleSnapshot vehicleSnapshot;
+      vehicleSnapshot.vehicleID = iter->first;
+      vehicleSnapshot.isLocalized = vehicle->vehicleState_.localized_;
+      vehicleSnapshot.speed = vehicleState->GetTrackerValue(TT_CURRENT_SPEED);
+      vehicleSnapshot.lanePosition = vehicle->vehicleState_.vehiclePosition_.GetCurrLane();
+      vehicleSnapshot.kills = (int)vehicleState->GetTrackerValue(TT_KILLS);
+      vehicleSnapshot.isAI = (vehicle->operatingMode_ == VEHICLE_OPERATING_MODE_AI);
+      snapshot.vehicles.push_back(vehicleSnapshot);
+    }
+    std::sort(snapshot.vehicles.begin(), snapshot.vehicles.end(),
+              [](const VehicleSnapshot& a, const VehicleSnapshot& b) { return a.vehicleID < b.vehicleID; });
+    
+    stateSnapshots_.Publish();
+  }
+  
+  // Runs on the script thread when async.
+  void GameWithLuaScript::RunScript()
+  {
     // TODO make sure that script time is limited
     luaScript_->Resume();
     // not sure what should be on the stack here..
     // currently we return nothing
-
+    luaContext_->CollectGarbage();
+  }
+  
+  // Back on the simulation thread, with the script idle.
+  void GameWithLuaScript::FinishScriptRun()
+  {
+    scriptCommands_.Drain([this](ScriptCommandType type, ScriptConfig const &config) {
+      ApplyScriptCommand(type, config);
+    });
+    
     if(!luaScript_->IsAlive()) {
       NormalGameEnd(false);
     }
-    luaContext_->CollectGarbage();
+  }
+  
+  void GameWithLuaScript::ApplyScriptCommand(ScriptCommandType type, ScriptConfig const &config)
+  {
+    switch(type) {
+      case ScriptCommandType::GoalReached:
+        GoalReached();
+        break;
+      case ScriptCommandType::SetEqualSpacingScript:
+        updateEqualSpacingScript(config.header, config.conf);
+        break;
+      case ScriptCommandType::SetVehicleScript:
+        updateVehicleScript(config.header, config.conf);
+        break;
+      case ScriptCommandType::Count:
+        break;
+    }
+  }
+  
+  void GameWithLuaScript::SetRunScriptAsync(bool runScriptAsync)
+  {
+    if(runScriptAsync) {
+      scriptThread_.Start();
+    }
+    else {
+      scriptThread_.Stop();
+    }
   }
   
   // This could probably be an iterator..
@@ -133,22 +226,23 @@ namespace BaseStation {
     
   }
   
-  void GameWithLuaScript::updateEqualSpacingScript(boost::property_tree::ptree const &conf)
+  void GameWithLuaScript::updateEqualSpacingScript(ScriptConfigHeader const &header, boost::property_tree::ptree const &conf)
   {
-    updateScriptWithConfig<VehicleFormation>(conf, spacingScript_, spacingScriptConf_);
+    updateScriptWithConfig<VehicleFormation>(header, conf, spacingScript_, spacingScriptHeader_, spacingScriptConf_);
   }
   
   void GameWithLuaScript::setVehicleScript(VehicleScript* vehicleScript) {
     
   }
   
-  void GameWithLuaScript::updateVehicleScript(boost::property_tree::ptree const &conf)
+  void GameWithLuaScript::updateVehicleScript(ScriptConfigHeader const &header, boost::property_tree::ptree const &conf)
   {
-    updateScriptWithConfig<VehicleScript>(conf, vehicleScript_, vehicleScriptConf_);
+    updateScriptWithConfig<VehicleScript>(header, conf, vehicleScript_, vehicleScriptHeader_, vehicleScriptConf_);
   }
   
   template <typename T>
-  void GameWithLuaScript::updateScriptWithConfig(boost::property_tree::ptree const &conf, T* &curScript, ptree &curScriptConf)
+  void GameWithLuaScript::updateScriptWithConfig(ScriptConfigHeader const &header, boost::property_tree::ptree const &conf,
+                                                 T* &curScript, ScriptConfigHeader &curScriptHeader, ptree &curScriptConf)
   {
     
     if(curScript && !VehicleScriptController::getInstance()->IsScriptRunning(curScript)) {
@@ -158,20 +252,20 @@ namespace BaseStation {
     
     // get script and start it if needed
     T *scriptToRemove = curScript;
-    boost::optional<string> oldScriptTypeOptional = curScriptConf.get_optional<string>(kP_TYPE);
-    curScriptConf.clear();
-    curScriptConf = conf;
-    
-    bool deleteOldScript = curScriptConf.get(kP_DELETE_OLD_SCRIPT, false);
-    boost::optional<string> newScriptTypeOptional = curScriptConf.get_optional<string>(kP_TYPE);
+    const bool sameScriptType = (!curScriptHeader.type.empty() && curScriptHeader.type == header.type);
+    curScriptHeader = header;
     
-    if (oldScriptTypeOptional
-        && newScriptTypeOptional
-        && ((string)(*oldScriptTypeOptional)).compare(*newScriptTypeOptional) == 0
-        && !deleteOldScript
+    if (sameScriptType
+        && !header.deleteOldScript
         && curScript != NULL) {
       scriptToRemove = NULL;
-      curScript->SetGameStateChanged(curScriptConf);
+      // Scripts send (mostly) the same config every tick, only pass on what actually changed.
+      ptree changedConf;
+      const bool isDelta = GameWithLuaScriptInternal::UpdateConfigInPlace(curScriptConf, conf, changedConf);
+      if(isDelta && changedConf.empty()) {
+        return;
+      }
+      curScript->SetGameStateChanged(isDelta ? changedConf : curScriptConf);
       /* 
        HELP! How do we log now?
       PRINT_NAMED_INFO("GameWithLuaScript.updateScriptWithConfig.update",
@@ -187,6 +281,7 @@ namespace BaseStation {
                        curScriptConf.get<string>(kP_TYPE).c_str(),
                        typeid(T).name());
        */
+      curScriptConf = conf;
       curScript = static_cast<T*>(VehicleScriptFactory::getInstance()->SpawnScript(curScriptConf));
     }
     
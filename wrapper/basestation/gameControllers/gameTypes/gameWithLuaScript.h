@@ -12,6 +12,9 @@
 
 #include <boost/property_tree/ptree_fwd.hpp>
 #include "basestation/vehicle/script/formation/vehicleFormation.h"
+#include "basestation/luaModules/gameStateSnapshot.h"
+#include "basestation/luaModules/scriptCommandBuffer.h"
+#include "basestation/luaModules/scriptRunThread.h"
 #include "basestation/gameControllers/gameTypes/gameType.h"
 
 namespace Metagame {
@@ -47,27 +50,56 @@ namespace BaseStation {
     void GoalReached();
     
     void setVehicleFormation(VehicleFormation* formation);
-    void updateEqualSpacingScript(boost::property_tree::ptree const &conf);
+    void updateEqualSpacingScript(ScriptConfigHeader const &header, boost::property_tree::ptree const &conf);
     
     void setVehicleScript(VehicleScript* vehicleScript);
-    void updateVehicleScript(boost::property_tree::ptree const &conf);
+    void updateVehicleScript(ScriptConfigHeader const &header, boost::property_tree::ptree const &conf);
     
+#pragma mark Script thread interface
+    // The game state as of the start of the current tick.  This is all the bridge should read,
+    //  it stays valid and unchanged until the script run for this tick is over.
+    const GameStateSnapshot& GetStateSnapshot() const { return stateSnapshots_.GetPublished(); }
+    
+    // Script side effects (goal reached, script changes) don't touch the game directly,
+    //  the bridge appends them here and they are applied on the simulation thread at the next tick boundary.
+    ScriptCommandBuffer& GetScriptCommands() { return scriptCommands_; }
+    
+    // When enabled, the script for tick N runs on its own thread while the simulation
+    //  carries on with tick N+1.  Its actions are then applied one tick later.
+    void SetRunScriptAsync(bool runScriptAsync);
     
   private:
   
     GameWithLuaScript(const MetaGame::GameSettings& settings, VehicleGameStatePtrMap &vehicleStates);
+    
+    void PublishStateSnapshot();
+    void RunScript();
+    void FinishScriptRun();
+    void ApplyScriptCommand(ScriptCommandType type, ScriptConfig const &config);
 
     Anki::Util::LuaContext *luaContext_;
     Anki::Util::LuaScript *luaScript_;
     vector<Anki::Util::ILuaBridgeModule*> luaModules_;
     
-    template <typename T> void updateScriptWithConfig(boost::property_tree::ptree const &conf, T* &oldScript, ptree &oldScriptConf);
+    template <typename T> void updateScriptWithConfig(ScriptConfigHeader const &header, boost::property_tree::ptree const &conf,
+                                                      T* &oldScript, ScriptConfigHeader &oldScriptHeader, ptree &oldScriptConf);
     
     VehicleFormation *spacingScript_;
+    ScriptConfigHeader spacingScriptHeader_;
     ptree spacingScriptConf_;
     
     VehicleScript *vehicleScript_;
+    ScriptConfigHeader vehicleScriptHeader_;
     ptree vehicleScriptConf_;
+    
+    // The script only ever sees the published one.
+    GameStateSnapshotBuffer stateSnapshots_;
+    
+    // Only touched by whichever thread is running the script, or by the simulation thread
+    //  between runs (the handoff goes through scriptThread_).
+    ScriptCommandBuffer scriptCommands_;
+    
+    ScriptRunThread scriptThread_;
   };
   
 }
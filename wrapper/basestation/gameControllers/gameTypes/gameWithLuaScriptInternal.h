@@ -0,0 +1,54 @@
+//
+//  gameWithLuaScriptInternal.h
+//  BaseStation
+//
+//  Created by Mark Pauley on 7/31/14.
+//  Copyright (c) 2014 Anki. All rights reserved.
+//
+//  Description:
+//  Helpers of GameWithLuaScript that don't need a game, kept here so they can be tested on their own.
+//
+
+#ifndef BASESTATION_GAMECONTROLLERS_GAMETYPES_GAMEWITHLUASCRIPTINTERNAL_H_
+#define BASESTATION_GAMECONTROLLERS_GAMETYPES_GAMEWITHLUASCRIPTINTERNAL_H_
+
+#include <boost/property_tree/ptree.hpp>
+
+namespace BaseStation {
+namespace GameWithLuaScriptInternal {
+
+  // Brings curConf up to date with conf, reusing its nodes, and copies the top level entries that changed into changedConf.
+  //  Returns false if the change can't be expressed that way (entries added, removed or reordered),
+  //  in which case curConf is simply replaced and changedConf is left empty.
+  inline bool UpdateConfigInPlace(boost::property_tree::ptree &curConf, boost::property_tree::ptree const &conf,
+                                  boost::property_tree::ptree &changedConf)
+  {
+    using boost::property_tree::ptree;
+    bool sameLayout = (curConf.size() == conf.size());
+    ptree::const_iterator curIt = curConf.begin();
+    for(ptree::const_iterator it = conf.begin(); sameLayout && it != conf.end(); ++curIt, ++it) {
+      // Array entries (empty keys) can't be told apart by key.
+      sameLayout = (!it->first.empty() && curIt->first == it->first);
+    }
+    if(!sameLayout) {
+      curConf = conf;
+      return false;
+    }
+
+    if(curConf.data() != conf.data()) {
+      curConf.data() = conf.data();
+    }
+    ptree::iterator changeIt = curConf.begin();
+    for(ptree::const_iterator it = conf.begin(); it != conf.end(); ++changeIt, ++it) {
+      if(changeIt->second != it->second) {
+        changeIt->second = it->second;
+        changedConf.push_back(*it);
+      }
+    }
+    return true;
+  }
+
+} // namespace GameWithLuaScriptInternal
+} // namespace BaseStation
+
+#endif
@@ -8,14 +8,16 @@
 
 #include "basestation/luaModules/baseStationGameBridge.h"
 #include "util/lua/luaUtils.h"
+#include "util/lua/luaStructMarshal.h"
+#include "util/lua/luaTrace.h"
 
-#include "basestation/utils/timer.h"
-#include "basestation/ui/messaging/messages/gameStateMessage.h"
-#include "basestation/ui/messaging/messageQueue.h"
 #include "basestation/gameControllers/gameTypes/gameWithLuaScript.h"
+#include "basestation/luaModules/gameStateSnapshot.h"
+#include "basestation/luaModules/scriptCommandBuffer.h"
 
-#include "basestation/vehicle/vehicle.h"
+#include <boost/property_tree/ptree.hpp>
 #include <lua/lua.hpp>
+#include <cassert>
 
 extern "C" {
   // Forward declarations of registration routines go here.
@@ -162,32 +164,46 @@ int luaopen_BaseStationGame(lua_State *state) {
  *  lua_tostring(state, 1) => returns "one", does not need to be free'd (lua owns the string storage).
 */
 
+// Game state comes from the per-tick snapshot (see GameStateSnapshot.h), never the live game,
+//  so none of this cares which thread the script is running on.
+static const GameStateSnapshot& currentSnapshot() {
+  return _currentGame->GetGame()->GetStateSnapshot();
+}
+
+static const VehicleSnapshot& checkVehicle(lua_State* state, int index) {
+  int vehicleID = luaL_checkint(state, index);
+  const VehicleSnapshot* vehicle = currentSnapshot().FindVehicle(vehicleID);
+  if(vehicle == nullptr) {
+    luaL_error(state, "no vehicle with ID %d", vehicleID);
+  }
+  return *vehicle;
+}
+
 int goalReached(lua_State* state) {
   assert(lua_gettop(state) == 0);
-  _currentGame->GetGame()->GoalReached();
+  LUA_TRACE_SCOPE("BaseStationGame.goalReached", "bridge");
+  _currentGame->GetGame()->GetScriptCommands().AppendGoalReached();
   //PRINT_NAMED_EVENT("Game.End", "GOALREACHED"); (How to log to DAS?)
   
   return 0;
 }
 
 int gameTime(lua_State* state) {
-  double gameTime = BaseStationTimer::getInstance()->GetCurrentTimeInSeconds();
-  lua_pushnumber(state, gameTime);
+  LUA_TRACE_SCOPE("BaseStationGame.gameTime", "bridge");
+  lua_pushnumber(state, currentSnapshot().gameTime);
 
   return 1;
 }
 
-// This could maybe use some caching, so we don't have to build the vector more than once per tick..
 int vehicleIDs(lua_State* state) {
-  lua_newtable(state);
+  LUA_TRACE_SCOPE("BaseStationGame.vehicleIDs", "bridge");
+  const GameStateSnapshot& snapshot = currentSnapshot();
+  lua_createtable(state, (int)snapshot.vehicles.size(), 0);
   int i = 1;
-  vector<int> vehicleIDVector;
-  _currentGame->GetGame()->GetVehicleIDs( vehicleIDVector );
-  for (const int& vehicleID : vehicleIDVector)
+  for (const VehicleSnapshot& vehicle : snapshot.vehicles)
   {
-    lua_pushinteger(state, i);
-    lua_pushinteger(state, vehicleID);
-    lua_settable(state, -3);
+    lua_pushinteger(state, vehicle.vehicleID);
+    lua_rawseti(state, -2, i);
     i++;
   }
   
@@ -196,104 +212,108 @@ int vehicleIDs(lua_State* state) {
 }
 
 int allVehiclesAreLocalized(lua_State* state) {
-  bool result = true;
-  VehicleGameStatePtrMap gameStatePtrMap = _currentGame->GetGame()->vehicleStates();
-  for (VehicleGameStatePtrMap::iterator iter = gameStatePtrMap.begin();
-       iter != gameStatePtrMap.end();
-       iter ++) {
-    if (!iter->second->IsLocalized()) {
-      result = false;
-    }
-  }
-
-  lua_pushboolean(state, result);
+  LUA_TRACE_SCOPE("BaseStationGame.allVehiclesAreLocalized", "bridge");
+  lua_pushboolean(state, currentSnapshot().allVehiclesLocalized);
   return 1;
 }
 
 int vehicleIsLocalized(lua_State* state) {
-  luaL_checkint(state, 1);
+  const VehicleSnapshot& vehicle = checkVehicle(state, 1);
+  LUA_TRACE_SCOPE("BaseStationGame.vehicleIsLocalized", "bridge");
   
-  int vehicleID = (int)lua_tointegerx(state, 1, NULL);
   lua_pop(state, 1);
-  bool isLocalized = _currentGame->GetGame()->vehicleStateForID(vehicleID)->GetParentVehicle()->vehicleState_.localized_;
-  
-  lua_pushboolean(state, isLocalized);
+  lua_pushboolean(state, vehicle.isLocalized);
   return 1;
 }
 
 int vehicleSpeed(lua_State* state) {
-  luaL_checkint(state, 1);
+  const VehicleSnapshot& vehicle = checkVehicle(state, 1);
+  LUA_TRACE_SCOPE("BaseStationGame.vehicleSpeed", "bridge");
   
-  int vehicleID = (int)lua_tointegerx(state, 1, NULL);
   lua_pop(state, 1);
-  double speed = _currentGame->GetGame()->vehicleStateForID(vehicleID)->GetTrackerValue(TT_CURRENT_SPEED);
-  lua_pushnumber(state, speed);
+  lua_pushnumber(state, vehicle.speed);
   return 1;
 }
 
 // FIXME: This returns between 0.0 and 1.0 this seems ok.  It seems like the lane position should be an int, minLane -> maxLane.
 int vehicleLane(lua_State* state) {
-  luaL_checkint(state, 1);
+  const VehicleSnapshot& vehicle = checkVehicle(state, 1);
+  LUA_TRACE_SCOPE("BaseStationGame.vehicleLane", "bridge");
   
-  int vehicleID = (int)lua_tointegerx(state, 1, NULL);
   lua_pop(state, 1);
-  Vehicle* vehicle = _currentGame->GetGame()->vehicleStateForID(vehicleID)->GetParentVehicle();
-  double lanePos = vehicle->vehicleState_.vehiclePosition_.GetCurrLane();
-  
-  lua_pushnumber(state, lanePos);
+  lua_pushnumber(state, vehicle.lanePosition);
   return 1;
 }
 
 int vehicleKills(lua_State* state) {
-  luaL_checkint(state, 1);
+  const VehicleSnapshot& vehicle = checkVehicle(state, 1);
+  LUA_TRACE_SCOPE("BaseStationGame.vehicleKills", "bridge");
   
-  int vehicleID = (int)lua_tointegerx(state, 1, NULL);
   lua_pop(state, 1);
-  int result = _currentGame->GetGame()->vehicleStateForID(vehicleID)->GetTrackerValue(TT_KILLS);
-  
-  lua_pushinteger(state, result);
+  lua_pushinteger(state, vehicle.kills);
   return 1;
 }
 
 int vehicleIsAI(lua_State* state) {
-  luaL_checkint(state, 1);
+  const VehicleSnapshot& vehicle = checkVehicle(state, 1);
+  LUA_TRACE_SCOPE("BaseStationGame.vehicleIsAI", "bridge");
   
-  int vehicleID = (int)lua_tointegerx(state, 1, NULL);
   lua_pop(state, 1);
-  bool result = (_currentGame->GetGame()->vehicleStateForID(vehicleID)->GetParentVehicle()->operatingMode_ == VEHICLE_OPERATING_MODE_AI);
-  
-  lua_pushboolean(state, result);
+  lua_pushboolean(state, vehicle.isAI);
   return 1;
 }
 
 int areVehiclesInFormation(lua_State* state) {
-  bool result = _currentGame->GetGame()->vehiclesAreInFormation();
-  lua_pushboolean(state, result);
+  LUA_TRACE_SCOPE("BaseStationGame.areVehiclesInFormation", "bridge");
+  lua_pushboolean(state, currentSnapshot().vehiclesInFormation);
   return 1;
 }
 
 int timeInFormation(lua_State* state) {
-  double result = 0;
-  result = _currentGame->GetGame()->timeInFormation();
-  lua_pushnumber(state, result);
+  LUA_TRACE_SCOPE("BaseStationGame.timeInFormation", "bridge");
+  lua_pushnumber(state, currentSnapshot().timeInFormation);
   return 1;
 }
 
-int setEqualSpacingScript(lua_State* state) {
-  ptree scriptConf;
-  Lua_ToPTree(state, scriptConf);
-  _currentGame->GetGame()->updateEqualSpacingScript(scriptConf);
-  lua_pop(state, 1);
-  
+// Converts the config table at 1 into the ScriptConfig passed as a light userdata at 2 (called through lua_pcall).
+static int convertScriptConfig(lua_State* state) {
+  ScriptConfig* scriptConfig = static_cast<ScriptConfig*>(lua_touserdata(state, 2));
+  lua_settop(state, 1); // Lua_ToPTree reads the top, keep the table both there and at 1.
+  if(!Anki::Util::Lua_ToStruct(state, 1, scriptConfig->header)) {
+    return luaL_error(state, "script config has a field of the wrong type");
+  }
+  Lua_ToPTree(state, scriptConfig->conf);
   return 0;
 }
 
-int setVehicleScript(lua_State* state) {
-  ptree scriptConf;
-  Lua_ToPTree(state, scriptConf);
-  _currentGame->GetGame()->updateVehicleScript(scriptConf);
-  lua_pop(state, 1);
-  
+// The config is converted into the command buffer's storage, then queued (only the last call per tick is applied).
+//  A config that doesn't convert is an error, and nothing is queued.
+//  The conversion is most of the work, so it runs protected inside the trace scope, which closes before any error.
+static int setScriptConfig(lua_State* state, ScriptCommandType type, const char* traceName) {
+  ScriptCommandBuffer& commands = _currentGame->GetGame()->GetScriptCommands();
+  ScriptConfig& scriptConfig = commands.StartScriptConfig();
+  int status = LUA_OK;
+  {
+    LUA_TRACE_SCOPE(traceName, "bridge");
+    lua_pushcfunction(state, convertScriptConfig);
+    lua_pushvalue(state, 1);
+    lua_pushlightuserdata(state, &scriptConfig);
+    status = lua_pcall(state, 2, 0, 0);
+    if(status == LUA_OK) {
+      commands.AppendScriptConfig(type);
+    }
+  }
+  if(status != LUA_OK) {
+    return lua_error(state); // rethrow, error object is on top.
+  }
   return 0;
 }
 
+int setEqualSpacingScript(lua_State* state) {
+  return setScriptConfig(state, ScriptCommandType::SetEqualSpacingScript, "BaseStationGame.setEqualSpacingScript");
+}
+
+int setVehicleScript(lua_State* state) {
+  return setScriptConfig(state, ScriptCommandType::SetVehicleScript, "BaseStationGame.setVehicleScript");
+}
+
@@ -6,7 +6,9 @@
 *
 *  Description:
 *   Bridge module from a BaseStation game object to a lua script.
-*   Not currently expected to be thread-safe.
+*   Reads only the game's per-tick GameStateSnapshot and queues
+*   anything that changes the game to its ScriptCommandBuffer,
+*   so the script may run on a thread other than the simulation's.
 *
 *   Probably needs documentation once finished,
 *   For now, please look at _BaseStationGameBridgeLib[]
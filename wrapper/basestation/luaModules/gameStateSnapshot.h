@@ -0,0 +1,82 @@
+/********************************************************
+*  GameStateSnapshot
+*
+*  Created by Mark Pauley on 7/30/14.
+*  Copyright (c) 2014 Anki. All rights reserved.
+*
+*  Description:
+*   Everything the BaseStationGame bridge lets a script read, copied
+*   out of the live game state once per tick.
+*   A published snapshot is never modified, so the script can read it
+*   from another thread while the simulation moves on.
+********************************************************/
+
+#ifndef BASESTATION_LUAMODULES_GAMESTATESNAPSHOT_H_
+#define BASESTATION_LUAMODULES_GAMESTATESNAPSHOT_H_
+
+#include <algorithm>
+#include <atomic>
+#include <vector>
+
+namespace BaseStation {
+
+  struct VehicleSnapshot {
+    int vehicleID;
+    bool isLocalized;
+    double speed;
+    double lanePosition;
+    int kills;
+    bool isAI;
+  };
+
+  struct GameStateSnapshot {
+    double gameTime;
+    bool allVehiclesLocalized;
+    bool vehiclesInFormation;
+    double timeInFormation;
+    // Sorted by vehicleID
+    std::vector<VehicleSnapshot> vehicles;
+
+    // Returns nullptr if there is no vehicle with that ID.
+    const VehicleSnapshot* FindVehicle(int vehicleID) const
+    {
+      auto iter = std::lower_bound(vehicles.begin(), vehicles.end(), vehicleID,
+                                   [](const VehicleSnapshot& vehicle, int id) { return vehicle.vehicleID < id; });
+      if(iter != vehicles.end() && iter->vehicleID == vehicleID) {
+        return &(*iter);
+      }
+      return nullptr;
+    }
+  };
+
+  // Two snapshots written alternately.  The one being filled in is never the published one,
+  //  so a script can go on reading the published snapshot until the next Publish.
+  class GameStateSnapshotBuffer {
+  public:
+    GameStateSnapshotBuffer()
+    : snapshots_()
+    , nextIndex_(0)
+    , published_(&snapshots_[1])
+    {
+    }
+
+    // The snapshot to fill in for the next Publish.
+    GameStateSnapshot& GetNext() { return snapshots_[nextIndex_]; }
+
+    void Publish()
+    {
+      published_.store(&snapshots_[nextIndex_], std::memory_order_release);
+      nextIndex_ ^= 1;
+    }
+
+    const GameStateSnapshot& GetPublished() const { return *published_.load(std::memory_order_acquire); }
+
+  private:
+    GameStateSnapshot snapshots_[2];
+    unsigned int nextIndex_;
+    std::atomic<const GameStateSnapshot*> published_;
+  };
+
+} // namespace BaseStation
+
+#endif
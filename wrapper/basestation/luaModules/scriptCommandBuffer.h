@@ -0,0 +1,137 @@
+/********************************************************
+*  ScriptCommandBuffer
+*
+*  Created by Mark Pauley on 7/31/14.
+*  Copyright (c) 2014 Anki. All rights reserved.
+*
+*  Description:
+*   Output channel from a game script to the engine.
+*   Bridge calls that change the game append a small typed
+*   command here instead of acting right away, the game drains
+*   the buffer on the simulation thread once the script yields.
+*
+*   Set*Script commands are coalesced as they are appended: only
+*   the last one of each type per tick survives, and config storage
+*   is reused.  GoalReached is never coalesced and keeps its place.
+********************************************************/
+
+#ifndef BASESTATION_LUAMODULES_SCRIPTCOMMANDBUFFER_H_
+#define BASESTATION_LUAMODULES_SCRIPTCOMMANDBUFFER_H_
+
+#include "util/parsingConstants/parsingConstants.h"
+#include "util/lua/luaStructFields.h"
+#include <boost/property_tree/ptree.hpp>
+#include <cstdint>
+#include <string>
+#include <utility>
+#include <vector>
+
+namespace BaseStation {
+
+  // The fields of a script config that the game itself acts on.
+  //  Read straight from the script's table (see LuaStructMarshal.h), the rest of the config
+  //  is only handed through to the vehicle script.
+  struct ScriptConfigHeader {
+    std::string type;
+    bool deleteOldScript = false;
+
+    LUA_STRUCT_FIELDS(
+      LUA_STRUCT_FIELD(type, kP_TYPE)
+      LUA_STRUCT_FIELD(deleteOldScript, kP_DELETE_OLD_SCRIPT)
+    )
+  };
+
+  struct ScriptConfig {
+    ScriptConfigHeader header;
+    boost::property_tree::ptree conf;
+  };
+
+  enum class ScriptCommandType : uint8_t {
+    GoalReached,
+    SetEqualSpacingScript,
+    SetVehicleScript,
+    Count
+  };
+
+  class ScriptCommandBuffer {
+  public:
+    ScriptCommandBuffer()
+    : coalescedCount_(0)
+    {
+      Reset();
+    }
+
+    void AppendGoalReached()
+    {
+      commands_.push_back(ScriptCommandType::GoalReached);
+    }
+
+    // Returns a cleared config to fill in for a SetEqualSpacingScript or SetVehicleScript.
+    //  Nothing is queued until AppendScriptConfig, so a conversion that fails half way
+    //  (or raises a Lua error) leaves the commands already appended as they were.
+    ScriptConfig& StartScriptConfig()
+    {
+      startedConfig_.header = ScriptConfigHeader();
+      startedConfig_.conf.clear();
+      return startedConfig_;
+    }
+
+    // Queues the config from StartScriptConfig.
+    //  An earlier command of the same type this tick is dropped, and its config reused.
+    void AppendScriptConfig(ScriptCommandType type)
+    {
+      AppendCoalesced(type);
+      std::swap(configs_[(size_t)type], startedConfig_);
+    }
+
+    // Calls handler(ScriptCommandType, const ScriptConfig&) for every surviving command,
+    //  in the order they were (last) appended, then empties the buffer.
+    //  Configs are only meaningful for the Set*Script commands.
+    template <typename Handler>
+    void Drain(Handler&& handler)
+    {
+      for(ScriptCommandType type : commands_) {
+        if(type != ScriptCommandType::Count) {
+          handler(type, configs_[(size_t)type]);
+        }
+      }
+      Reset();
+    }
+
+    bool IsEmpty() const { return commands_.empty(); }
+
+    // Number of commands dropped because a later one of the same type replaced them.
+    uint64_t GetCoalescedCount() const { return coalescedCount_; }
+
+  private:
+    void AppendCoalesced(ScriptCommandType type)
+    {
+      int& lastIndex = lastIndex_[(size_t)type];
+      if(lastIndex >= 0) {
+        // Leave a hole rather than shifting the others down.
+        commands_[(size_t)lastIndex] = ScriptCommandType::Count;
+        coalescedCount_++;
+      }
+      lastIndex = (int)commands_.size();
+      commands_.push_back(type);
+    }
+
+    void Reset()
+    {
+      commands_.clear();
+      for(int& lastIndex : lastIndex_) {
+        lastIndex = -1;
+      }
+    }
+
+    // Count marks a command that was coalesced away.
+    std::vector<ScriptCommandType> commands_;
+    int lastIndex_[(size_t)ScriptCommandType::Count];
+    ScriptConfig configs_[(size_t)ScriptCommandType::Count];
+    ScriptConfig startedConfig_;
+    uint64_t coalescedCount_;
+  };
+
+} // namespace BaseStation
+
+#endif
@@ -0,0 +1,109 @@
+/********************************************************
+*  ScriptRunThread
+*
+*  Created by Mark Pauley on 7/31/14.
+*  Copyright (c) 2014 Anki. All rights reserved.
+*
+*  Description:
+*   Runs a game script on its own thread, one run per tick.
+*   The simulation thread hands a run over with StartRun and
+*   takes the script back with WaitForRun at the next tick
+*   boundary, so the two never touch the script at once.
+********************************************************/
+
+#ifndef BASESTATION_LUAMODULES_SCRIPTRUNTHREAD_H_
+#define BASESTATION_LUAMODULES_SCRIPTRUNTHREAD_H_
+
+#include "util/helpers/noncopyable.h"
+#include <condition_variable>
+#include <functional>
+#include <mutex>
+#include <thread>
+
+namespace BaseStation {
+
+  class ScriptRunThread : public Anki::Util::noncopyable {
+  public:
+    explicit ScriptRunThread(std::function<void()> run)
+    : run_(run)
+    , runPending_(false)
+    , stopping_(false)
+    {
+    }
+
+    // Finishes a pending run and stops the thread.
+    ~ScriptRunThread()
+    {
+      Stop();
+    }
+
+    bool IsStarted() const { return thread_.joinable(); }
+
+    void Start()
+    {
+      if(IsStarted()) {
+        return;
+      }
+      stopping_ = false;
+      thread_ = std::thread(&ScriptRunThread::ThreadMain, this);
+    }
+
+    // Waits for a pending run first, so the caller owns the script again once this returns.
+    void Stop()
+    {
+      if(!IsStarted()) {
+        return;
+      }
+      WaitForRun();
+      {
+        std::lock_guard<std::mutex> lock(mutex_);
+        stopping_ = true;
+      }
+      condition_.notify_all();
+      thread_.join();
+    }
+
+    // Hands one run over to the thread.  The caller must not touch the script until WaitForRun.
+    void StartRun()
+    {
+      {
+        std::lock_guard<std::mutex> lock(mutex_);
+        runPending_ = true;
+      }
+      condition_.notify_all();
+    }
+
+    void WaitForRun()
+    {
+      std::unique_lock<std::mutex> lock(mutex_);
+      condition_.wait(lock, [this]{ return !runPending_; });
+    }
+
+  private:
+    void ThreadMain()
+    {
+      std::unique_lock<std::mutex> lock(mutex_);
+      while(true) {
+        condition_.wait(lock, [this]{ return runPending_ || stopping_; });
+        if(!runPending_) {
+          break;
+        }
+        lock.unlock();
+        run_();
+        lock.lock();
+        runPending_ = false;
+        condition_.notify_all();
+      }
+    }
+
+    std::function<void()> run_;
+    std::thread thread_;
+    std::mutex mutex_;
+    std::condition_variable condition_;
+    bool runPending_;
+    bool stopping_;
+  };
+
+} // namespace BaseStation
+
+#endif
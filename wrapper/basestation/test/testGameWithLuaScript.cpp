@@ -17,6 +17,16 @@
 #include "basestation/ui/messaging/messages/inputControllerMessage.h"
 #include "basestation/ui/messaging/messages/itemMessage.h"
 #include "basestation/ui/messaging/messages/gameStateMessage.h"
+#include "basestation/luaModules/gameStateSnapshot.h"
+#include "basestation/luaModules/scriptCommandBuffer.h"
+#include "basestation/luaModules/scriptRunThread.h"
+#include "basestation/gameControllers/gameTypes/gameWithLuaScript.h"
+#include "basestation/gameControllers/gameTypes/gameWithLuaScriptInternal.h"
+#include <boost/property_tree/ptree.hpp>
+#include <atomic>
+#include <chrono>
+#include <string>
+#include <thread>
 
 namespace BaseStation {
 
@@ -129,4 +139,157 @@ TEST_F(TestGameWithLuaScript, TestTimedGameWithLuaScript)
   EXPECT_TRUE(goalReached);
 }
   
+static void AppendTestScriptConfig(ScriptCommandBuffer& commands, ScriptCommandType type, const char* configType)
+{
+  commands.StartScriptConfig().header.type = configType;
+  commands.AppendScriptConfig(type);
+}
+  
+TEST(TestScriptCommandBuffer, CoalescesToLastCommandPerType)
+{
+  ScriptCommandBuffer commands;
+  AppendTestScriptConfig(commands, ScriptCommandType::SetVehicleScript, "first");
+  commands.AppendGoalReached();
+  AppendTestScriptConfig(commands, ScriptCommandType::SetEqualSpacingScript, "spacing");
+  AppendTestScriptConfig(commands, ScriptCommandType::SetVehicleScript, "second");
+  commands.AppendGoalReached();
+  
+  vector<ScriptCommandType> drainedTypes;
+  vector<string> drainedConfigTypes;
+  commands.Drain([&](ScriptCommandType type, ScriptConfig const &config) {
+    drainedTypes.push_back(type);
+    drainedConfigTypes.push_back(config.header.type);
+  });
+  
+  // GoalReached is neither coalesced nor moved past the Set* commands that follow it.
+  ASSERT_EQ(4u, drainedTypes.size());
+  EXPECT_TRUE(drainedTypes[0] == ScriptCommandType::GoalReached);
+  EXPECT_TRUE(drainedTypes[1] == ScriptCommandType::SetEqualSpacingScript);
+  EXPECT_EQ("spacing", drainedConfigTypes[1]);
+  EXPECT_TRUE(drainedTypes[2] == ScriptCommandType::SetVehicleScript);
+  EXPECT_EQ("second", drainedConfigTypes[2]);
+  EXPECT_TRUE(drainedTypes[3] == ScriptCommandType::GoalReached);
+  EXPECT_EQ(1u, commands.GetCoalescedCount());
+  EXPECT_TRUE(commands.IsEmpty());
+}
+  
+TEST(TestScriptCommandBuffer, StartedConfigIsOnlyQueuedOnAppend)
+{
+  ScriptCommandBuffer commands;
+  AppendTestScriptConfig(commands, ScriptCommandType::SetVehicleScript, "valid");
+  
+  // A conversion that bails out half way (a Lua error in the bridge) never gets appended.
+  commands.StartScriptConfig().header.type = "half";
+  
+  vector<string> drainedConfigTypes;
+  commands.Drain([&](ScriptCommandType type, ScriptConfig const &config) {
+    drainedConfigTypes.push_back(config.header.type);
+  });
+  ASSERT_EQ(1u, drainedConfigTypes.size());
+  EXPECT_EQ("valid", drainedConfigTypes[0]);
+  EXPECT_EQ(0u, commands.GetCoalescedCount());
+}
+  
+TEST(TestGameStateSnapshotBuffer, PublishesOneSnapshotPerTick)
+{
+  GameStateSnapshotBuffer snapshots;
+  snapshots.GetNext().gameTime = 1.0;
+  snapshots.Publish();
+  const GameStateSnapshot& firstTick = snapshots.GetPublished();
+  EXPECT_EQ(1.0, firstTick.gameTime);
+  
+  // Filling in the next tick leaves the published snapshot alone.
+  GameStateSnapshot& next = snapshots.GetNext();
+  EXPECT_NE(&firstTick, &next);
+  next.gameTime = 2.0;
+  EXPECT_EQ(1.0, snapshots.GetPublished().gameTime);
+  snapshots.Publish();
+  EXPECT_EQ(2.0, snapshots.GetPublished().gameTime);
+  EXPECT_EQ(&firstTick, &snapshots.GetNext());
+}
+  
+// The tick boundary of GameWithLuaScript::InGameUpdate when the script runs async.
+TEST(TestScriptRunThread, AppliesAsyncRunOneTickLater)
+{
+  GameStateSnapshotBuffer snapshots;
+  ScriptCommandBuffer commands;
+  // The "script" asks for a vehicle script named after the tick it saw.
+  ScriptRunThread scriptThread([&]{
+    commands.StartScriptConfig().header.type = std::to_string((int)snapshots.GetPublished().gameTime);
+    commands.AppendScriptConfig(ScriptCommandType::SetVehicleScript);
+  });
+  scriptThread.Start();
+  EXPECT_TRUE(scriptThread.IsStarted());
+  
+  vector<string> applied;
+  for(int tick = 1; tick <= 3; ++tick) {
+    scriptThread.WaitForRun();
+    applied.clear();
+    commands.Drain([&](ScriptCommandType type, ScriptConfig const &config) {
+      applied.push_back(config.header.type);
+    });
+    if(tick == 1) {
+      EXPECT_TRUE(applied.empty());
+    }
+    else {
+      ASSERT_EQ(1u, applied.size());
+      EXPECT_EQ(std::to_string(tick - 1), applied[0]);
+    }
+    snapshots.GetNext().gameTime = tick;
+    snapshots.Publish();
+    scriptThread.StartRun();
+  }
+  
+  // Going back to synchronous waits for the run of the last tick.
+  scriptThread.Stop();
+  EXPECT_FALSE(scriptThread.IsStarted());
+  applied.clear();
+  commands.Drain([&](ScriptCommandType type, ScriptConfig const &config) {
+    applied.push_back(config.header.type);
+  });
+  ASSERT_EQ(1u, applied.size());
+  EXPECT_EQ("3", applied[0]);
+}
+  
+TEST(TestScriptRunThread, DestructorFinishesPendingRun)
+{
+  std::atomic<int> runCount(0);
+  {
+    ScriptRunThread scriptThread([&]{
+      std::this_thread::sleep_for(std::chrono::milliseconds(20));
+      runCount++;
+    });
+    scriptThread.Stop(); // never started, nothing to do
+    scriptThread.Start();
+    scriptThread.StartRun();
+  }
+  EXPECT_EQ(1, runCount.load());
+}
+  
+TEST(TestGameWithLuaScriptConfig, UpdateConfigInPlacePassesOnlyChanges)
+{
+  ptree curConf;
+  curConf.put("type", "spacing");
+  curConf.put("speed", 300);
+  curConf.put("lanes.count", 3);
+  
+  ptree conf = curConf;
+  ptree changedConf;
+  EXPECT_TRUE(GameWithLuaScriptInternal::UpdateConfigInPlace(curConf, conf, changedConf));
+  EXPECT_TRUE(changedConf.empty());
+  
+  conf.put("speed", 450);
+  EXPECT_TRUE(GameWithLuaScriptInternal::UpdateConfigInPlace(curConf, conf, changedConf));
+  EXPECT_EQ(1u, changedConf.size());
+  EXPECT_EQ(450, changedConf.get<int>("speed"));
+  EXPECT_TRUE(curConf == conf);
+  
+  // New keys can't be sent as a delta, the whole config replaces the old one.
+  changedConf.clear();
+  conf.put("distance", 10);
+  EXPECT_FALSE(GameWithLuaScriptInternal::UpdateConfigInPlace(curConf, conf, changedConf));
+  EXPECT_TRUE(changedConf.empty());
+  EXPECT_TRUE(curConf == conf);
+}
+  
 }  // namespace BaseStation
@@ -11,12 +11,19 @@
 
 #include <lua/lua.hpp>
 #include "util/lua/luaUtils.h"
+#include "util/lua/luaTableSerializer.h"
+#include "util/lua/luaStructMarshal.h"
+#include "util/lua/luaLogSink.h"
+#include "util/lua/luaTrace.h"
 #include "util/lua/luaContext.h"
 #include "util/lua/luaScript.h"
+#include "util/lua/luaScriptTemplate.h"
 #include "util/lua/luaDebugger.h"
 #include "basestation/utils/parameters.h"
 #include <boost/property_tree/json_parser.hpp>
 #include <boost/foreach.hpp>
+#include <cstdio>
+#include <fstream>
 #include "util/ptree/ptreeTools.h"
 #include "basestation/tests/bTestDefines.h"
 #include "basestation/ui/platform/standalonePlatform.h"
@@ -60,6 +67,8 @@ public:
   
   void ExpectTable(string const& table);
   
+  string RunChunk(const char* chunk);
+  
 protected:
   lua_State* state_;
   ptree expectedPTree_;
@@ -219,6 +228,266 @@ TEST_F(TestLua, TestLuaConversionNestedJSON)
 }
   
   
+#pragma mark Streaming serializer tests.
+
+TEST_F(TestLua, TestStreamingJSONList)
+{
+  luaL_loadstring(state_, "result = { 1, true, 3, \"foo\", 5.5 }");
+  EXPECT_EQ(LUA_OK, lua_pcall(state_, 0, 0, 0));
+  lua_getglobal(state_, "result");
+  std::string json;
+  EXPECT_TRUE(Anki::Util::Lua_ToJSON(state_, json));
+  EXPECT_EQ("[1,true,3,\"foo\",5.5]", json);
+  EXPECT_EQ(1, lua_gettop(state_));
+
+  // Huge integral keys are not array indices.
+  luaL_loadstring(state_, "result = { [1e300] = 1 }");
+  EXPECT_EQ(LUA_OK, lua_pcall(state_, 0, 0, 0));
+  lua_getglobal(state_, "result");
+  json.clear();
+  EXPECT_TRUE(Anki::Util::Lua_ToJSON(state_, json));
+  EXPECT_EQ('{', json[0]);
+}
+
+TEST_F(TestLua, TestStreamingJSONNested)
+{
+  ExpectJSON("{ \"result\": { \"a\": { \"a\": \"f\\\"oo\", \"b\": [ 1, 2, { \"c\": false } ] }, \"empty\": {} } }");
+  luaL_loadstring(state_, "result = { a = { a=\"f\\\"oo\", b={ 1, 2, { c=false } } }, empty={} }");
+  EXPECT_EQ(LUA_OK, lua_pcall(state_, 0, 0, 0));
+  lua_getglobal(state_, "result");
+  std::stringstream jsonStream;
+  jsonStream << "{ \"result\": ";
+  EXPECT_TRUE(Anki::Util::Lua_ToJSON(state_, jsonStream));
+  jsonStream << " }";
+  ptree actual;
+  LoadJSON(jsonStream.str(), actual);
+  CheckExpected(actual);
+}
+
+TEST_F(TestLua, TestStreamingJSONRejectsCycles)
+{
+  luaL_loadstring(state_, "result = { a = {} } result.a.parent = result");
+  EXPECT_EQ(LUA_OK, lua_pcall(state_, 0, 0, 0));
+  lua_getglobal(state_, "result");
+  std::string json;
+  EXPECT_FALSE(Anki::Util::Lua_ToJSON(state_, json));
+  EXPECT_EQ(1, lua_gettop(state_));
+
+  // Shared (acyclic) references are fine.
+  luaL_loadstring(state_, "local shared = { 1 } result = { shared, shared }");
+  EXPECT_EQ(LUA_OK, lua_pcall(state_, 0, 0, 0));
+  lua_getglobal(state_, "result");
+  json.clear();
+  EXPECT_TRUE(Anki::Util::Lua_ToJSON(state_, json));
+  EXPECT_EQ("[[1],[1]]", json);
+}
+
+TEST_F(TestLua, TestStreamingBinaryRoundTrip)
+{
+  luaL_loadstring(state_, "result = { name=\"car\", speed=-12.25, lane=-3, big=2^40, tags={ \"a\", \"b\" }, ok=true }");
+  EXPECT_EQ(LUA_OK, lua_pcall(state_, 0, 0, 0));
+  lua_getglobal(state_, "result");
+  std::vector<uint8_t> encoded;
+  EXPECT_TRUE(Anki::Util::Lua_ToBinary(state_, encoded));
+  std::string expectedJSON("{ \"result\": ");
+  Anki::Util::Lua_ToJSON(state_, expectedJSON);
+  expectedJSON += " }";
+  lua_pop(state_, 1);
+
+  EXPECT_TRUE(Anki::Util::Lua_PushBinaryAsValue(state_, encoded.data(), encoded.size()));
+  std::string actualJSON("{ \"result\": ");
+  Anki::Util::Lua_ToJSON(state_, actualJSON);
+  actualJSON += " }";
+  lua_pop(state_, 1);
+  ptree actual;
+  LoadJSON(actualJSON, actual);
+  LoadJSON(expectedJSON, expectedPTree_);
+  CheckExpected(actual);
+
+  // Truncated data pushes nothing.
+  EXPECT_FALSE(Anki::Util::Lua_PushBinaryAsValue(state_, encoded.data(), encoded.size() - 1));
+  EXPECT_EQ(0, lua_gettop(state_));
+}
+
+#pragma mark Pinned key tests.
+
+TEST_F(TestLua, TestPinnedKeys)
+{
+  const lua_Key speedKey = lua_pinkey(state_, "speed");
+  EXPECT_EQ(speedKey, lua_pinkey(state_, "speed"));
+  
+  lua_newtable(state_);
+  lua_pushnumber(state_, 12.5);
+  lua_setfieldh(state_, -2, speedKey);
+  lua_setglobal(state_, "vehicle");
+  
+  // Pinned keys survive collection even when nothing else references them.
+  lua_gc(state_, LUA_GCCOLLECT, 0);
+  
+  luaL_loadstring(state_, "return vehicle.speed");
+  EXPECT_EQ(LUA_OK, lua_pcall(state_, 0, 1, 0));
+  EXPECT_EQ(12.5, lua_tonumber(state_, -1));
+  lua_pop(state_, 1);
+  
+  lua_getglobal(state_, "vehicle");
+  lua_getfieldh(state_, -1, speedKey);
+  EXPECT_EQ(12.5, lua_tonumber(state_, -1));
+  lua_pop(state_, 1);
+  
+  // Key handles respect metamethods, just like lua_getfield.
+  luaL_loadstring(state_, "setmetatable(vehicle, { __index = function(t, k) return k .. \"!\" end })");
+  EXPECT_EQ(LUA_OK, lua_pcall(state_, 0, 0, 0));
+  const lua_Key laneKey = lua_pinkey(state_, "lane");
+  lua_getfieldh(state_, -1, laneKey);
+  EXPECT_STREQ("lane!", lua_tostring(state_, -1));
+  lua_pushkey(state_, laneKey);
+  EXPECT_STREQ("lane", lua_tostring(state_, -1));
+  lua_pop(state_, 3);
+}
+
+#pragma mark Struct marshalling tests.
+
+struct TestLuaLane {
+  int lane = 0;
+  float offset = 0.0f;
+  LUA_STRUCT_FIELDS(
+    LUA_STRUCT_FIELD(lane, "lane")
+    LUA_STRUCT_FIELD(offset, "offset")
+  )
+};
+
+struct TestLuaConfig {
+  std::string type;
+  bool deleteOldScript = false;
+  double speed = 1.0;
+  TestLuaLane position;
+  LUA_STRUCT_FIELDS(
+    LUA_STRUCT_FIELD(type, "type")
+    LUA_STRUCT_FIELD(deleteOldScript, "deleteOldScript")
+    LUA_STRUCT_FIELD(speed, "speed")
+    LUA_STRUCT_FIELD(position, "position")
+  )
+};
+
+TEST_F(TestLua, TestLuaTableToStruct)
+{
+  luaL_loadstring(state_, "result = { type=\"formation\", deleteOldScript=true, position={ lane=3, offset=0.5 }, extra=7 }");
+  EXPECT_EQ(LUA_OK, lua_pcall(state_, 0, 0, 0));
+  lua_getglobal(state_, "result");
+  TestLuaConfig config;
+  EXPECT_TRUE(Anki::Util::Lua_ToStruct(state_, -1, config));
+  EXPECT_EQ("formation", config.type);
+  EXPECT_TRUE(config.deleteOldScript);
+  EXPECT_EQ(1.0, config.speed); // missing fields keep their defaults
+  EXPECT_EQ(3, config.position.lane);
+  EXPECT_FLOAT_EQ(0.5f, config.position.offset);
+  EXPECT_EQ(1, lua_gettop(state_));
+  
+  // Type mismatches are reported, the rest of the struct is still filled in.
+  luaL_loadstring(state_, "result = { type={}, speed=4 }");
+  EXPECT_EQ(LUA_OK, lua_pcall(state_, 0, 0, 0));
+  lua_getglobal(state_, "result");
+  EXPECT_FALSE(Anki::Util::Lua_ToStruct(state_, -1, config));
+  EXPECT_EQ("formation", config.type);
+  EXPECT_EQ(4.0, config.speed);
+  
+  // Numbers are accepted for string fields, like Lua_ToPTree does, and stay numbers in the table.
+  luaL_loadstring(state_, "result = { type=12 }");
+  EXPECT_EQ(LUA_OK, lua_pcall(state_, 0, 0, 0));
+  lua_getglobal(state_, "result");
+  EXPECT_TRUE(Anki::Util::Lua_ToStruct(state_, -1, config));
+  EXPECT_EQ("12", config.type);
+  lua_getfield(state_, -1, "type");
+  EXPECT_EQ(LUA_TNUMBER, lua_type(state_, -1));
+  lua_pop(state_, 3);
+}
+
+TEST_F(TestLua, TestLuaStructToTable)
+{
+  TestLuaConfig config;
+  config.type = "vehicle";
+  config.speed = 2.5;
+  config.position.lane = -1;
+  Anki::Util::Lua_PushStructAsTable(state_, config);
+  lua_setglobal(state_, "config");
+  luaL_loadstring(state_, "return config.type == \"vehicle\" and config.speed == 2.5 and config.position.lane == -1 and config.deleteOldScript == false");
+  EXPECT_EQ(LUA_OK, lua_pcall(state_, 0, 1, 0));
+  EXPECT_TRUE(lua_toboolean(state_, -1));
+  lua_pop(state_, 1);
+
+  TestLuaConfig roundTrip;
+  lua_getglobal(state_, "config");
+  EXPECT_TRUE(Anki::Util::Lua_ToStruct(state_, -1, roundTrip));
+  EXPECT_EQ(config.type, roundTrip.type);
+  EXPECT_EQ(config.position.lane, roundTrip.position.lane);
+}
+
+#pragma mark Log sink tests.
+
+TEST_F(TestLua, TestLuaPrintToLogSink)
+{
+  // Long flush interval, so only our explicit Flush() drains the buffer.
+  Anki::Util::LuaLogSink logSink(64, 60 * 1000);
+  logSink.InstallPrint(state_);
+  luaL_loadstring(state_, "print(\"speed\", 2.5, true, nil) print(setmetatable({}, { __tostring = function() return \"car\" end }))");
+  EXPECT_EQ(LUA_OK, lua_pcall(state_, 0, 0, 0));
+  EXPECT_EQ(2u, logSink.GetLineCount());
+  EXPECT_EQ(0u, logSink.GetDroppedCount());
+  logSink.Flush();
+  
+  // Lines that don't fit are dropped (and counted), not blocked on.  At most 8 of them
+  //  (2 fit), fewer if the flush thread happens to wake up while the script runs.
+  luaL_loadstring(state_, "for i = 1, 10 do print(string.rep(\"x\", 20)) end");
+  EXPECT_EQ(LUA_OK, lua_pcall(state_, 0, 0, 0));
+  EXPECT_EQ(2u + 10u, logSink.GetLineCount() + logSink.GetDroppedCount());
+  EXPECT_LE(logSink.GetDroppedCount(), 8u);
+}
+
+#pragma mark Trace tests.
+
+TEST_F(TestLua, TestLuaTraceRecorder)
+{
+  using Anki::Util::LuaTraceRecorder;
+  LuaTraceRecorder::Clear();
+  LuaTraceRecorder::InstallGCHook(state_);
+  luaL_requiref(state_, "trace", &LuaTraceRecorder::OpenLibrary, 1);
+  lua_pop(state_, 1);
+  
+  // Disabled: scripts can still call trace, nothing is recorded.
+  luaL_loadstring(state_, "return trace.scope(\"disabledRegion\", function(a, b) return a + b end, 1, 2)");
+  EXPECT_EQ(LUA_OK, lua_pcall(state_, 0, 1, 0));
+  EXPECT_EQ(3, lua_tointeger(state_, -1));
+  lua_pop(state_, 1);
+  
+  LuaTraceRecorder::SetEnabled(true);
+  {
+    LUA_TRACE_SCOPE("nativeRegion", "test");
+    luaL_loadstring(state_, "return trace.scope(\"scriptRegion\", function(a) return a end, 4)");
+    EXPECT_EQ(LUA_OK, lua_pcall(state_, 0, 1, 0));
+    EXPECT_EQ(4, lua_tointeger(state_, -1));
+    lua_pop(state_, 1);
+    // Scopes can't span a yield, the region still ends.
+    luaL_loadstring(state_, "local co = coroutine.wrap(function() trace.scope(\"yieldingRegion\", function() coroutine.yield() end) end)"
+                            " co()");
+    EXPECT_EQ(LUA_ERRRUN, lua_pcall(state_, 0, 0, 0));
+    lua_pop(state_, 1);
+    lua_gc(state_, LUA_GCCOLLECT, 0);
+  }
+  LuaTraceRecorder::SetEnabled(false);
+  
+  std::stringstream traceStream;
+  LuaTraceRecorder::WriteChromeTrace(traceStream);
+  const std::string trace = traceStream.str();
+  EXPECT_EQ(std::string::npos, trace.find("disabledRegion"));
+  EXPECT_NE(std::string::npos, trace.find("\"name\":\"nativeRegion\",\"cat\":\"test\",\"ph\":\"E\""));
+  EXPECT_NE(std::string::npos, trace.find("\"name\":\"scriptRegion\",\"cat\":\"script\",\"ph\":\"E\""));
+  EXPECT_NE(std::string::npos, trace.find("\"name\":\"yieldingRegion\",\"cat\":\"script\",\"ph\":\"E\""));
+  EXPECT_NE(std::string::npos, trace.find("\"name\":\"GC full\""));
+  ptree parsedTrace;
+  LoadJSON(trace, parsedTrace);
+  LuaTraceRecorder::Clear();
+}
+
 TEST_F(TestLua, TestLuaCreateContext)
 {
   Anki::Util::LuaContext testContext;
@@ -249,6 +518,51 @@ TEST_F(TestLua, TestLuaRunSimpleScript)
   delete testScript;
 }
 
+TEST_F(TestLua, TestLuaScriptTemplate)
+{
+  Anki::Util::LuaContext testContext;
+  const string scriptPath = platform_->pathToResource(BaseStation::Platform::Resources, "/scripts/test/simpleScript.lua");
+  Anki::Util::LuaScriptTemplate* testTemplate = testContext.CreateLuaScriptTemplateWithFile(scriptPath);
+  ASSERT_TRUE(testTemplate != nullptr);
+  
+  std::vector<Anki::Util::LuaScript*> scripts;
+  for(int i = 0; i < 16; i++) {
+    scripts.push_back(testTemplate->CreateScript((i % 2) == 0));
+  }
+  // The scripts don't depend on the template once spawned.
+  delete testTemplate;
+  
+  for(Anki::Util::LuaScript* script : scripts) {
+    ASSERT_TRUE(script != nullptr);
+    EXPECT_TRUE(script->IsAlive());
+    script->Resume();
+    EXPECT_FALSE(script->IsAlive());
+    delete script;
+  }
+}
+
+TEST_F(TestLua, TestLuaLoadAsync)
+{
+  Anki::Util::LuaContext testContext;
+  const string scriptPath = platform_->pathToResource(BaseStation::Platform::Resources, "/scripts/test/simpleScript.lua");
+  std::future<Anki::Util::LuaCompiledChunk> pendingChunk = Anki::Util::LuaContext::LoadAsync(scriptPath);
+  std::future<Anki::Util::LuaCompiledChunk> missingChunk = Anki::Util::LuaContext::LoadAsync(scriptPath + ".missing");
+  
+  const Anki::Util::LuaCompiledChunk compiledChunk = pendingChunk.get();
+  ASSERT_TRUE(compiledChunk.IsValid());
+  EXPECT_FALSE(compiledChunk.bytecode.empty());
+  Anki::Util::LuaScript* testScript = testContext.CreateLuaScriptWithChunk(compiledChunk);
+  ASSERT_TRUE(testScript != nullptr);
+  EXPECT_TRUE(testScript->IsAlive());
+  testScript->Resume();
+  EXPECT_FALSE(testScript->IsAlive());
+  delete testScript;
+  
+  const Anki::Util::LuaCompiledChunk failedChunk = missingChunk.get();
+  EXPECT_FALSE(failedChunk.IsValid());
+  EXPECT_TRUE(testContext.CreateLuaScriptWithChunk(failedChunk) == nullptr);
+}
+
 TEST_F(TestLua, TestLuaSetBreakpoints)
 {
   Anki::Util::LuaContext testContext;
@@ -283,4 +597,450 @@ TEST_F(TestLua, TestLuaSetBreakpoints)
 }
 
 
+TEST_F(TestLua, TestLuaConditionalBreakpointsAndLogpoints)
+{
+  Anki::Util::LuaContext testContext;
+  Anki::Util::LuaScript* testScript = nullptr;
+  std::stringstream inStream;
+  std::stringstream outStream;
+  
+  const string scriptPath = platform_->pathToResource(BaseStation::Platform::Resources, "/scripts/test/simpleScript.lua");
+  testScript = testContext.CreateLuaScriptWithFile(scriptPath);
+  ASSERT_TRUE(testScript != nullptr);
+  testScript->Debugger().SetInStream(inStream);
+  testScript->Debugger().SetOutStream(outStream);
+  
+  // Never true, so this one must not stop (there is nothing to read from inStream if it did).
+  Anki::Util::LuaBreakpointOptions neverStop;
+  neverStop.condition = "type(simpleFunctionOne) ~= 'function'";
+  testScript->Debugger().SetFunctionBreakpoint("simpleFunctionOne", neverStop);
+  
+  Anki::Util::LuaBreakpointOptions logpoint;
+  logpoint.condition = "true";
+  logpoint.logMessage = "logpoint {1 + 1} {type(simpleFunctionTwo)}";
+  testScript->Debugger().SetFunctionBreakpoint("simpleFunctionTwo", logpoint);
+  
+  testScript->Resume();
+  EXPECT_FALSE(testScript->IsAlive());
+  
+  const std::string outString = outStream.str();
+  EXPECT_EQ("logpoint 2 function\n", outString);
+  delete testScript;
+}
+
+TEST_F(TestLua, TestLuaBreakpointWithManyVariables)
+{
+  // More upvalues than the LUA_MINSTACK slots a hook is guaranteed.
+  const string scriptPath = "./manyVariablesScript.lua";
+  {
+    std::ofstream script(scriptPath.c_str());
+    std::string sum;
+    for(int i = 1; i <= 40; i++) {
+      sum += (i > 1 ? " + v" : "v") + std::to_string(i);
+      script << "local v" << i << " = " << i << "\n";
+    }
+    script << "function manyVariables() return " << sum << " end\n";
+    script << "return function() local sum = manyVariables() return sum end\n";
+  }
+  
+  Anki::Util::LuaContext testContext;
+  std::stringstream inStream;
+  std::stringstream outStream;
+  Anki::Util::LuaScript* testScript = testContext.CreateLuaScriptWithFile(scriptPath);
+  ASSERT_TRUE(testScript != nullptr);
+  testScript->Debugger().SetInStream(inStream);
+  testScript->Debugger().SetOutStream(outStream);
+  
+  Anki::Util::LuaBreakpointOptions logpoint;
+  logpoint.condition = "v1 == 1";
+  logpoint.logMessage = "{v1} {v40}";
+  testScript->Debugger().SetFunctionBreakpoint("manyVariables", logpoint);
+  testScript->Resume();
+  EXPECT_FALSE(testScript->IsAlive());
+  EXPECT_EQ("1 40\n", outStream.str());
+  delete testScript;
+  std::remove(scriptPath.c_str());
+}
+
+TEST_F(TestLua, TestLuaCoverage)
+{
+  Anki::Util::LuaContext testContext;
+  const string scriptPath = platform_->pathToResource(BaseStation::Platform::Resources, "/scripts/test/simpleScript.lua");
+  Anki::Util::LuaScript* testScript = testContext.CreateLuaScriptWithFile(scriptPath);
+  ASSERT_TRUE(testScript != nullptr);
+  testScript->Resume();
+  // The file's main chunk is garbage now, its coverage is still reported.
+  testContext.CollectGarbage();
+  
+  std::stringstream coverage;
+  if(testContext.WriteCoverage(coverage)) {
+    const std::string lcov = coverage.str();
+    EXPECT_NE(std::string::npos, lcov.find("SF:" + scriptPath + "\n"));
+    EXPECT_NE(std::string::npos, lcov.find(",1\n"));
+    EXPECT_NE(std::string::npos, lcov.find("end_of_record"));
+  }
+  else {
+    // Lua built without LUA_COVERAGE.
+    EXPECT_TRUE(coverage.str().empty());
+  }
+  delete testScript;
+}
+
+TEST_F(TestLua, TestLuaHeapSnapshot)
+{
+  Anki::Util::LuaContext testContext;
+  const string scriptPath = platform_->pathToResource(BaseStation::Platform::Resources, "/scripts/test/simpleScript.lua");
+  Anki::Util::LuaScript* testScript = testContext.CreateLuaScriptWithFile(scriptPath);
+  ASSERT_TRUE(testScript != nullptr);
+  
+  std::stringstream snapshot;
+  testContext.WriteHeapSnapshot(snapshot);
+  const std::string snapshotString = snapshot.str();
+  EXPECT_EQ(0u, snapshotString.find("lua-heap-snapshot 1\n"));
+  EXPECT_NE(std::string::npos, snapshotString.find("\tthread\t"));
+  EXPECT_NE(std::string::npos, snapshotString.find("\ttable\t"));
+  EXPECT_NE(std::string::npos, snapshotString.find("\tproto\t"));
+  EXPECT_NE(std::string::npos, snapshotString.find("\t(registry)\n"));
+  // Globals show up as references named after their key.
+  EXPECT_NE(std::string::npos, snapshotString.find("\tsimpleFunctionOne\n"));
+  delete testScript;
+}
+
+TEST_F(TestLua, TestLuaTablePool)
+{
+  Anki::Util::LuaContext testContext;
+  EXPECT_EQ(0, testContext.GetTablePoolStats().size);
+  testContext.SetTablePoolSize(64);
+  const string scriptPath = platform_->pathToResource(BaseStation::Platform::Resources, "/scripts/test/simpleScript.lua");
+  Anki::Util::LuaScript* testScript = testContext.CreateLuaScriptWithFile(scriptPath);
+  ASSERT_TRUE(testScript != nullptr);
+  testScript->Resume();
+  delete testScript;
+  testContext.CollectGarbage();
+  
+  Anki::Util::LuaTablePoolStats stats = testContext.GetTablePoolStats();
+  EXPECT_LE(stats.size, 64);
+  EXPECT_EQ(stats.pooled, stats.reused + stats.size);
+  
+  testContext.SetTablePoolSize(0);
+  EXPECT_EQ(0, testContext.GetTablePoolStats().size);
+}
+
+#pragma mark Table access tests.
+
+// Runs chunk and returns its result as a string, or the error message.
+string TestLua::RunChunk(const char* chunk)
+{
+  string result;
+  if(luaL_loadstring(state_, chunk) != LUA_OK || lua_pcall(state_, 0, 1, 0) != LUA_OK) {
+    result = string("error: ") + lua_tostring(state_, -1);
+    lua_pop(state_, 1);
+  }
+  else {
+    result = luaL_tolstring(state_, -1, NULL);
+    lua_pop(state_, 2);
+  }
+  return result;
+}
+
+TEST_F(TestLua, TestInlineCacheAfterResize)
+{
+  // One call site caches where 'name' was in a table that is then freed; tables whose node vectors
+  //  reuse its memory at another offset must not be read through the stale entry.
+  EXPECT_EQ("0", RunChunk(
+    "local function getname(o) return o.name end\n"
+    "local bad = 0\n"
+    "for round = 1, 200 do\n"
+    "  local grown = {}\n"
+    "  for i = 1, 17 + round % 200 do grown['k' .. i] = i end\n"
+    "  grown.name = round\n"
+    "  if getname(grown) ~= round then bad = bad + 1 end\n"
+    "  grown = nil\n"
+    "  collectgarbage()\n"
+    "  for size = 1, 300, 7 do\n"
+    "    local decoy = {}\n"
+    "    for i = 1, size do decoy['d' .. i] = 'name' end\n"
+    "    if getname(decoy) ~= nil then bad = bad + 1 end\n"
+    "  end\n"
+    "end\n"
+    "return bad\n"));
+}
+
+TEST_F(TestLua, TestInlineCacheSharedByOtherAccesses)
+{
+  // Accesses without a constant key share one cache per function, which must never answer for another key.
+  EXPECT_EQ("0 0", RunChunk(
+    "local Base = {kind = 'base'} Base.__index = Base\n"
+    "local a, b = {x = 1, y = 2}, setmetatable({y = 20}, Base)\n"
+    "local keys = {'x', 'y', 'kind', 'z'}\n"
+    "local bad, stores = 0, 0\n"
+    "for round = 1, 100 do\n"
+    "  for _, k in ipairs(keys) do\n"
+    "    local t = (round % 2 == 0) and a or b\n"
+    "    local expected = rawget(t, k) or (t == b and Base[k]) or nil\n"
+    "    if t[k] ~= expected then bad = bad + 1 end\n"
+    "  end\n"
+    "  local k = keys[round % 2 + 1]\n"
+    "  a[k] = round b[k] = -round\n"
+    "  if a[k] ~= round or b[k] ~= -round then stores = stores + 1 end\n"
+    "end\n"
+    "return bad .. ' ' .. stores\n"));
+}
+
+TEST_F(TestLua, TestIndexChainInvalidation)
+{
+  // The same method call site keeps seeing the right method as the classes it went through change.
+  EXPECT_EQ("base derived base other base patched own", RunChunk(
+    "local Base = {} Base.__index = Base\n"
+    "function Base:kind() return 'base' end\n"
+    "local Derived = setmetatable({}, Base) Derived.__index = Derived\n"
+    "local o = setmetatable({}, Derived)\n"
+    "local out = {}\n"
+    "for round = 1, 7 do\n"
+    "  out[#out + 1] = o:kind()\n"
+    "  if round == 1 then rawset(Derived, 'kind', function() return 'derived' end)\n"
+    "  elseif round == 2 then rawset(Derived, 'kind', nil)\n"
+    "  elseif round == 3 then setmetatable(Derived, {__index = {kind = function() return 'other' end}})\n"
+    "  elseif round == 4 then setmetatable(o, Base)\n"
+    "  elseif round == 5 then rawset(Base, 'kind', function() return 'patched' end)\n"
+    "  elseif round == 6 then rawset(o, 'kind', function() return 'own' end) end\n"
+    "end\n"
+    "return table.concat(out, ' ')\n"));
+}
+
+TEST_F(TestLua, TestNextOverShapedTables)
+{
+  // Record-like tables share a shape; next must skip their nil slots and follow them into a plain hash.
+  EXPECT_EQ("x=1,y=2,z=3;x=4,z=6;x=4,y=7,z=6;x=10,y=20,z=30;nil;20 210", RunChunk(
+    "local function fields(t)\n"
+    "  local out = {}\n"
+    "  for k, v in next, t do out[#out + 1] = k .. '=' .. tostring(v) end\n"
+    "  table.sort(out)\n"
+    "  return table.concat(out, ',')\n"
+    "end\n"
+    "local out = {}\n"
+    "local a = {x = 1, y = 2, z = 3}\n"
+    "local b = {x = 4, y = 5, z = 6}\n"
+    "out[#out + 1] = fields(a)\n"
+    "b.y = nil\n"
+    "out[#out + 1] = fields(b)\n"
+    "b.y = 7\n"
+    "out[#out + 1] = fields(b)\n"
+    "for k, v in next, a do a[k] = v * 10 end\n"
+    "out[#out + 1] = fields(a)\n"
+    "for k in next, a do a[k] = nil end\n"
+    "out[#out + 1] = tostring(next(a))\n"
+    "local c = {}\n"
+    "for i = 1, 20 do c['f' .. i] = i end\n"
+    "local n, sum = 0, 0\n"
+    "for k, v in next, c do n = n + 1 sum = sum + v end\n"
+    "out[#out + 1] = n .. ' ' .. sum\n"
+    "return table.concat(out, ';')\n"));
+}
+
+TEST_F(TestLua, TestShapesOfCollectedTablesAreFreed)
+{
+  // 2100 live tables with distinct keys take every one of the LUAI_MAXSHAPES (2048) shapes, so new
+  //  record-like tables fall back to a larger hash part; once those tables are collected, so are their shapes.
+  //  (The few bytes of slack are for the keys' strings.)
+  EXPECT_EQ("true true", RunChunk(
+    "local function bytesPerRecord(prefix)\n"
+    "  local keep = {}\n"
+    "  for i = 1, 1000 do keep[i] = false end\n"
+    "  collectgarbage() collectgarbage('stop')\n"
+    "  local before = collectgarbage('count')\n"
+    "  for i = 1, 1000 do keep[i] = {[prefix .. 'a'] = 1, [prefix .. 'b'] = 2, [prefix .. 'c'] = 3} end\n"
+    "  local bytes = (collectgarbage('count') - before) * 1024 / 1000\n"
+    "  collectgarbage('restart')\n"
+    "  return bytes\n"
+    "end\n"
+    "local shaped = bytesPerRecord('p')\n"
+    "local full = {}\n"
+    "for i = 1, 2100 do full[i] = {['u' .. i] = true} end\n"
+    "local whileFull = bytesPerRecord('q')\n"
+    "full = nil\n"
+    "collectgarbage()\n"
+    "local afterwards = bytesPerRecord('r')\n"
+    "return tostring(whileFull - shaped > 32) .. ' ' .. tostring(afterwards - shaped < 32)\n"));
+}
+
+TEST_F(TestLua, TestNextDuringIncrementalRehash)
+{
+  // 4100 keys grow a 2^LUAI_INCREHASHLOG hash part, and only inserts move nodes to the new part,
+  //  so every traversal here runs with nodes still in the old part.
+  EXPECT_EQ("4100 8407050 2050 0 2350", RunChunk(
+    "local t = {}\n"
+    "for i = 1, 4100 do t['k' .. i] = i end\n"
+    "local n, sum = 0, 0\n"
+    "for k, v in next, t do n = n + 1 sum = sum + v t[k] = v + 1 end\n"
+    "for k, v in next, t do if v % 2 == 0 then t[k] = nil end end\n"
+    "local m, bad = 0, 0\n"
+    "for k in next, t do m = m + 1 end\n"
+    "for i = 1, 4100 do\n"
+    "  if t['k' .. i] ~= (i % 2 == 0 and i + 1 or nil) then bad = bad + 1 end\n"
+    "end\n"
+    "for i = 4101, 4400 do t['k' .. i] = i end\n"
+    "local total = 0\n"
+    "for k in next, t do total = total + 1 end\n"
+    "return table.concat({n, sum, m, bad, total}, ' ')\n"));
+}
+
+TEST_F(TestLua, TestLookupAfterMigratedKeysAreCollected)
+{
+  // Nodes already moved out of the old part are no longer marked, so their keys get collected
+  //  while lookups still walk the old part's chains through them (ASan builds catch a stale compare).
+  EXPECT_EQ("0", RunChunk(
+    "local t, pre = {}, string.rep('x', 50)\n"
+    "for i = 1, 4097 do t[pre .. i] = i end\n"
+    "for i = 1, 4097 do t[pre .. i] = nil end\n"
+    "collectgarbage() collectgarbage()\n"
+    "local hits = 0\n"
+    "for i = 1, 20000 do if t[pre .. 'n' .. i] ~= nil then hits = hits + 1 end end\n"
+    "return hits\n"));
+}
+
+TEST_F(TestLua, TestLengthAfterNilStores)
+{
+  // Every store here clears the last element, so each sequence has a single border.
+  EXPECT_EQ("10 9 7 6 7 6 0 2 1", RunChunk(
+    "local t, out = {}, {}\n"
+    "for i = 1, 10 do t[#t + 1] = i end\n"
+    "out[#out + 1] = #t\n"
+    "t[10] = nil\n"
+    "out[#out + 1] = #t\n"
+    "t[9] = nil t[8] = nil\n"
+    "out[#out + 1] = #t\n"
+    "rawset(t, 7, nil)\n"
+    "out[#out + 1] = #t\n"
+    "t[#t + 1] = 'x'\n"
+    "out[#out + 1] = #t\n"
+    "table.remove(t)\n"
+    "out[#out + 1] = #t\n"
+    "for i = #t, 1, -1 do t[i] = nil end\n"
+    "out[#out + 1] = #t\n"
+    "local h = {[1] = 1, [2] = 2, [3] = 3}\n"
+    "h[3] = nil\n"
+    "out[#out + 1] = #h\n"
+    "rawset(h, 2, nil)\n"
+    "out[#out + 1] = #h\n"
+    "return table.concat(out, ' ')\n"));
+}
+
+TEST_F(TestLua, TestShrinkAfterDrain)
+{
+  // The keys stay alive on their own, so what the queue gives back is its node vector,
+  //  once a collection found it mostly empty and a new key was added.
+  EXPECT_EQ("true nil 1000", RunChunk(
+    "local names = {}\n"
+    "for i = 1, 50000 do names[i] = 'job' .. i end\n"
+    "local q = {}\n"
+    "collectgarbage()\n"
+    "local base = collectgarbage('count')\n"
+    "for i = 1, 50000 do q[names[i]] = i end\n"
+    "local peak = collectgarbage('count')\n"
+    "for i = 1, 50000 do q[names[i]] = nil end\n"
+    "collectgarbage() collectgarbage()\n"
+    "q.first = true q.first = nil\n"
+    "collectgarbage()\n"
+    "local after = collectgarbage('count')\n"
+    "local empty = next(q)\n"
+    "for i = 1, 1000 do q[names[i]] = i end\n"
+    "local n = 0\n"
+    "for k, v in next, q do if q[names[v]] == v then n = n + 1 end end\n"
+    "return tostring(after < base + (peak - base) / 10) .. ' ' .. tostring(empty) .. ' ' .. n\n"));
+  // Collections during traversals, even nested ones, must not shrink the table under them.
+  EXPECT_EQ("1000 nil", RunChunk(
+    "local t = {}\n"
+    "for i = 1, 1000 do t['k' .. i] = i end\n"
+    "local n = 0\n"
+    "for k in pairs(t) do\n"
+    "  for k2 in pairs(t) do end\n"
+    "  t[k] = nil\n"
+    "  n = n + 1\n"
+    "  collectgarbage()\n"
+    "end\n"
+    "return n .. ' ' .. tostring(next(t))\n"));
+}
+
+TEST_F(TestLua, TestInterningWhileStringTableGrows)
+{
+  // Short strings are equal only if they are the same object, so rebuilding an old string
+  //  while the string table moves its buckets must find that object, wherever its bucket is.
+  EXPECT_EQ("0 0", RunChunk(
+    "local keep, index = {}, {}\n"
+    "local misses, wrong = 0, 0\n"
+    "for i = 1, 60000 do\n"
+    "  local s = 's' .. i\n"
+    "  if i % 3 == 0 then keep[#keep + 1] = s index[s] = i end\n"
+    "  if i % 7 == 0 and #keep > 0 then\n"
+    "    local j = keep[(i * 31) % #keep + 1]\n"
+    "    local n = tonumber(j:sub(2))\n"
+    "    if ('s' .. n) ~= j then wrong = wrong + 1 end\n"
+    "    if index['s' .. n] ~= n then misses = misses + 1 end\n"
+    "  end\n"
+    "  if i % 100 == 0 then collectgarbage('step', 1) end\n"
+    "end\n"
+    "collectgarbage()\n"
+    "for _, s in ipairs(keep) do\n"
+    "  if index['s' .. s:sub(2)] == nil then misses = misses + 1 end\n"
+    "end\n"
+    "return misses .. ' ' .. wrong\n"));
+}
+
+#pragma mark String builder tests.
+
+TEST_F(TestLua, TestStrbufGrowth)
+{
+  // Starts at 32 characters and grows many times over.
+  EXPECT_EQ("true 48894", RunChunk(
+    "local sb, parts = string.strbuf(), {}\n"
+    "for i = 1, 10000 do sb:append(i, ','); parts[#parts + 1] = i .. ',' end\n"
+    "return tostring(sb:tostring() == table.concat(parts)) .. ' ' .. #sb\n"));
+  EXPECT_EQ("true", RunChunk(
+    "local sb = string.strbuf():append('a')\n"
+    "local long = string.rep('x', 5000)\n"
+    "sb:append(long):appendf('<%s>', long)\n"
+    "return tostring(tostring(sb) == 'a' .. long .. '<' .. long .. '>')\n"));
+}
+
+TEST_F(TestLua, TestStrbufAppendsItself)
+{
+  // Formatting the strbuf reads what it held before the call, also when the call makes it grow.
+  EXPECT_EQ("abab|ab", RunChunk(
+    "local sb = string.strbuf():append('ab')\n"
+    "return tostring(sb:appendf('%s|%s', sb, sb))\n"));
+  EXPECT_EQ("true", RunChunk(
+    "local sb = string.strbuf():append(string.rep('x', 40))\n"
+    "sb:appendf('%s', sb)\n"
+    "return tostring(tostring(sb) == string.rep('x', 80))\n"));
+}
+
+TEST_F(TestLua, TestStrbufErrorKeepsContents)
+{
+  // Pieces added before the bad argument are dropped, whether or not they made the strbuf grow.
+  EXPECT_EQ("false ok false ok false ok ok!", RunChunk(
+    "local sb, out = string.strbuf():append('ok'), {}\n"
+    "out[#out + 1] = tostring(pcall(sb.append, sb, 'x', {}))\n"
+    "out[#out + 1] = tostring(sb)\n"
+    "out[#out + 1] = tostring(pcall(sb.append, sb, string.rep('y', 100), {}))\n"
+    "out[#out + 1] = tostring(sb)\n"
+    "out[#out + 1] = tostring(pcall(sb.appendf, sb, '%s%d', 'z', 'nan'))\n"
+    "out[#out + 1] = tostring(sb)\n"
+    "out[#out + 1] = tostring(sb:append('!'))\n"
+    "return table.concat(out, ' ')\n"));
+}
+
+TEST_F(TestLua, TestStrbufClearReuse)
+{
+  EXPECT_EQ("0  ab-ab-ab 3 xyz", RunChunk(
+    "local sb = string.strbuf():append(string.rep('q', 1000))\n"
+    "sb:clear()\n"
+    "local out = {#sb, tostring(sb)}\n"
+    "out[#out + 1] = tostring(sb:rep('ab', 3, '-'))\n"
+    "sb:clear():append('x', 'y', 'z')\n"
+    "out[#out + 1] = #sb\n"
+    "out[#out + 1] = tostring(sb)\n"
+    "return table.concat(out, ' ')\n"));
+}
+
 } //namespace BaseStation
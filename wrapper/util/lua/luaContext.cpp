@@ -8,53 +8,156 @@
 
 #include "util/lua/luaContext.h"
 #include "util/lua/luaScript.h"
+#include "util/lua/luaScriptTemplate.h"
 #include "util/lua/luaBridgeModule.h"
 #include "util/lua/luaUtils.h"
+#include "util/lua/luaLogSink.h"
+#include "util/lua/luaTrace.h"
+#include "util/helpers/templateHelpers.h"
 #include <lua/lua.hpp>
 
 #include "util/logging/logging.h"
 #include "util/parsingConstants/parsingConstants.h"
 #include <assert.h>
+#include <fstream>
+#include <future>
+#include <map>
+#include <ostream>
 
 
 
 namespace Anki{ namespace Util {
   
+  // Registry key of the chunks loaded by the context (for WriteCoverage), only there when the core
+  //  records coverage.  The keys are weak, so coverage never keeps a chunk alive: each chunk maps to a
+  //  sentinel table whose finalizer folds the chunk's coverage into collectedCoverage_ once it dies.
+  static const char kLoadedChunksKey = 0;
+  static const char kChunkSentinelMetaKey = 0;
+  
+  static void LuaContext_IgnoreCoverageLine(void* ud, const char* source, int line, int hit)
+  {
+  }
+  
+  static void LuaContext_CoverageLine(void* ud, const char* source, int line, int hit);
+  
+  // __gc of a chunk's sentinel, { chunk }.  The chunk is reachable again from the sentinel being finalized.
+  static int LuaContext_FoldChunkCoverage(lua_State* state)
+  {
+    LuaCoverageMap* collectedCoverage = static_cast<LuaCoverageMap*>(lua_touserdata(state, lua_upvalueindex(1)));
+    lua_rawgeti(state, 1, 1);
+    if(lua_isfunction(state, -1)) {
+      lua_getcoverage(state, -1, &LuaContext_CoverageLine, collectedCoverage);
+    }
+    return 0;
+  }
+  
   LuaContext::LuaContext() {
     luaState_ = luaL_newstate();
     luaL_openlibs(luaState_);
+    logSink_ = new LuaLogSink();
+    logSink_->InstallPrint(luaState_);
+    LuaTraceRecorder::InstallGCHook(luaState_);
+    luaL_requiref(luaState_, "trace", &LuaTraceRecorder::OpenLibrary, 1);
+    // lua_getcoverage only reports whether coverage is compiled in when given a function.
+    collectedCoverage_ = nullptr;
+    luaL_loadstring(luaState_, "");
+    if(lua_getcoverage(luaState_, -1, &LuaContext_IgnoreCoverageLine, nullptr)) {
+      collectedCoverage_ = new LuaCoverageMap();
+      lua_newtable(luaState_);
+      lua_createtable(luaState_, 0, 1);
+      lua_pushliteral(luaState_, "k");
+      lua_setfield(luaState_, -2, "__mode");
+      lua_setmetatable(luaState_, -2);
+      lua_rawsetp(luaState_, LUA_REGISTRYINDEX, &kLoadedChunksKey);
+      lua_createtable(luaState_, 0, 1);
+      lua_pushlightuserdata(luaState_, collectedCoverage_);
+      lua_pushcclosure(luaState_, &LuaContext_FoldChunkCoverage, 1);
+      lua_setfield(luaState_, -2, "__gc");
+      lua_rawsetp(luaState_, LUA_REGISTRYINDEX, &kChunkSentinelMetaKey);
+    }
+    lua_settop(luaState_, 0);
   }
   
   LuaContext::~LuaContext() {
     lua_close(luaState_);
+    // Only after the state is gone, so that nothing can print into a dead sink
+    //  (and the last chunk sentinels have been finalized).
+    SafeDelete(logSink_);
+    SafeDelete(collectedCoverage_);
   }
   
-  LuaScript* LuaContext::CreateLuaScriptWithFile(const std::string& fileName)
+  bool LuaContext::RunScript(const std::string& fileName, const LuaCompiledChunk* compiledChunk, const char* eventName)
   {
+    if(compiledChunk != nullptr) {
+      // Compiled on another thread, only the bytecode is left to load.
+      if(!compiledChunk->IsValid()) {
+        PRINT_NAMED_ERROR((std::string(eventName) + ".compile").c_str(), "%s", compiledChunk->error.c_str());
+        return false;
+      }
+      if(luaL_loadbufferx(luaState_, compiledChunk->bytecode.data(), compiledChunk->bytecode.size(), ("@" + fileName).c_str(), "b")) {
+        PRINT_NAMED_ERROR((std::string(eventName) + ".loadBytecode").c_str(), "%s", lua_tolstring(luaState_, 1, NULL));
+        lua_settop(luaState_, 0);
+        CollectGarbage();
+        return false;
+      }
+    }
     // Load script from file.
-    if(luaL_loadfile(luaState_, fileName.c_str())) {
+    else if(luaL_loadfile(luaState_, fileName.c_str())) {
       __attribute__((unused)) const char* errorString = lua_tolstring(luaState_, 1, NULL);
-      PRINT_NAMED_ERROR("LuaContext.CreateLuaScriptWithFile.loadFile", "%s", errorString);
+      PRINT_NAMED_ERROR((std::string(eventName) + ".loadFile").c_str(), "%s", errorString);
       assert(!errorString);
+      lua_settop(luaState_, 0);
       CollectGarbage();
-      return nullptr;
+      return false;
     }
+    // Remember the chunk, its functions are where coverage is recorded.
+    lua_rawgetp(luaState_, LUA_REGISTRYINDEX, &kLoadedChunksKey);
+    if(lua_istable(luaState_, -1)) {
+      lua_pushvalue(luaState_, -2);
+      lua_createtable(luaState_, 1, 0);
+      lua_pushvalue(luaState_, -4);
+      lua_rawseti(luaState_, -2, 1);
+      lua_rawgetp(luaState_, LUA_REGISTRYINDEX, &kChunkSentinelMetaKey);
+      lua_setmetatable(luaState_, -2);
+      lua_rawset(luaState_, -3);
+    }
+    lua_pop(luaState_, 1);
+    
     // Script is now on the top of the stack, call it.
     if(lua_pcall(luaState_, 0, 1, 0)) {
       __attribute__((unused)) const char* errorString = lua_tolstring(luaState_, 1, NULL);
-      PRINT_NAMED_ERROR("LuaContext.CreateLuaScriptWithFile.pcall", "%s", errorString);
+      PRINT_NAMED_ERROR((std::string(eventName) + ".pcall").c_str(), "%s", errorString);
       assert(!errorString);
+      lua_settop(luaState_, 0);
       CollectGarbage();
-      return nullptr;
+      return false;
     }
     // At this point, the script was successfully run.
     // We need to do a bit of work to make sure it did so correctly.
     
     if(lua_gettop(luaState_) != 1) {
       // DEBUGGER ENTRY HERE
-      PRINT_NAMED_ERROR("LuaContext.CreateLuaScriptWithFile", "Expected at least one return item from script %s.", fileName.c_str());
+      PRINT_NAMED_ERROR(eventName, "Expected at least one return item from script %s.", fileName.c_str());
       lua_settop(luaState_, 0);
       CollectGarbage();
+      return false;
+    }
+    return true;
+  }
+  
+  LuaScript* LuaContext::CreateLuaScriptWithFile(const std::string& fileName)
+  {
+    return CreateLuaScript(fileName, nullptr, "LuaContext.CreateLuaScriptWithFile");
+  }
+  
+  LuaScript* LuaContext::CreateLuaScriptWithChunk(const LuaCompiledChunk& compiledChunk)
+  {
+    return CreateLuaScript(compiledChunk.fileName, &compiledChunk, "LuaContext.CreateLuaScriptWithChunk");
+  }
+  
+  LuaScript* LuaContext::CreateLuaScript(const std::string& fileName, const LuaCompiledChunk* compiledChunk, const char* eventName)
+  {
+    if(!RunScript(fileName, compiledChunk, eventName)) {
       return nullptr;
     }
     
@@ -76,7 +179,7 @@ namespace Anki{ namespace Util {
     else {
       // DEBUG ENTRY HERE.
       lua_settop(luaState_, 0);
-      PRINT_NAMED_ERROR("LuaContext.CreateLuaScriptWithFile", "Script didn't return a thread or function!");
+      PRINT_NAMED_ERROR(eventName, "Script didn't return a thread or function!");
       CollectGarbage();
       return nullptr;
     }
@@ -90,11 +193,180 @@ namespace Anki{ namespace Util {
     return newScript;
   }
   
+  LuaScriptTemplate* LuaContext::CreateLuaScriptTemplateWithFile(const std::string& fileName)
+  {
+    return CreateLuaScriptTemplate(fileName, nullptr, "LuaContext.CreateLuaScriptTemplateWithFile");
+  }
+  
+  LuaScriptTemplate* LuaContext::CreateLuaScriptTemplateWithChunk(const LuaCompiledChunk& compiledChunk)
+  {
+    return CreateLuaScriptTemplate(compiledChunk.fileName, &compiledChunk, "LuaContext.CreateLuaScriptTemplateWithChunk");
+  }
+  
+  LuaScriptTemplate* LuaContext::CreateLuaScriptTemplate(const std::string& fileName, const LuaCompiledChunk* compiledChunk, const char* eventName)
+  {
+    if(!RunScript(fileName, compiledChunk, eventName)) {
+      return nullptr;
+    }
+    
+    // A thread can only be run once, the template needs a function to start every script with.
+    if(!lua_isfunction(luaState_, -1)) {
+      lua_settop(luaState_, 0);
+      PRINT_NAMED_ERROR(eventName, "Script %s didn't return a function!", fileName.c_str());
+      CollectGarbage();
+      return nullptr;
+    }
+    
+    // The template takes the function off the stack.
+    LuaScriptTemplate* newTemplate = new LuaScriptTemplate(luaState_);
+    lua_settop(luaState_, 0);
+    
+    CollectGarbage();
+    
+    return newTemplate;
+  }
+  
+  
+#pragma mark - Background compilation
+  static int LuaContext_WriteBytecode(lua_State* L, const void* data, size_t size, void* ud)
+  {
+    static_cast<std::string*>(ud)->append(static_cast<const char*>(data), size);
+    return 0;
+  }
+  
+  std::future<LuaCompiledChunk> LuaContext::LoadAsync(const std::string& fileName)
+  {
+    // The worker has its own scratch state and never touches this context.
+    return std::async(std::launch::async, [fileName]() {
+      LuaCompiledChunk compiledChunk;
+      compiledChunk.fileName = fileName;
+      lua_State* scratchState = luaL_newstate();
+      if(luaL_loadfile(scratchState, fileName.c_str())) {
+        const char* errorString = lua_tolstring(scratchState, -1, NULL);
+        compiledChunk.error = (errorString != NULL) ? errorString : "unknown error";
+      }
+      else {
+        lua_dump(scratchState, &LuaContext_WriteBytecode, &compiledChunk.bytecode);
+      }
+      lua_close(scratchState);
+      return compiledChunk;
+    });
+  }
+  
   
   void LuaContext::CollectGarbage() {
     lua_gc(luaState_, LUA_GCCOLLECT, 0);
   }
   
+#pragma mark - Coverage
+  static void LuaContext_CoverageLine(void* ud, const char* source, int line, int hit)
+  {
+    // Only chunks loaded from files ("@path") have something lcov can point at.
+    if(source[0] != '@') {
+      return;
+    }
+    LuaCoverageMap& coverage = *static_cast<LuaCoverageMap*>(ud);
+    bool& lineHit = coverage[&source[1]][line];
+    lineHit = lineHit || (hit != 0);
+  }
+  
+  bool LuaContext::WriteCoverage(std::ostream& stream)
+  {
+    LuaCoverageMap coverage;
+    lua_rawgetp(luaState_, LUA_REGISTRYINDEX, &kLoadedChunksKey);
+    const bool available = lua_istable(luaState_, -1);
+    if(available) {
+      coverage = *collectedCoverage_;
+      lua_pushnil(luaState_);
+      while(lua_next(luaState_, -2) != 0) {
+        lua_pop(luaState_, 1);
+        lua_getcoverage(luaState_, -1, &LuaContext_CoverageLine, &coverage);
+      }
+    }
+    lua_settop(luaState_, 0);
+    if(!available) {
+      PRINT_NAMED_WARNING("LuaContext.WriteCoverage", "Lua was built without LUA_COVERAGE");
+      return false;
+    }
+    
+    for(const auto& file : coverage) {
+      size_t linesHit = 0;
+      stream << "TN:\nSF:" << file.first << "\n";
+      for(const auto& line : file.second) {
+        stream << "DA:" << line.first << "," << (line.second ? 1 : 0) << "\n";
+        linesHit += (line.second ? 1 : 0);
+      }
+      stream << "LF:" << file.second.size() << "\nLH:" << linesHit << "\nend_of_record\n";
+    }
+    stream.flush();
+    return true;
+  }
+  
+#pragma mark - Heap snapshot
+  static void LuaContext_HeapObject(void* ud, const void* object, const char* type, size_t size)
+  {
+    std::ostream& stream = *static_cast<std::ostream*>(ud);
+    stream << "o\t" << object << "\t" << type << "\t" << size << "\n";
+  }
+  
+  static void LuaContext_HeapRef(void* ud, const void* from, const void* to, const char* name)
+  {
+    static const size_t kMaxNameLength = 64;
+    std::ostream& stream = *static_cast<std::ostream*>(ud);
+    stream << "r\t";
+    if(from != nullptr) {
+      stream << from;
+    }
+    else {
+      stream << "0";
+    }
+    stream << "\t" << to << "\t";
+    // Keys can be any string, keep each entry on one line.
+    for(size_t i = 0; name != nullptr && name[i] != '\0' && i < kMaxNameLength; i++) {
+      const char c = name[i];
+      stream << ((c == '\t' || c == '\n' || c == '\r') ? ' ' : c);
+    }
+    stream << "\n";
+  }
+  
+  void LuaContext::WriteHeapSnapshot(std::ostream& stream)
+  {
+    CollectGarbage();
+    stream << "lua-heap-snapshot 1\n";
+    lua_walkheap(luaState_, &LuaContext_HeapObject, &LuaContext_HeapRef, &stream);
+    stream.flush();
+  }
+  
+  bool LuaContext::WriteHeapSnapshot(const std::string& fileName)
+  {
+    std::ofstream stream(fileName.c_str());
+    if(!stream.good()) {
+      PRINT_NAMED_ERROR("LuaContext.WriteHeapSnapshot", "could not open %s", fileName.c_str());
+      return false;
+    }
+    WriteHeapSnapshot(stream);
+    return stream.good();
+  }
+  
+#pragma mark - Table pool
+  void LuaContext::SetTablePoolSize(int maxTables)
+  {
+    lua_settablepool(luaState_, maxTables);
+  }
+  
+  LuaTablePoolStats LuaContext::GetTablePoolStats() const
+  {
+    lua_TablePoolStats luaStats;
+    lua_gettablepool(luaState_, &luaStats);
+    LuaTablePoolStats stats;
+    stats.reused = luaStats.reused;
+    stats.created = luaStats.created;
+    stats.pooled = luaStats.pooled;
+    stats.dropped = luaStats.dropped;
+    stats.size = luaStats.size;
+    return stats;
+  }
+  
   void LuaContext::RequireModule(const ILuaBridgeModule& module) {
     luaL_requiref(luaState_, module.GetModuleName().c_str(), module.GetRegistrationFunction(), 1);
     lua_settop(luaState_, 0);
@@ -11,7 +11,16 @@
 *  - Can be used to load bridge modules via RequireLib (see ILuaBridgeModule)
 *  - Can be used to manually do garbage collection on the Lua context.
 *  - Spawns new scripts with the CreateLuaScriptWith* methods
+*  - Can compile a script on a background thread (LoadAsync), so that only loading the
+*    bytecode is left to do on the context's thread.
+*  - Loads a script once with CreateLuaScriptTemplateWithFile, for spawning many instances
+*    of it cheaply (see LuaScriptTemplate)
 *  - Can be used to set global values (visible from all scripts spawned by this context)
+*  - Routes 'print' from its scripts to the engine log through a LuaLogSink.
+*  - Can write line coverage of its scripts (lcov format) when Lua is built with LUA_COVERAGE.
+*  - Can write a snapshot of its heap (every object, its size and references), compare
+*    two of them with tools/luaHeapDiff.py.
+*  - Can keep the tables its scripts throw away in a pool, to hand them out again.
 *  - Will close the Lua Context and notify all spawned scripts of termination upon destruction.
 *
 *
@@ -22,12 +31,39 @@
 
 
 #include <string>
+#include <future>
+#include <iosfwd>
+#include <map>
 #include "util/helpers/noncopyable.h"
 
 struct lua_State;
 namespace Anki{ namespace Util {
   class LuaScript;
+  class LuaScriptTemplate;
   class ILuaBridgeModule;
+  class LuaLogSink;
+  
+  // source file -> line -> hit
+  typedef std::map<std::string, std::map<int, bool>> LuaCoverageMap;
+  
+  // Result of LuaContext::LoadAsync.
+  struct LuaCompiledChunk {
+    std::string fileName;
+    std::string bytecode;
+    // Set if the file couldn't be compiled.
+    std::string error;
+    
+    bool IsValid() const { return error.empty(); }
+  };
+  
+  // Result of LuaContext::GetTablePoolStats, counts since the context was created.
+  struct LuaTablePoolStats {
+    size_t reused = 0;    // new tables taken from the pool
+    size_t created = 0;   // new tables allocated while the pool was enabled but empty
+    size_t pooled = 0;    // collected tables kept in the pool
+    size_t dropped = 0;   // collected tables freed because the pool was full (or they were too large)
+    int size = 0;         // tables in the pool now
+  };
   
   class LuaContext : public Anki::Util::noncopyable {
     
@@ -36,6 +72,16 @@ namespace Anki{ namespace Util {
     ~LuaContext();
     
     LuaScript* CreateLuaScriptWithFile(const std::string& fileName);
+    // Runs the file once and keeps the function it returns, scripts are then spawned from the template.
+    //  Returns nullptr if the file fails to run or doesn't return a function.
+    LuaScriptTemplate* CreateLuaScriptTemplateWithFile(const std::string& fileName);
+    
+    // Compiles fileName on a worker thread, the future is ready once the bytecode is.
+    //  Doesn't touch the context, so it can be called from any thread.
+    static std::future<LuaCompiledChunk> LoadAsync(const std::string& fileName);
+    // Same as the *WithFile versions, with a chunk from LoadAsync instead of parsing the file.
+    LuaScript* CreateLuaScriptWithChunk(const LuaCompiledChunk& compiledChunk);
+    LuaScriptTemplate* CreateLuaScriptTemplateWithChunk(const LuaCompiledChunk& compiledChunk);
     
     void RequireModule(const ILuaBridgeModule& module);
     void CollectGarbage();
@@ -43,9 +89,37 @@ namespace Anki{ namespace Util {
     void SetGlobal(const std::string& globalName, void* value);
     void ClearGlobal(const std::string& globalName);
     
+    LuaLogSink& GetLogSink() { return *logSink_; }
+    
+    // Writes which lines of the scripts loaded by this context have run, one lcov record per source file.
+    //  The context doesn't keep chunks alive for this: the lines a chunk ran are folded in when it is collected.
+    //  Returns false (and writes nothing) if the Lua core wasn't built with LUA_COVERAGE.
+    bool WriteCoverage(std::ostream& stream);
+    
+    // Runs a full collection, then writes every live object of the context and the references between them.
+    //  Format, one entry per line (fields separated by tabs):
+    //   "lua-heap-snapshot 1" header
+    //   "o <address> <type> <bytes>" for every object
+    //   "r <from> <to> <name>" for every reference (from 0 for roots, name may be empty)
+    void WriteHeapSnapshot(std::ostream& stream);
+    bool WriteHeapSnapshot(const std::string& fileName);
+    
+    // Keeps up to maxTables collected tables (emptied) for reuse by new ones, 0 (the default) disables
+    //  the pool and frees the tables it holds.
+    void SetTablePoolSize(int maxTables);
+    LuaTablePoolStats GetTablePoolStats() const;
+    
   private:
+    // Loads and runs fileName (from compiledChunk if not null), leaving the single value it
+    //  returned on the stack. On failure, logs under eventName, clears the stack and returns false.
+    bool RunScript(const std::string& fileName, const LuaCompiledChunk* compiledChunk, const char* eventName);
+    LuaScript* CreateLuaScript(const std::string& fileName, const LuaCompiledChunk* compiledChunk, const char* eventName);
+    LuaScriptTemplate* CreateLuaScriptTemplate(const std::string& fileName, const LuaCompiledChunk* compiledChunk, const char* eventName);
     
     lua_State *luaState_;
+    LuaLogSink *logSink_;
+    // Coverage of the chunks that were collected (null when Lua is built without LUA_COVERAGE).
+    LuaCoverageMap *collectedCoverage_;
   };
 
 } }
@@ -16,6 +16,8 @@
 #include <fstream>
 #include <sstream>
 #include <assert.h>
+#include <ctype.h>
+#include <string.h>
 
 namespace Anki{ namespace Util {
   
@@ -42,6 +44,9 @@ namespace Anki{ namespace Util {
     lua_sethook(thread, nullptr, 0, 0);
     sDebuggerMap.erase(thread);
     SafeDelete(_stepBreakpoint);
+    for(const auto* bp : _breakpoints) {
+      ReleaseCompiledChunks(*bp);
+    }
   }
   
 #pragma mark - Interactive Debugger Commands
@@ -419,7 +424,7 @@ namespace Anki{ namespace Util {
   }
 
 #pragma mark - Function Breakpoints
-  void LuaDebugger::SetFunctionBreakpoint(const std::string& functionName)
+  void LuaDebugger::SetFunctionBreakpoint(const std::string& functionName, const LuaBreakpointOptions& options)
   {
     LuaBreakpoint_Function breakpoint(functionName);
     auto ret = _functionBreakpoints.emplace(breakpoint);
@@ -427,6 +432,8 @@ namespace Anki{ namespace Util {
       // This was a new breakpoint.
       _breakpoints.push_back(&(*ret.first));
     }
+    ReleaseCompiledChunks(*ret.first);
+    ret.first->SetOptions(options);
     UpdateHooks();
   }
 
@@ -441,6 +448,7 @@ namespace Anki{ namespace Util {
           break;
         }
       }
+      ReleaseCompiledChunks(*toDelete);
       _functionBreakpoints.erase(toDelete);
     }
     UpdateHooks();
@@ -459,13 +467,15 @@ namespace Anki{ namespace Util {
   
   
 #pragma mark - Line Number Breakpoints
-  void LuaDebugger::SetLineBreakpoint(const std::string& fileName, const int lineNumber)
+  void LuaDebugger::SetLineBreakpoint(const std::string& fileName, const int lineNumber, const LuaBreakpointOptions& options)
   {
     const LuaBreakpoint_Line breakpoint(fileName, lineNumber);
     auto ret = _lineBreakpoints.emplace(breakpoint);
     if(ret.second) {
       _breakpoints.push_back(&(*ret.first));
     }
+    ReleaseCompiledChunks(*ret.first);
+    ret.first->SetOptions(options);
     UpdateHooks();
   }
   
@@ -480,6 +490,7 @@ namespace Anki{ namespace Util {
           break;
         }
       }
+      ReleaseCompiledChunks(*toDelete);
       _lineBreakpoints.erase(toDelete);
     }
     UpdateHooks();
@@ -497,6 +508,218 @@ namespace Anki{ namespace Util {
     return nullptr;
   }
   
+#pragma mark - Conditions and Logpoints
+  // Unlike EvaluateExpression, conditions and log messages are only parsed once per breakpoint:
+  //  the chunk takes the frame's upvalues and locals as arguments ("local a, b, c = ..."), so each hit
+  //  only has to push their current values and call it.
+  //  It is recompiled if the breakpoint is reached from a frame with different variables.
+  
+  static inline bool IsBindableName(const char* name)
+  {
+    // Skips "(*temporary)" and friends, and the empty / "?" names of C function and stripped upvalues.
+    return name != nullptr && (isalpha((unsigned char)name[0]) || name[0] == '_');
+  }
+  
+  // Pushes the values of the running function's upvalues then its locals, and puts their names into _frameVariables.
+  //  _ENV is left out, it is handed to the chunk as its own _ENV instead.
+  //  A hook is only guaranteed LUA_MINSTACK free slots, so the stack is grown for every value.
+  int LuaDebugger::PushFrameVariables(lua_Debug* ar)
+  {
+    lua_State* state = _script.GetLuaThread();
+    _frameVariables.clear();
+    int numVariables = 0;
+    
+    lua_getinfo(state, "f", ar);
+    const int functionIndex = lua_gettop(state);
+    for(int i = 1; ; i++) {
+      luaL_checkstack(state, 1, "too many variables for a breakpoint");
+      const char* name = lua_getupvalue(state, functionIndex, i);
+      if(name == nullptr) break;
+      if(IsBindableName(name) && strcmp(name, "_ENV") != 0) {
+        _frameVariables += (numVariables > 0 ? ", " : "");
+        _frameVariables += name;
+        numVariables++;
+      }
+      else {
+        lua_pop(state, 1);
+      }
+    }
+    for(int i = 1; ; i++) {
+      luaL_checkstack(state, 1, "too many variables for a breakpoint");
+      const char* name = lua_getlocal(state, ar, i);
+      if(name == nullptr) break;
+      if(IsBindableName(name)) {
+        _frameVariables += (numVariables > 0 ? ", " : "");
+        _frameVariables += name;
+        numVariables++;
+      }
+      else {
+        lua_pop(state, 1);
+      }
+    }
+    lua_remove(state, functionIndex);
+    return numVariables;
+  }
+  
+  static void AppendQuoted(std::string& out, const char* str, size_t length)
+  {
+    out += '"';
+    for(size_t i = 0; i < length; i++) {
+      const char c = str[i];
+      switch(c) {
+        case '"':  out += "\\\""; break;
+        case '\\': out += "\\\\"; break;
+        case '\n': out += "\\n"; break;
+        case '\r': out += "\\r"; break;
+        case '\0': out += "\\0"; break;
+        default:   out += c; break;
+      }
+    }
+    out += '"';
+  }
+  
+  // "x = {x}, y = {y}" -> "x = ", (x), ", y = ", (y)
+  static void AppendLogMessageExpressions(std::string& out, const std::string& message)
+  {
+    size_t textStart = 0;
+    bool first = true;
+    while(textStart < message.size()) {
+      const size_t open = message.find('{', textStart);
+      const size_t close = (open == std::string::npos ? std::string::npos : message.find('}', open + 1));
+      const size_t textEnd = (close == std::string::npos ? message.size() : open);
+      if(!first) out += ", ";
+      AppendQuoted(out, message.data() + textStart, textEnd - textStart);
+      first = false;
+      if(close == std::string::npos) {
+        break;
+      }
+      out += ", (";
+      out.append(message, open + 1, close - open - 1);
+      out += ")";
+      textStart = close + 1;
+    }
+    if(first) {
+      out += "\"\"";
+    }
+  }
+  
+  // Runs the breakpoint's condition (or log message) in the frame of ar, leaving its results on the stack.
+  //  Returns the number of results, or -1 if it failed to compile or run (the error has been reported).
+  int LuaDebugger::RunBreakpointChunk(const LuaBreakpoint& breakpoint, lua_Debug* ar, bool logMessage)
+  {
+    lua_State* state = _script.GetLuaThread();
+    const int stackSize = lua_gettop(state);
+    const int numVariables = PushFrameVariables(ar);
+    luaL_checkstack(state, 3, "too many variables for a breakpoint"); // the chunk, the function and its _ENV
+    if(_frameVariables != breakpoint._boundVariables) {
+      ReleaseCompiledChunks(breakpoint);
+      breakpoint._boundVariables = _frameVariables;
+    }
+    
+    int& chunkRef = (logMessage ? breakpoint._logMessageRef : breakpoint._conditionRef);
+    int status = LUA_OK;
+    if(chunkRef == 0) {
+      std::string source;
+      if(numVariables > 0) {
+        source += "local " + _frameVariables + " = ...\n";
+      }
+      source += "return ";
+      if(logMessage) {
+        AppendLogMessageExpressions(source, breakpoint._options.logMessage);
+      }
+      else {
+        source += breakpoint._options.condition;
+      }
+      status = luaL_loadbuffer(state, source.data(), source.size(), (logMessage ? "=logpoint" : "=condition"));
+      if(status == LUA_OK) {
+        chunkRef = luaL_ref(state, LUA_REGISTRYINDEX);
+      }
+    }
+    
+    if(status == LUA_OK) {
+      lua_rawgeti(state, LUA_REGISTRYINDEX, chunkRef);
+      // The chunk sees the same globals as the frame.
+      lua_getinfo(state, "f", ar);
+      const char* upvalName = nullptr;
+      for(int i = 1; (upvalName = lua_getupvalue(state, -1, i)) != nullptr; i++) {
+        if(strcmp(upvalName, "_ENV") == 0) break;
+        lua_pop(state, 1);
+      }
+      if(upvalName == nullptr) {
+        lua_pushglobaltable(state);
+      }
+      lua_remove(state, -2);
+      lua_setupvalue(state, -2, 1);
+      
+      lua_insert(state, stackSize + 1);
+      status = lua_pcall(state, numVariables, LUA_MULTRET, 0);
+    }
+    
+    if(status != LUA_OK) {
+      const char* errorStr = lua_tolstring(state, -1, nullptr);
+      if(errorStr == nullptr) errorStr = "( no description )";
+      *_outStream << "**Error in breakpoint " << (logMessage ? "log message" : "condition") << ": " << errorStr << std::endl;
+      lua_settop(state, stackSize);
+      return -1;
+    }
+    return lua_gettop(state) - stackSize;
+  }
+  
+  bool LuaDebugger::ShouldStopAtBreakpoint(const LuaBreakpoint& breakpoint, lua_Debug* ar)
+  {
+    lua_State* state = _script.GetLuaThread();
+    const LuaBreakpointOptions& options = breakpoint.GetOptions();
+    
+    if(!options.condition.empty()) {
+      const int numResults = RunBreakpointChunk(breakpoint, ar, false);
+      if(numResults < 0) {
+        // Broken condition, stop so that someone notices.
+        return true;
+      }
+      const bool conditionHolds = (numResults > 0 && lua_toboolean(state, -numResults));
+      lua_pop(state, numResults);
+      if(!conditionHolds) {
+        return false;
+      }
+    }
+    
+    breakpoint.Hit();
+    if(breakpoint.GetHitCount() < options.hitCount) {
+      return false;
+    }
+    
+    if(!options.logMessage.empty()) {
+      const int numResults = RunBreakpointChunk(breakpoint, ar, true);
+      if(numResults > 0) {
+        std::string line;
+        for(int i = -numResults; i < 0; i++) {
+          size_t length = 0;
+          const char* str = luaL_tolstring(state, i, &length);
+          line.append(str, length);
+          lua_pop(state, 1);
+        }
+        lua_pop(state, numResults);
+        *_outStream << line << std::endl;
+      }
+      return false;
+    }
+    return true;
+  }
+  
+  void LuaDebugger::ReleaseCompiledChunks(const LuaBreakpoint& breakpoint)
+  {
+    lua_State* state = _script.GetLuaThread();
+    if(breakpoint._conditionRef != 0) {
+      luaL_unref(state, LUA_REGISTRYINDEX, breakpoint._conditionRef);
+      breakpoint._conditionRef = 0;
+    }
+    if(breakpoint._logMessageRef != 0) {
+      luaL_unref(state, LUA_REGISTRYINDEX, breakpoint._logMessageRef);
+      breakpoint._logMessageRef = 0;
+    }
+    breakpoint._boundVariables.clear();
+  }
+  
 #pragma mark - Internals
   bool LuaDebugger::GetDebugStack(lua_Debug *debugInfo,
                                   const unsigned int stackFrame) const
@@ -593,8 +816,7 @@ namespace Anki{ namespace Util {
         // HOOKCALL => We're calling a function.
         if(ar->name) {
           const LuaBreakpoint_Function* funcBP = GetBreakpointForFunction(ar->name);
-          if(funcBP != nullptr) {
-            funcBP->Hit();
+          if(funcBP != nullptr && ShouldStopAtBreakpoint(*funcBP, ar)) {
             PrintBacktrace(*_outStream);
             PrintSource(*_outStream);
             EnterDebugger(*_inStream, *_outStream);
@@ -606,8 +828,7 @@ namespace Anki{ namespace Util {
         // HOOKLINE => We're executing a new lua source line.
         {
           const LuaBreakpoint_Line *lineBP = GetBreakpointForLine(ar->short_src, ar->currentline);
-          if(lineBP != nullptr) {
-            lineBP->Hit();
+          if(lineBP != nullptr && ShouldStopAtBreakpoint(*lineBP, ar)) {
             PrintBacktrace(*_outStream);
             PrintSource(*_outStream);
             EnterDebugger(*_inStream, *_outStream);
@@ -22,6 +22,19 @@ struct lua_Debug;
 namespace Anki{ namespace Util {
   
 class LuaScript;
+
+// Optional behaviour for a breakpoint, checked each time it is reached.
+struct LuaBreakpointOptions {
+  // Lua expression, evaluated in the breakpoint's frame (locals and upvalues visible).
+  //  The breakpoint is skipped unless it is true.  Empty means always.
+  std::string condition;
+  // Only stop once the condition has held this many times (0 or 1 means every time).
+  unsigned int hitCount = 0;
+  // When set, this is a logpoint: print the message and carry on instead of stopping.
+  //  Text inside {braces} is evaluated as a Lua expression in the frame, e.g. "x = {x}".
+  std::string logMessage;
+};
+
 class LuaDebugger : public Anki::Util::noncopyable {
 #pragma mark - Interfaces
   //
@@ -57,10 +70,14 @@ public:
   //
   // Breakpoint Interfaces
   //
-  void SetFunctionBreakpoint(const std::string& functionName);
+  // Setting an existing breakpoint again replaces its options.
+  //  Conditions and log messages are compiled the first time the breakpoint is reached, not on each hit.
+  void SetFunctionBreakpoint(const std::string& functionName,
+                             const LuaBreakpointOptions& options = LuaBreakpointOptions());
   void UnsetFunctionBreakpoint(const std::string& functionName);
   
-  void SetLineBreakpoint(const std::string& fileName, const int lineNumber);
+  void SetLineBreakpoint(const std::string& fileName, const int lineNumber,
+                         const LuaBreakpointOptions& options = LuaBreakpointOptions());
   void UnsetLineBreakpoint(const std::string& fileName, const int lineNumber);
   
   void UnsetBreakpoint(int breakpointIndex);
@@ -108,6 +125,12 @@ private:
   const LuaBreakpoint_Function* GetBreakpointForFunction(const std::string& functionName) const;
   const LuaBreakpoint_Line* GetBreakpointForLine(const std::string& fileName, const int lineNumber) const;
   
+  // Checks condition, hit count and log message.  Returns true if we should enter the debugger.
+  bool ShouldStopAtBreakpoint(const LuaBreakpoint& breakpoint, lua_Debug* ar);
+  int PushFrameVariables(lua_Debug* ar);
+  int RunBreakpointChunk(const LuaBreakpoint& breakpoint, lua_Debug* ar, bool logMessage);
+  void ReleaseCompiledChunks(const LuaBreakpoint& breakpoint);
+  
   enum class DebuggerState {
     Idle,
     Debugging,
@@ -128,6 +151,8 @@ private:
   std::set<LuaBreakpoint_Line> _lineBreakpoints;
   LuaBreakpoint *_stepBreakpoint;
   DebuggerState _debuggerState;
+  // Scratch for PushFrameVariables (names of the variables the breakpoint chunks get bound to).
+  std::string _frameVariables;
 }; // LuaDebugger
   
   
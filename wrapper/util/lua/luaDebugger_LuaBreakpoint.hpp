@@ -15,10 +15,16 @@
 class LuaBreakpoint {
 public:
   LuaBreakpoint()
-  : _hitCount(0) {};
+  : _hitCount(0)
+  , _conditionRef(0)
+  , _logMessageRef(0) {};
   
+  // Compiled chunks belong to the original, the copy compiles its own.
   LuaBreakpoint(const LuaBreakpoint& other)
-  : _hitCount(other._hitCount) {};
+  : _hitCount(other._hitCount)
+  , _options(other._options)
+  , _conditionRef(0)
+  , _logMessageRef(0) {};
   
   virtual ~LuaBreakpoint() {};
   
@@ -34,8 +40,28 @@ public:
     return _hitCount;
   };
   
+  const LuaBreakpointOptions& GetOptions() const
+  {
+    return _options;
+  }
+  
+  // Breakpoints live in sets, options aren't part of their ordering.
+  void SetOptions(const LuaBreakpointOptions& options) const
+  {
+    _options = options;
+    _hitCount = 0;
+  }
+  
 private:
+  friend class LuaDebugger;
+  
   unsigned mutable int _hitCount;
+  mutable LuaBreakpointOptions _options;
+  // Registry references to the compiled condition / log message (0 until compiled),
+  //  and the frame variables (see LuaDebugger::PushFrameVariables) they take as arguments.
+  mutable int _conditionRef;
+  mutable int _logMessageRef;
+  mutable std::string _boundVariables;
 };
 
 #pragma mark Function breakpoints
@@ -0,0 +1,173 @@
+//
+//  LuaLogSink.cpp
+//  BaseStation
+//
+//  Created by Mark Pauley on 7/25/14.
+//  Copyright (c) 2014 Anki. All rights reserved.
+//
+
+#include "util/lua/luaLogSink.h"
+#include "util/logging/logging.h"
+#include <lua/lua.hpp>
+#include <algorithm>
+#include <chrono>
+#include <cstring>
+
+namespace Anki{ namespace Util {
+
+  // Every record in the ring is a length header followed by the line bytes.
+  typedef uint32_t LuaLogRecordHeader;
+
+  LuaLogSink::LuaLogSink(size_t capacity, unsigned int flushIntervalMS)
+  : ring_(capacity)
+  , head_(0)
+  , tail_(0)
+  , lineCount_(0)
+  , droppedCount_(0)
+  , reportedDroppedCount_(0)
+  , flushIntervalMS_(flushIntervalMS)
+  , stopping_(false)
+  {
+    formatBuffer_.reserve(256);
+    flushThread_ = std::thread(&LuaLogSink::FlushThreadMain, this);
+  }
+
+  LuaLogSink::~LuaLogSink()
+  {
+    {
+      std::lock_guard<std::mutex> lock(wakeMutex_);
+      stopping_ = true;
+    }
+    wakeCondition_.notify_one();
+    flushThread_.join();
+    Flush();
+  }
+
+#pragma mark - Producer
+  void LuaLogSink::CopyIn(size_t position, const void* bytes, size_t length)
+  {
+    const size_t offset = position % ring_.size();
+    const size_t firstPart = std::min(length, ring_.size() - offset);
+    std::memcpy(&ring_[offset], bytes, firstPart);
+    std::memcpy(&ring_[0], static_cast<const char*>(bytes) + firstPart, length - firstPart);
+  }
+
+  bool LuaLogSink::Append(const char* line, size_t length)
+  {
+    const size_t recordSize = sizeof(LuaLogRecordHeader) + length;
+    const size_t head = head_.load(std::memory_order_relaxed);
+    const size_t tail = tail_.load(std::memory_order_acquire);
+    if(recordSize > ring_.size() - (head - tail)) {
+      droppedCount_.fetch_add(1, std::memory_order_relaxed);
+      return false;
+    }
+    const LuaLogRecordHeader header = (LuaLogRecordHeader)length;
+    CopyIn(head, &header, sizeof header);
+    CopyIn(head + sizeof header, line, length);
+    // Publish the record to the consumer.
+    head_.store(head + recordSize, std::memory_order_release);
+    lineCount_.fetch_add(1, std::memory_order_relaxed);
+    return true;
+  }
+
+#pragma mark - Consumer
+  void LuaLogSink::CopyOut(size_t position, void* bytes, size_t length) const
+  {
+    const size_t offset = position % ring_.size();
+    const size_t firstPart = std::min(length, ring_.size() - offset);
+    std::memcpy(bytes, &ring_[offset], firstPart);
+    std::memcpy(static_cast<char*>(bytes) + firstPart, &ring_[0], length - firstPart);
+  }
+
+  void LuaLogSink::Flush()
+  {
+    std::lock_guard<std::mutex> lock(consumerMutex_);
+    size_t tail = tail_.load(std::memory_order_relaxed);
+    const size_t head = head_.load(std::memory_order_acquire);
+    while(tail != head) {
+      LuaLogRecordHeader length = 0;
+      CopyOut(tail, &length, sizeof length);
+      lineBuffer_.resize(length);
+      CopyOut(tail + sizeof length, &lineBuffer_[0], length);
+      tail += sizeof length + length;
+      // Hand the space back before logging, the producer may be waiting for room.
+      tail_.store(tail, std::memory_order_release);
+      PRINT_NAMED_INFO("LuaScript.print", "%s", lineBuffer_.c_str());
+    }
+
+    const uint64_t droppedCount = droppedCount_.load(std::memory_order_relaxed);
+    if(droppedCount != reportedDroppedCount_) {
+      PRINT_NAMED_WARNING("LuaScript.print.dropped", "%llu lines dropped (log buffer full)",
+                          (unsigned long long)(droppedCount - reportedDroppedCount_));
+      reportedDroppedCount_ = droppedCount;
+    }
+  }
+
+  void LuaLogSink::FlushThreadMain()
+  {
+    std::unique_lock<std::mutex> lock(wakeMutex_);
+    while(!stopping_) {
+      wakeCondition_.wait_for(lock, std::chrono::milliseconds(flushIntervalMS_));
+      lock.unlock();
+      Flush();
+      lock.lock();
+    }
+  }
+
+#pragma mark - Lua print replacement
+  void LuaLogSink::InstallPrint(lua_State* state)
+  {
+    lua_pushlightuserdata(state, this);
+    lua_pushcclosure(state, &LuaLogSink::LuaPrint, 1);
+    lua_setglobal(state, "print");
+  }
+
+  // Same output as luaB_print, but common types are formatted here instead of calling tostring,
+  //  and the line goes to the sink instead of stdout.
+  int LuaLogSink::LuaPrint(lua_State* state)
+  {
+    LuaLogSink* sink = static_cast<LuaLogSink*>(lua_touserdata(state, lua_upvalueindex(1)));
+    std::string& line = sink->formatBuffer_;
+    line.clear();
+    const int numArgs = lua_gettop(state);
+    for(int i = 1; i <= numArgs; i++) {
+      if(i > 1) {
+        line += '\t';
+      }
+      switch(lua_type(state, i)) {
+        case LUA_TNIL:
+          line += "nil";
+          break;
+        case LUA_TBOOLEAN:
+          line += (lua_toboolean(state, i) ? "true" : "false");
+          break;
+        case LUA_TNUMBER:
+        {
+          char numBuf[LUAI_MAXNUMBER2STR];
+          const int length = lua_number2str(numBuf, lua_tonumber(state, i));
+          line.append(numBuf, (size_t)length);
+          break;
+        }
+        case LUA_TSTRING:
+        {
+          size_t length = 0;
+          const char* str = lua_tolstring(state, i, &length);
+          line.append(str, length);
+          break;
+        }
+        default:
+        {
+          // Tables and friends may have a __tostring, let lauxlib deal with them.
+          size_t length = 0;
+          const char* str = luaL_tolstring(state, i, &length);
+          line.append(str, length);
+          lua_pop(state, 1);
+          break;
+        }
+      }
+    }
+    sink->Append(line.data(), line.size());
+    return 0;
+  }
+
+} }
@@ -0,0 +1,90 @@
+/************************************************************************
+*  LuaLogSink.h
+*  BaseStation
+*
+*  Created by Mark Pauley on 7/25/14.
+*  Copyright (c) 2014 Anki. All rights reserved.
+*
+*  Description:
+*  - Collects script output (print) without blocking the game thread.
+*  - Lines are appended to a fixed-size lock-free ring buffer, a background
+*    thread drains it into the engine log (PRINT_NAMED_INFO).
+*  - Single producer: only the thread running the owning LuaContext may Append.
+*  - If the buffer is full the line is dropped and counted, the flush thread
+*    reports drops in the log so they are never silent.
+*
+************************************************************************/
+
+#ifndef UTIL_LUA_LUALOGSINK_H_
+#define UTIL_LUA_LUALOGSINK_H_
+
+#include "util/helpers/noncopyable.h"
+#include <atomic>
+#include <condition_variable>
+#include <cstdint>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+struct lua_State;
+
+namespace Anki{ namespace Util {
+
+  class LuaLogSink : public Anki::Util::noncopyable {
+
+  public:
+    static const size_t kDefaultCapacity = 64 * 1024;
+    static const unsigned int kDefaultFlushIntervalMS = 20;
+
+    explicit LuaLogSink(size_t capacity = kDefaultCapacity,
+                        unsigned int flushIntervalMS = kDefaultFlushIntervalMS);
+    // Stops the flush thread after draining whatever is left.
+    ~LuaLogSink();
+
+    // Copies the line into the ring buffer.  Returns false (and counts a drop) if it doesn't fit.
+    bool Append(const char* line, size_t length);
+
+    // Synchronously drain the buffer into the log (from any thread).
+    void Flush();
+
+    uint64_t GetLineCount() const { return lineCount_.load(std::memory_order_relaxed); }
+    uint64_t GetDroppedCount() const { return droppedCount_.load(std::memory_order_relaxed); }
+
+    // Replaces the global 'print' in the given state with one that appends to this sink.
+    //  Formats nil, booleans, numbers and strings without calling back into Lua.
+    void InstallPrint(lua_State* state);
+
+  private:
+    static int LuaPrint(lua_State* state);
+
+    void FlushThreadMain();
+    void CopyIn(size_t position, const void* bytes, size_t length);
+    void CopyOut(size_t position, void* bytes, size_t length) const;
+
+    std::vector<char> ring_;
+    // Monotonic byte counters, positions in ring_ are modulo its size.
+    //  head_ is only written by the producer, tail_ only by the consumer.
+    std::atomic<size_t> head_;
+    std::atomic<size_t> tail_;
+    std::atomic<uint64_t> lineCount_;
+    std::atomic<uint64_t> droppedCount_;
+
+    // Producer-side scratch space for formatting print arguments.
+    std::string formatBuffer_;
+
+    // Consumer side (the flush thread, or whoever calls Flush).
+    std::mutex consumerMutex_;
+    std::string lineBuffer_;
+    uint64_t reportedDroppedCount_;
+
+    unsigned int flushIntervalMS_;
+    std::mutex wakeMutex_;
+    std::condition_variable wakeCondition_;
+    bool stopping_;
+    std::thread flushThread_;
+  };
+
+} }
+
+#endif
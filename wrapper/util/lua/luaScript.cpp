@@ -7,6 +7,7 @@
 //
 
 #include "util/lua/luaScript.h"
+#include "util/lua/luaTrace.h"
 #include "util/logging/logging.h"
 #include <lua/lua.hpp>
 #include <cassert>
@@ -30,6 +31,7 @@ namespace Anki{ namespace Util {
   
   
   void LuaScript::Resume() {
+    LUA_TRACE_SCOPE("LuaScript::Resume", "lua");
     lua_Debug debugInfo;
     int result;
     assert(luaThread_);
@@ -7,7 +7,7 @@
 *
 *  Description:
 *  - A wrapper for a Lua Coroutine. Essentially represents a stack and a context.
-*  - Must be created via a Lua Context. (LuaContext::CreateLuaScriptWith*)
+*  - Must be created via a Lua Context (LuaContext::CreateLuaScriptWith*) or a LuaScriptTemplate.
 *  - Wraps a Lua-thread (lua_State) and points at the parent context. 
 *  - Can share state with sibling contexts through the parent context.
 *    other sibling contexts.
@@ -29,10 +29,12 @@ struct lua_State;
 namespace Anki{ namespace Util {
   class LuaContext;
   class LuaDebugger;
+  class LuaScriptTemplate;
   class LuaScript : public Anki::Util::noncopyable {
     friend class LuaContext;
+    friend class LuaScriptTemplate;
   protected:
-    // Constructor may only be called by a LuaContext object (the parent)
+    // Constructor may only be called by a LuaContext object (the parent) or one of its templates
     //   luaThread is assumed to have been created from parentContext
     LuaScript(lua_State* parentContext, lua_State* luaThread);
     
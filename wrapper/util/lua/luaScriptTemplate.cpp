@@ -0,0 +1,67 @@
+//
+//  LuaScriptTemplate.cpp
+//  BaseStation
+//
+//  Created by Mark Pauley on 8/4/14.
+//  Copyright (c) 2014 Anki. All rights reserved.
+//
+
+#include "util/lua/luaScriptTemplate.h"
+#include "util/lua/luaScript.h"
+#include <lua/lua.hpp>
+#include <cassert>
+#include <cstring>
+
+namespace Anki{ namespace Util {
+
+  LuaScriptTemplate::LuaScriptTemplate(lua_State* parentContext)
+  : parentContext_(parentContext)
+  , envUpvalue_(0)
+  {
+    assert(lua_isfunction(parentContext_, -1));
+    // Globals are reached through the _ENV upvalue (if the function uses any).
+    if(!lua_iscfunction(parentContext_, -1)) {
+      const char* upvalueName = NULL;
+      for(int n = 1; (upvalueName = lua_getupvalue(parentContext_, -1, n)) != NULL; n++) {
+        lua_pop(parentContext_, 1);
+        if(strcmp(upvalueName, "_ENV") == 0) {
+          envUpvalue_ = n;
+          break;
+        }
+      }
+    }
+    entryPointRef_ = luaL_ref(parentContext_, LUA_REGISTRYINDEX);
+
+    lua_createtable(parentContext_, 0, 1);
+    lua_pushglobaltable(parentContext_);
+    lua_setfield(parentContext_, -2, "__index");
+    envMetatableRef_ = luaL_ref(parentContext_, LUA_REGISTRYINDEX);
+  }
+
+  LuaScriptTemplate::~LuaScriptTemplate() {
+    luaL_unref(parentContext_, LUA_REGISTRYINDEX, envMetatableRef_);
+    luaL_unref(parentContext_, LUA_REGISTRYINDEX, entryPointRef_);
+  }
+
+  LuaScript* LuaScriptTemplate::CreateScript(bool ownEnvironment)
+  {
+    lua_State* luaThreadState = lua_newthread(parentContext_);
+    lua_rawgeti(parentContext_, LUA_REGISTRYINDEX, entryPointRef_);
+    if(ownEnvironment && envUpvalue_ != 0) {
+      lua_newtable(parentContext_);
+      lua_rawgeti(parentContext_, LUA_REGISTRYINDEX, envMetatableRef_);
+      lua_setmetatable(parentContext_, -2);
+      // Same function, with the new table as its _ENV.
+      lua_copyfunction(parentContext_, -2, envUpvalue_);
+      lua_remove(parentContext_, -2);
+    }
+    lua_xmove(parentContext_, luaThreadState, 1);
+
+    // The script holds on to the thread from here.
+    LuaScript* newScript = new LuaScript(parentContext_, luaThreadState);
+    lua_pop(parentContext_, 1);
+    return newScript;
+  }
+
+}
+} // namespace
@@ -0,0 +1,60 @@
+/***************************************************************************************************
+*  LuaScriptTemplate
+*  BaseStation
+*
+*  Created by Mark Pauley on 8/4/14.
+*  Copyright (c) 2014 Anki. All rights reserved.
+*
+*  Description:
+*  - The entry point of a script file, loaded and run once.
+*  - Must be created via a Lua Context. (LuaContext::CreateLuaScriptTemplateWithFile)
+*  - Spawns any number of LuaScripts with CreateScript, each one only costs a new thread
+*    (the file is not loaded or run again).
+*  - A spawned script can get its own global environment, so that instances don't
+*    see each other's globals.
+*  - Scripts spawned from a template are independent of it, the template can be
+*    destroyed while they run.
+*
+*
+***************************************************************************************************/
+
+#ifndef UTIL_LUA_LUASCRIPTTEMPLATE_H_
+#define UTIL_LUA_LUASCRIPTTEMPLATE_H_
+
+#include "util/helpers/noncopyable.h"
+
+struct lua_State;
+
+namespace Anki{ namespace Util {
+  class LuaContext;
+  class LuaScript;
+  class LuaScriptTemplate : public Anki::Util::noncopyable {
+    friend class LuaContext;
+  protected:
+    // Constructor may only be called by a LuaContext object (the parent)
+    //   Takes the entry point function off the top of parentContext's stack.
+    LuaScriptTemplate(lua_State* parentContext);
+
+  public:
+    ~LuaScriptTemplate();
+
+    // Returns a new script that runs the entry point from the start.
+    //  With ownEnvironment, globals set by the entry point go to a table private to the new
+    //  script, and globals it doesn't set are read from the context's globals.
+    //  This covers the entry point's own code and the functions it creates, other functions
+    //  of the file it calls keep using the context's globals.
+    LuaScript* CreateScript(bool ownEnvironment = false);
+
+  private:
+    lua_State* parentContext_;
+    int entryPointRef_;
+    // Index of the entry point's _ENV upvalue, 0 if it doesn't use globals.
+    int envUpvalue_;
+    // Metatable of the per-script environments (falls back to the globals).
+    int envMetatableRef_;
+  };
+
+}
+} // namespace
+
+#endif
@@ -0,0 +1,39 @@
+//
+//  LuaStructFields.h
+//  BaseStation
+//
+//  Created by Mark Pauley on 7/23/14.
+//  Copyright (c) 2014 Anki. All rights reserved.
+//
+//  Description:
+//  Declares the Lua-visible fields of a plain C++ struct, once.
+//  LuaStructMarshal.h uses the declaration to convert directly between
+//  the struct and a Lua table (no ptree, no string parsing).
+//  This header does not depend on Lua, so it is safe to include from game headers.
+//
+//  Example:
+//    struct VehicleConfig {
+//      std::string type;
+//      double speed = 0.0;
+//      LUA_STRUCT_FIELDS(
+//        LUA_STRUCT_FIELD(type, "type")
+//        LUA_STRUCT_FIELD(speed, "speed")
+//      )
+//    };
+//
+//  Supported field types are bool, arithmetic types, std::string
+//  and other structs that declare LUA_STRUCT_FIELDS.
+//  Fields are visited in declaration order; keep the key strings literal (or otherwise static).
+//
+
+#ifndef UTIL_LUA_LUASTRUCTFIELDS_H_
+#define UTIL_LUA_LUASTRUCTFIELDS_H_
+
+// Generates VisitLuaFields(visitor), which calls visitor(key, member) for each declared field.
+#define LUA_STRUCT_FIELDS(...) \
+  template <typename LuaFieldVisitor> void VisitLuaFields(LuaFieldVisitor& luaFieldVisitor) { __VA_ARGS__ } \
+  template <typename LuaFieldVisitor> void VisitLuaFields(LuaFieldVisitor& luaFieldVisitor) const { __VA_ARGS__ }
+
+#define LUA_STRUCT_FIELD(member, key) luaFieldVisitor((key), (member));
+
+#endif
@@ -0,0 +1,89 @@
+//
+//  LuaStructMarshal.cpp
+//  BaseStation
+//
+//  Created by Mark Pauley on 7/23/14.
+//  Copyright (c) 2014 Anki. All rights reserved.
+//
+
+#include "util/lua/luaStructMarshal.h"
+#include "util/logging/logging.h"
+
+namespace Anki{ namespace Util {
+
+#pragma mark Leaf values
+bool Lua_ReadField(lua_State* state, int index, bool& outValue)
+{
+  switch(lua_type(state, index)) {
+    case LUA_TNIL:
+      return true;
+    case LUA_TBOOLEAN:
+      outValue = (lua_toboolean(state, index) != 0);
+      return true;
+    default:
+      LuaStructMarshalInternal::ReportTypeMismatch(state, index, "boolean");
+      return false;
+  }
+}
+
+bool Lua_ReadField(lua_State* state, int index, std::string& outValue)
+{
+  switch(lua_type(state, index)) {
+    case LUA_TNIL:
+      return true;
+    case LUA_TNUMBER:
+    case LUA_TSTRING:
+    {
+      // Numbers are taken as their string form, as Lua_ToPTree does.  Convert a copy,
+      //  lua_tolstring would change a number in place (and confuse a lua_next on its key).
+      lua_pushvalue(state, index);
+      size_t length = 0;
+      const char* value = lua_tolstring(state, -1, &length);
+      outValue.assign(value, length);
+      lua_pop(state, 1);
+      return true;
+    }
+    default:
+      LuaStructMarshalInternal::ReportTypeMismatch(state, index, "string");
+      return false;
+  }
+}
+
+bool Lua_ReadField(lua_State* state, int index, double& outValue)
+{
+  switch(lua_type(state, index)) {
+    case LUA_TNIL:
+      return true;
+    case LUA_TNUMBER:
+      outValue = lua_tonumber(state, index);
+      return true;
+    default:
+      LuaStructMarshalInternal::ReportTypeMismatch(state, index, "number");
+      return false;
+  }
+}
+
+void Lua_PushField(lua_State* state, bool value)
+{
+  lua_pushboolean(state, value);
+}
+
+void Lua_PushField(lua_State* state, const std::string& value)
+{
+  lua_pushlstring(state, value.data(), value.size());
+}
+
+void Lua_PushField(lua_State* state, double value)
+{
+  lua_pushnumber(state, value);
+}
+
+namespace LuaStructMarshalInternal {
+  void ReportTypeMismatch(lua_State* state, int index, const char* expected)
+  {
+    PRINT_NAMED_WARNING("Lua_ToStruct", "Expected %s, got %s", expected, luaL_typename(state, index));
+  }
+}
+
+}
+} // namespace
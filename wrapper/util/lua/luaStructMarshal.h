@@ -0,0 +1,200 @@
+//
+//  LuaStructMarshal.h
+//  BaseStation
+//
+//  Created by Mark Pauley on 7/23/14.
+//  Copyright (c) 2014 Anki. All rights reserved.
+//
+//  Description:
+//  Typed conversion between Lua tables and structs that declare LUA_STRUCT_FIELDS.
+//  The field keys of each struct type are pinned once per lua_State (see lua_pinkey),
+//  so a conversion never hashes key strings.
+//
+
+#ifndef UTIL_LUA_LUASTRUCTMARSHAL_H_
+#define UTIL_LUA_LUASTRUCTMARSHAL_H_
+
+#include "util/lua/luaStructFields.h"
+#include <lua/lua.hpp>
+#include <string>
+#include <type_traits>
+#include <typeinfo>
+#include <vector>
+
+namespace Anki{ namespace Util
+{
+
+#pragma mark Leaf values
+// Read the value at index into outValue.  Nil leaves outValue alone and succeeds.
+//  Returns false (leaving outValue alone) if the value has the wrong type.
+//  A string field also takes a number, in its string form.
+bool Lua_ReadField(lua_State* state, int index, bool& outValue);
+bool Lua_ReadField(lua_State* state, int index, std::string& outValue);
+bool Lua_ReadField(lua_State* state, int index, double& outValue);
+
+void Lua_PushField(lua_State* state, bool value);
+void Lua_PushField(lua_State* state, const std::string& value);
+void Lua_PushField(lua_State* state, double value);
+
+// Any other arithmetic type goes through lua_Number.
+template <typename T>
+typename std::enable_if<std::is_arithmetic<T>::value, bool>::type
+Lua_ReadField(lua_State* state, int index, T& outValue)
+{
+  double number = 0.0;
+  if(lua_isnil(state, index)) {
+    return true;
+  }
+  if(!Lua_ReadField(state, index, number)) {
+    return false;
+  }
+  outValue = static_cast<T>(number);
+  return true;
+}
+
+template <typename T>
+typename std::enable_if<std::is_arithmetic<T>::value>::type
+Lua_PushField(lua_State* state, T value)
+{
+  Lua_PushField(state, static_cast<double>(value));
+}
+
+#pragma mark Struct values
+template <typename S> bool Lua_ToStruct(lua_State* state, int index, S& outStruct);
+template <typename S> void Lua_PushStructAsTable(lua_State* state, const S& value);
+
+// Nested structs.
+template <typename S>
+auto Lua_ReadField(lua_State* state, int index, S& outValue)
+  -> decltype(outValue.VisitLuaFields(*(int*)nullptr), bool())
+{
+  if(lua_isnil(state, index)) {
+    return true;
+  }
+  return Lua_ToStruct(state, index, outValue);
+}
+
+template <typename S>
+auto Lua_PushField(lua_State* state, const S& value)
+  -> decltype(value.VisitLuaFields(*(int*)nullptr), void())
+{
+  Lua_PushStructAsTable(state, value);
+}
+
+namespace LuaStructMarshalInternal {
+
+  // Unique per struct type, its address is the registry key of the pinned field keys.
+  template <typename S>
+  struct FieldKeysTag {
+    static const char tag;
+  };
+  template <typename S> const char FieldKeysTag<S>::tag = 0;
+
+  // Gathers the field keys in declaration order.
+  class KeyCollector {
+  public:
+    template <typename T> void operator()(const char* key, const T&)
+    {
+      keys_.push_back(key);
+    }
+    const std::vector<const char*>& GetKeys() const { return keys_; }
+  private:
+    std::vector<const char*> keys_;
+  };
+
+  // Returns the pinned field keys for S (in declaration order), pinning them on first use in this lua_State.
+  //  The array lives in a userdata anchored in the registry, so it stays put for the life of the state.
+  template <typename S>
+  const lua_Key* GetFieldKeys(lua_State* state)
+  {
+    const void* tag = &FieldKeysTag<S>::tag;
+    lua_rawgetp(state, LUA_REGISTRYINDEX, tag);
+    const lua_Key* keys = static_cast<const lua_Key*>(lua_touserdata(state, -1));
+    lua_pop(state, 1);
+    if(keys != nullptr) {
+      return keys;
+    }
+    KeyCollector collector;
+    const S prototype = S();
+    prototype.VisitLuaFields(collector);
+    const std::vector<const char*>& keyStrings = collector.GetKeys();
+    lua_Key* newKeys = static_cast<lua_Key*>(lua_newuserdata(state, sizeof(lua_Key) * (keyStrings.size() + 1)));
+    for(size_t i = 0; i < keyStrings.size(); ++i) {
+      newKeys[i] = lua_pinkey(state, keyStrings[i]);
+    }
+    lua_rawsetp(state, LUA_REGISTRYINDEX, tag);
+    return newKeys;
+  }
+
+  // Reads each field from the table at tableIndex.
+  class FieldReader {
+  public:
+    FieldReader(lua_State* state, int tableIndex, const lua_Key* keys)
+    : state_(state), tableIndex_(tableIndex), keys_(keys), ok_(true) {}
+    template <typename T> void operator()(const char* key, T& member)
+    {
+      lua_pushkey(state_, *keys_++);
+      lua_rawget(state_, tableIndex_);
+      if(!Lua_ReadField(state_, lua_gettop(state_), member)) {
+        ok_ = false;
+      }
+      lua_pop(state_, 1);
+    }
+    bool IsOK() const { return ok_; }
+  private:
+    lua_State* state_;
+    int tableIndex_;
+    const lua_Key* keys_;
+    bool ok_;
+  };
+
+  // Sets each field into the table on top of the stack.
+  class FieldWriter {
+  public:
+    FieldWriter(lua_State* state, const lua_Key* keys) : state_(state), keys_(keys) {}
+    template <typename T> void operator()(const char* key, const T& member)
+    {
+      lua_pushkey(state_, *keys_++);
+      Lua_PushField(state_, member);
+      lua_rawset(state_, -3);
+    }
+  private:
+    lua_State* state_;
+    const lua_Key* keys_;
+  };
+
+  void ReportTypeMismatch(lua_State* state, int index, const char* expected);
+
+} // namespace LuaStructMarshalInternal
+
+// Fills outStruct from the table at index.  Missing (nil) fields keep their current values.
+//  Returns false if the value is not a table or any field had the wrong type.
+template <typename S>
+bool Lua_ToStruct(lua_State* state, int index, S& outStruct)
+{
+  using namespace LuaStructMarshalInternal;
+  index = lua_absindex(state, index);
+  if(!lua_istable(state, index)) {
+    ReportTypeMismatch(state, index, typeid(S).name());
+    return false;
+  }
+  FieldReader reader(state, index, GetFieldKeys<S>(state));
+  outStruct.VisitLuaFields(reader);
+  return reader.IsOK();
+}
+
+// Converts the struct to a new lua table, which is pushed to the top of the given lua stack.
+template <typename S>
+void Lua_PushStructAsTable(lua_State* state, const S& value)
+{
+  using namespace LuaStructMarshalInternal;
+  const lua_Key* keys = GetFieldKeys<S>(state);
+  lua_newtable(state);
+  FieldWriter writer(state, keys);
+  value.VisitLuaFields(writer);
+}
+
+}
+} // namespace
+
+#endif
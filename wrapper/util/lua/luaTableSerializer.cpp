@@ -0,0 +1,418 @@
+//
+//  LuaTableSerializer.cpp
+//  BaseStation
+//
+//  Created by Mark Pauley on 7/21/14.
+//  Copyright (c) 2014 Anki. All rights reserved.
+//
+
+#include "util/lua/luaTableSerializer.h"
+#include "util/logging/logging.h"
+
+#include <lua/lua.hpp>
+#include <cmath>
+#include <cstdio>
+#include <cstring>
+#include <ostream>
+
+namespace {
+// Stream mode hands the buffer to the ostream once it grows past this.
+static const size_t kJsonStreamChunkSize = 4096;
+
+// Doubles with integral values up to this magnitude are stored as varints.
+static const double kMaxBinaryInteger = 9007199254740992.0; // 2^53
+
+// Guards against hostile or corrupt input when decoding.
+static const size_t kMaxBinaryDepth = 200;
+
+static bool Lua_PushBinaryValue(lua_State* state, const uint8_t*& cursor, const uint8_t* end, size_t depth);
+} // anonymous namespace, file-local
+
+namespace Anki{ namespace Util {
+
+#pragma mark - JSON Writer
+LuaJsonWriter::LuaJsonWriter(std::string& outBuffer)
+: buffer_(outBuffer)
+, stream_(nullptr)
+, afterKey_(false)
+{
+}
+
+LuaJsonWriter::LuaJsonWriter(std::ostream& outStream)
+: buffer_(ownBuffer_)
+, stream_(&outStream)
+, afterKey_(false)
+{
+  ownBuffer_.reserve(kJsonStreamChunkSize * 2);
+}
+
+LuaJsonWriter::~LuaJsonWriter()
+{
+  Flush();
+}
+
+void LuaJsonWriter::Flush()
+{
+  if(stream_ != nullptr && !buffer_.empty()) {
+    stream_->write(buffer_.data(), (std::streamsize)buffer_.size());
+    buffer_.clear();
+  }
+}
+
+void LuaJsonWriter::FlushIfFull()
+{
+  if(stream_ != nullptr && buffer_.size() >= kJsonStreamChunkSize) {
+    Flush();
+  }
+}
+
+// Emits the separator needed before a value (or key) in the current container.
+void LuaJsonWriter::BeginValue()
+{
+  if(afterKey_) {
+    afterKey_ = false;
+    return;
+  }
+  if(!firstElement_.empty()) {
+    if(firstElement_.back()) {
+      firstElement_.back() = false;
+    }
+    else {
+      buffer_ += ',';
+    }
+  }
+}
+
+void LuaJsonWriter::WriteEscaped(const char* value, size_t length)
+{
+  static const char* hexDigits = "0123456789abcdef";
+  buffer_ += '"';
+  const char* runStart = value;
+  const char* end = value + length;
+  for(const char* cur = value; cur != end; ++cur) {
+    const unsigned char c = (unsigned char)*cur;
+    if(c >= 0x20 && c != '"' && c != '\\') {
+      continue;
+    }
+    // Copy the run of plain characters in one go.
+    buffer_.append(runStart, cur - runStart);
+    runStart = cur + 1;
+    switch(c) {
+      case '"':  buffer_ += "\\\""; break;
+      case '\\': buffer_ += "\\\\"; break;
+      case '\n': buffer_ += "\\n"; break;
+      case '\r': buffer_ += "\\r"; break;
+      case '\t': buffer_ += "\\t"; break;
+      case '\b': buffer_ += "\\b"; break;
+      case '\f': buffer_ += "\\f"; break;
+      default:
+        buffer_ += "\\u00";
+        buffer_ += hexDigits[c >> 4];
+        buffer_ += hexDigits[c & 0xf];
+        break;
+    }
+  }
+  buffer_.append(runStart, end - runStart);
+  buffer_ += '"';
+}
+
+void LuaJsonWriter::VisitNil()
+{
+  BeginValue();
+  buffer_ += "null";
+  FlushIfFull();
+}
+
+void LuaJsonWriter::VisitBoolean(bool value)
+{
+  BeginValue();
+  buffer_ += (value ? "true" : "false");
+  FlushIfFull();
+}
+
+void LuaJsonWriter::VisitNumber(double value)
+{
+  BeginValue();
+  if(std::isfinite(value)) {
+    // Same formatting as lua's own tostring().
+    char numBuf[LUAI_MAXNUMBER2STR];
+    const int length = lua_number2str(numBuf, (lua_Number)value);
+    buffer_.append(numBuf, (size_t)length);
+  }
+  else {
+    buffer_ += "null";
+  }
+  FlushIfFull();
+}
+
+void LuaJsonWriter::VisitString(const char* value, size_t length)
+{
+  BeginValue();
+  WriteEscaped(value, length);
+  FlushIfFull();
+}
+
+void LuaJsonWriter::BeginArray(size_t length)
+{
+  BeginValue();
+  buffer_ += '[';
+  firstElement_.push_back(true);
+}
+
+void LuaJsonWriter::EndArray()
+{
+  firstElement_.pop_back();
+  buffer_ += ']';
+  FlushIfFull();
+}
+
+void LuaJsonWriter::BeginObject(size_t numEntries)
+{
+  BeginValue();
+  buffer_ += '{';
+  firstElement_.push_back(true);
+}
+
+void LuaJsonWriter::VisitKey(const char* key, size_t length)
+{
+  BeginValue();
+  WriteEscaped(key, length);
+  buffer_ += ':';
+  afterKey_ = true;
+}
+
+void LuaJsonWriter::EndObject()
+{
+  firstElement_.pop_back();
+  buffer_ += '}';
+  FlushIfFull();
+}
+
+#pragma mark - Binary Writer
+LuaBinaryWriter::LuaBinaryWriter(std::vector<uint8_t>& outBuffer)
+: buffer_(outBuffer)
+{
+}
+
+void LuaBinaryWriter::WriteTag(LuaBinaryTag tag)
+{
+  buffer_.push_back((uint8_t)tag);
+}
+
+void LuaBinaryWriter::WriteVarint(uint64_t value)
+{
+  while(value >= 0x80) {
+    buffer_.push_back((uint8_t)(value | 0x80));
+    value >>= 7;
+  }
+  buffer_.push_back((uint8_t)value);
+}
+
+void LuaBinaryWriter::WriteBytes(const char* bytes, size_t length)
+{
+  WriteVarint(length);
+  buffer_.insert(buffer_.end(), (const uint8_t*)bytes, (const uint8_t*)bytes + length);
+}
+
+void LuaBinaryWriter::VisitNil()
+{
+  WriteTag(LuaBinaryTag::Nil);
+}
+
+void LuaBinaryWriter::VisitBoolean(bool value)
+{
+  WriteTag(value ? LuaBinaryTag::True : LuaBinaryTag::False);
+}
+
+void LuaBinaryWriter::VisitNumber(double value)
+{
+  if(value == std::floor(value) && std::fabs(value) <= kMaxBinaryInteger) {
+    // zig-zag so that small negative numbers stay small.
+    const int64_t intValue = (int64_t)value;
+    WriteTag(LuaBinaryTag::Integer);
+    WriteVarint(((uint64_t)intValue << 1) ^ (uint64_t)(intValue >> 63));
+    return;
+  }
+  uint64_t bits;
+  static_assert(sizeof bits == sizeof value, "double must be 64 bits");
+  std::memcpy(&bits, &value, sizeof bits);
+  WriteTag(LuaBinaryTag::Double);
+  for(int i = 0; i < 8; ++i) {
+    buffer_.push_back((uint8_t)(bits >> (8 * i)));
+  }
+}
+
+void LuaBinaryWriter::VisitString(const char* value, size_t length)
+{
+  WriteTag(LuaBinaryTag::String);
+  WriteBytes(value, length);
+}
+
+void LuaBinaryWriter::BeginArray(size_t length)
+{
+  WriteTag(LuaBinaryTag::Array);
+  WriteVarint(length);
+}
+
+void LuaBinaryWriter::EndArray()
+{
+}
+
+void LuaBinaryWriter::BeginObject(size_t numEntries)
+{
+  WriteTag(LuaBinaryTag::Object);
+  WriteVarint(numEntries);
+}
+
+void LuaBinaryWriter::VisitKey(const char* key, size_t length)
+{
+  WriteBytes(key, length);
+}
+
+void LuaBinaryWriter::EndObject()
+{
+}
+
+#pragma mark - Public Entry Points
+bool Lua_ToJSON(lua_State* state, std::string& outBuffer)
+{
+  LuaJsonWriter writer(outBuffer);
+  return Lua_VisitValue(state, writer);
+}
+
+bool Lua_ToJSON(lua_State* state, std::ostream& outStream)
+{
+  LuaJsonWriter writer(outStream);
+  return Lua_VisitValue(state, writer);
+}
+
+bool Lua_ToBinary(lua_State* state, std::vector<uint8_t>& outBuffer)
+{
+  LuaBinaryWriter writer(outBuffer);
+  return Lua_VisitValue(state, writer);
+}
+
+bool Lua_PushBinaryAsValue(lua_State* state, const uint8_t* data, size_t length)
+{
+  const int top = lua_gettop(state);
+  const uint8_t* cursor = data;
+  if(!Lua_PushBinaryValue(state, cursor, data + length, 0) || cursor != data + length) {
+    PRINT_NAMED_ERROR("Lua_PushBinaryAsValue", "Malformed data at offset %zu of %zu", (size_t)(cursor - data), length);
+    lua_settop(state, top);
+    return false;
+  }
+  return true;
+}
+
+}
+} // namespace
+
+// Anonymous namespace for the helper functions
+namespace {
+
+#pragma mark - Binary Reader Helpers
+static bool Lua_ReadVarint(const uint8_t*& cursor, const uint8_t* end, uint64_t& outValue)
+{
+  uint64_t value = 0;
+  for(unsigned int shift = 0; shift < 64; shift += 7) {
+    if(cursor == end) {
+      return false;
+    }
+    const uint8_t byte = *cursor++;
+    value |= (uint64_t)(byte & 0x7f) << shift;
+    if((byte & 0x80) == 0) {
+      outValue = value;
+      return true;
+    }
+  }
+  return false;
+}
+
+// Pushes a length-prefixed byte string as a lua string.
+static bool Lua_PushBinaryBytes(lua_State* state, const uint8_t*& cursor, const uint8_t* end)
+{
+  uint64_t length = 0;
+  if(!Lua_ReadVarint(cursor, end, length) || length > (uint64_t)(end - cursor)) {
+    return false;
+  }
+  lua_pushlstring(state, (const char*)cursor, (size_t)length);
+  cursor += length;
+  return true;
+}
+
+static bool Lua_PushBinaryValue(lua_State* state, const uint8_t*& cursor, const uint8_t* end, size_t depth)
+{
+  using Anki::Util::LuaBinaryTag;
+  if(cursor == end || depth > kMaxBinaryDepth || !lua_checkstack(state, 3)) {
+    return false;
+  }
+  const LuaBinaryTag tag = (LuaBinaryTag)*cursor++;
+  uint64_t value = 0;
+  switch(tag) {
+    case LuaBinaryTag::Nil:
+      lua_pushnil(state);
+      return true;
+    case LuaBinaryTag::False:
+      lua_pushboolean(state, 0);
+      return true;
+    case LuaBinaryTag::True:
+      lua_pushboolean(state, 1);
+      return true;
+    case LuaBinaryTag::Integer:
+      if(!Lua_ReadVarint(cursor, end, value)) {
+        return false;
+      }
+      lua_pushnumber(state, (lua_Number)((int64_t)(value >> 1) ^ -(int64_t)(value & 1)));
+      return true;
+    case LuaBinaryTag::Double:
+    {
+      if(end - cursor < 8) {
+        return false;
+      }
+      for(int i = 0; i < 8; ++i) {
+        value |= (uint64_t)cursor[i] << (8 * i);
+      }
+      cursor += 8;
+      double number;
+      std::memcpy(&number, &value, sizeof number);
+      lua_pushnumber(state, (lua_Number)number);
+      return true;
+    }
+    case LuaBinaryTag::String:
+      return Lua_PushBinaryBytes(state, cursor, end);
+    case LuaBinaryTag::Array:
+    {
+      // Every element takes at least one byte, which bounds the count for corrupt data.
+      if(!Lua_ReadVarint(cursor, end, value) || value > (uint64_t)(end - cursor)) {
+        return false;
+      }
+      lua_createtable(state, (int)value, 0);
+      for(uint64_t i = 1; i <= value; ++i) {
+        if(!Lua_PushBinaryValue(state, cursor, end, depth + 1)) {
+          return false;
+        }
+        lua_rawseti(state, -2, (int)i);
+      }
+      return true;
+    }
+    case LuaBinaryTag::Object:
+    {
+      if(!Lua_ReadVarint(cursor, end, value) || value > (uint64_t)(end - cursor)) {
+        return false;
+      }
+      lua_createtable(state, 0, (int)value);
+      for(uint64_t i = 0; i < value; ++i) {
+        if(!Lua_PushBinaryBytes(state, cursor, end)
+           || !Lua_PushBinaryValue(state, cursor, end, depth + 1)) {
+          return false;
+        }
+        lua_rawset(state, -3);
+      }
+      return true;
+    }
+    default:
+      return false;
+  }
+}
+
+} // anonymous namespace
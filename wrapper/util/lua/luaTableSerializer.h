@@ -0,0 +1,119 @@
+//
+//  LuaTableSerializer.h
+//  BaseStation
+//
+//  Created by Mark Pauley on 7/21/14.
+//  Copyright (c) 2014 Anki. All rights reserved.
+//
+//  Description:
+//  Streaming serializers for Lua values, built on ILuaTableVisitor.
+//  These write straight from the Lua stack into a caller-owned buffer,
+//  so there is no intermediate ptree (use these instead of Lua_ToPTree + json_parser).
+//  - JSON text, appended to a std::string or written to a std::ostream.
+//  - A compact tagged binary encoding, for shipping script state over the MessageQueue.
+//
+
+#ifndef UTIL_LUA_LUATABLESERIALIZER_H_
+#define UTIL_LUA_LUATABLESERIALIZER_H_
+
+#include "util/lua/luaTableVisitor.h"
+#include <cstdint>
+#include <iosfwd>
+#include <string>
+#include <vector>
+
+struct lua_State;
+
+namespace Anki{ namespace Util
+{
+
+// Writes JSON for the visited value.
+//  Nil (and anything without a data representation), NaN and infinities are written as null.
+class LuaJsonWriter : public ILuaTableVisitor {
+public:
+  // Appends to outBuffer. The buffer is never cleared, so callers can reuse its capacity across exports.
+  explicit LuaJsonWriter(std::string& outBuffer);
+  // Writes to outStream in chunks.  Anything pending is written on Flush() or destruction.
+  explicit LuaJsonWriter(std::ostream& outStream);
+  virtual ~LuaJsonWriter();
+
+  void Flush();
+
+  virtual void VisitNil() override;
+  virtual void VisitBoolean(bool value) override;
+  virtual void VisitNumber(double value) override;
+  virtual void VisitString(const char* value, size_t length) override;
+  virtual void BeginArray(size_t length) override;
+  virtual void EndArray() override;
+  virtual void BeginObject(size_t numEntries) override;
+  virtual void VisitKey(const char* key, size_t length) override;
+  virtual void EndObject() override;
+
+private:
+  void BeginValue();
+  void WriteEscaped(const char* value, size_t length);
+  void FlushIfFull();
+
+  std::string ownBuffer_;
+  std::string& buffer_;
+  std::ostream* stream_;
+  // One entry per open array/object: true until the first element has been written.
+  std::vector<bool> firstElement_;
+  bool afterKey_;
+};
+
+// Tags for the binary encoding.  Every value is a tag byte followed by its payload:
+//  Integer: zig-zag varint.  Double: 8 bytes, little endian IEEE-754.
+//  String: varint length, then bytes.  Array: varint count, then values.
+//  Object: varint count, then (varint key length, key bytes, value) for each entry.
+enum class LuaBinaryTag : uint8_t {
+  Nil = 0,
+  False,
+  True,
+  Integer,
+  Double,
+  String,
+  Array,
+  Object,
+  Count
+};
+
+// Writes the compact binary encoding of the visited value.
+class LuaBinaryWriter : public ILuaTableVisitor {
+public:
+  // Appends to outBuffer (never clears it).
+  explicit LuaBinaryWriter(std::vector<uint8_t>& outBuffer);
+
+  virtual void VisitNil() override;
+  virtual void VisitBoolean(bool value) override;
+  virtual void VisitNumber(double value) override;
+  virtual void VisitString(const char* value, size_t length) override;
+  virtual void BeginArray(size_t length) override;
+  virtual void EndArray() override;
+  virtual void BeginObject(size_t numEntries) override;
+  virtual void VisitKey(const char* key, size_t length) override;
+  virtual void EndObject() override;
+
+private:
+  void WriteTag(LuaBinaryTag tag);
+  void WriteVarint(uint64_t value);
+  void WriteBytes(const char* bytes, size_t length);
+
+  std::vector<uint8_t>& buffer_;
+};
+
+// Convert the value on top of the given lua stack.  Do not pop stack.
+//  Return false (leaving partial output behind) if the value contains a cycle.
+bool Lua_ToJSON(lua_State* state, std::string& outBuffer);
+bool Lua_ToJSON(lua_State* state, std::ostream& outStream);
+bool Lua_ToBinary(lua_State* state, std::vector<uint8_t>& outBuffer);
+
+// Decodes a value written by LuaBinaryWriter and pushes it to the top of the given lua stack.
+//  Object keys come back as strings (number keys included).
+//  Returns false (pushing nothing) if the data is malformed or truncated.
+bool Lua_PushBinaryAsValue(lua_State* state, const uint8_t* data, size_t length);
+
+}
+} // namespace
+
+#endif
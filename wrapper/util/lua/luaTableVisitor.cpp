@@ -0,0 +1,205 @@
+//
+//  LuaTableVisitor.cpp
+//  BaseStation
+//
+//  Created by Mark Pauley on 7/21/14.
+//  Copyright (c) 2014 Anki. All rights reserved.
+//
+
+#include "util/lua/luaTableVisitor.h"
+#include "util/logging/logging.h"
+
+#include <lua/lua.hpp>
+#include <algorithm>
+#include <cmath>
+#include <cstdio>
+#include <limits>
+#include <vector>
+
+namespace {
+// Tables currently being walked (from the root down), used to detect cycles.
+typedef std::vector<const void*> LuaTablePath;
+
+// Keeps us from blowing the C stack on absurdly deep (but acyclic) tables.
+static const size_t kMaxTableDepth = 200;
+
+static bool Lua_VisitValueRecursive(lua_State* state,
+                                    Anki::Util::ILuaTableVisitor& visitor,
+                                    LuaTablePath& path);
+} // anonymous namespace, file-local
+
+namespace Anki{ namespace Util {
+
+#pragma mark Public Entry Point
+bool Lua_VisitValue(lua_State* state, ILuaTableVisitor& visitor)
+{
+  if(lua_gettop(state) < 1) {
+    PRINT_NAMED_ERROR("Lua_VisitValue", "Should have at least one argument on the lua stack (was %d)!",
+                      lua_gettop(state));
+    return false;
+  }
+  LuaTablePath path;
+  return Lua_VisitValueRecursive(state, visitor, path);
+}
+
+}
+} // namespace
+
+// Anonymous namespace for the helper functions
+namespace {
+
+#pragma mark - Helper Functions
+
+// True if the key at the top of the stack is a number that could be an array index.
+//  Keys above INT_MAX can't index a sequence (no table holds that many entries) and
+//  are rejected before the cast, which would be undefined for very large doubles.
+static bool Lua_IsArrayIndex(lua_State* state, size_t& outIndex)
+{
+  if(lua_type(state, -1) != LUA_TNUMBER) {
+    return false;
+  }
+  const lua_Number key = lua_tonumber(state, -1);
+  if(key < 1 || key > (lua_Number)std::numeric_limits<int>::max() || key != std::floor(key)) {
+    return false;
+  }
+  outIndex = (size_t)key;
+  return true;
+}
+
+// Counts the visitable entries of the table on top of the stack and decides whether it is a
+//  sequence.  A table is an array iff every key is an integer in 1..numEntries.
+static void Lua_ClassifyTable(lua_State* state, size_t& outNumEntries, bool& outIsArray)
+{
+  size_t numEntries = 0;
+  size_t maxIndex = 0;
+  bool allIndices = true;
+  lua_pushnil(state);
+  while(lua_next(state, -2) != 0) {
+    lua_pop(state, 1); // don't need the value yet, leave the key for lua_next.
+    const int keyType = lua_type(state, -1);
+    if(keyType != LUA_TSTRING && keyType != LUA_TNUMBER) {
+      continue;
+    }
+    ++numEntries;
+    size_t index = 0;
+    if(allIndices && Lua_IsArrayIndex(state, index)) {
+      maxIndex = std::max(maxIndex, index);
+    }
+    else {
+      allIndices = false;
+    }
+  }
+  outNumEntries = numEntries;
+  outIsArray = (numEntries > 0 && allIndices && maxIndex == numEntries);
+}
+
+// Reports the key on top of the stack, must not modify it (lua_next needs it intact).
+static bool Lua_VisitKey(lua_State* state, Anki::Util::ILuaTableVisitor& visitor)
+{
+  switch(lua_type(state, -1)) {
+    case LUA_TSTRING:
+    {
+      size_t length = 0;
+      const char* key = lua_tolstring(state, -1, &length);
+      visitor.VisitKey(key, length);
+      return true;
+    }
+    case LUA_TNUMBER:
+    {
+      // Never lua_tolstring a number key, it would convert the key in place.
+      char keyBuf[LUAI_MAXNUMBER2STR];
+      const int length = lua_number2str(keyBuf, lua_tonumber(state, -1));
+      visitor.VisitKey(keyBuf, (size_t)length);
+      return true;
+    }
+    default:
+      PRINT_NAMED_WARNING("Lua_VisitKey", "Unhandled lua key type: %d", lua_type(state, -1));
+      return false;
+  }
+}
+
+static bool Lua_VisitTable(lua_State* state,
+                           Anki::Util::ILuaTableVisitor& visitor,
+                           LuaTablePath& path)
+{
+  const void* table = lua_topointer(state, -1);
+  if(std::find(path.begin(), path.end(), table) != path.end()) {
+    PRINT_NAMED_ERROR("Lua_VisitTable", "Table %p contains itself, cannot serialize cycles.", table);
+    return false;
+  }
+  if(path.size() >= kMaxTableDepth || !lua_checkstack(state, 3)) {
+    PRINT_NAMED_ERROR("Lua_VisitTable", "Tables nested too deeply (%zu levels).", path.size());
+    return false;
+  }
+  path.push_back(table);
+
+  size_t numEntries = 0;
+  bool isArray = false;
+  Lua_ClassifyTable(state, numEntries, isArray);
+
+  bool ok = true;
+  if(isArray) {
+    visitor.BeginArray(numEntries);
+    for(size_t i = 1; ok && i <= numEntries; ++i) {
+      lua_rawgeti(state, -1, (int)i);
+      ok = Lua_VisitValueRecursive(state, visitor, path);
+      lua_pop(state, 1);
+    }
+    visitor.EndArray();
+  }
+  else {
+    visitor.BeginObject(numEntries);
+    lua_pushnil(state);
+    while(lua_next(state, -2) != 0) {
+      // key at -2, value at -1
+      lua_pushvalue(state, -2);
+      const bool visitedKey = Lua_VisitKey(state, visitor);
+      lua_pop(state, 1);
+      if(visitedKey) {
+        ok = Lua_VisitValueRecursive(state, visitor, path);
+      }
+      lua_pop(state, 1); // pop the value, lua will find the key after this key.
+      if(!ok) {
+        lua_pop(state, 1); // abandon the iteration, pop the key too.
+        break;
+      }
+    }
+    visitor.EndObject();
+  }
+
+  path.pop_back();
+  return ok;
+}
+
+// Using value on the top of the stack
+static bool Lua_VisitValueRecursive(lua_State* state,
+                                    Anki::Util::ILuaTableVisitor& visitor,
+                                    LuaTablePath& path)
+{
+  switch(lua_type(state, -1)) {
+    case LUA_TBOOLEAN:
+      visitor.VisitBoolean(lua_toboolean(state, -1) != 0);
+      return true;
+    case LUA_TNUMBER:
+      visitor.VisitNumber(lua_tonumber(state, -1));
+      return true;
+    case LUA_TSTRING:
+    {
+      size_t length = 0;
+      const char* value = lua_tolstring(state, -1, &length);
+      visitor.VisitString(value, length);
+      return true;
+    }
+    case LUA_TTABLE:
+      return Lua_VisitTable(state, visitor, path);
+    case LUA_TNIL:
+      visitor.VisitNil();
+      return true;
+    default:
+      // functions, userdata and threads have no data representation.
+      visitor.VisitNil();
+      return true;
+  }
+}
+
+} // anonymous namespace
@@ -0,0 +1,54 @@
+//
+//  LuaTableVisitor.h
+//  BaseStation
+//
+//  Created by Mark Pauley on 7/21/14.
+//  Copyright (c) 2014 Anki. All rights reserved.
+//
+//  Description:
+//  Walks a Lua value (usually a table) and reports its structure to a visitor,
+//  without building any intermediate representation.
+//  Serializers (see LuaTableSerializer.h) are implemented as visitors.
+//
+
+#ifndef UTIL_LUA_LUATABLEVISITOR_H_
+#define UTIL_LUA_LUATABLEVISITOR_H_
+
+#include <cstddef>
+
+struct lua_State;
+
+namespace Anki{ namespace Util
+{
+
+class ILuaTableVisitor {
+public:
+  virtual ~ILuaTableVisitor() {}
+
+  // Scalars. Values that have no data representation (functions, userdata, threads) are visited as nil.
+  virtual void VisitNil() = 0;
+  virtual void VisitBoolean(bool value) = 0;
+  virtual void VisitNumber(double value) = 0;
+  virtual void VisitString(const char* value, size_t length) = 0;
+
+  // A table whose keys are exactly 1..length. Followed by length values, then EndArray.
+  virtual void BeginArray(size_t length) = 0;
+  virtual void EndArray() = 0;
+
+  // Any other non-empty table. Followed by numEntries (VisitKey, value) pairs, then EndObject.
+  //  Number keys are reported as their string representation.
+  virtual void BeginObject(size_t numEntries) = 0;
+  virtual void VisitKey(const char* key, size_t length) = 0;
+  virtual void EndObject() = 0;
+};
+
+// Walks the value on top of the given lua stack, calling back into visitor.  Does not pop stack.
+//  Empty tables are visited as empty objects.
+//  Tables that (directly or indirectly) contain themselves are rejected; the walk stops and returns false.
+//  Keys that are neither strings nor numbers are skipped.
+bool Lua_VisitValue(lua_State* state, ILuaTableVisitor& visitor);
+
+}
+} // namespace
+
+#endif
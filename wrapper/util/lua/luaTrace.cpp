@@ -0,0 +1,227 @@
+//
+//  LuaTrace.cpp
+//  BaseStation
+//
+//  Created by Mark Pauley on 7/28/14.
+//  Copyright (c) 2014 Anki. All rights reserved.
+//
+
+#include "util/lua/luaTrace.h"
+#include "util/logging/logging.h"
+#include <lua/lua.hpp>
+#include <chrono>
+#include <cstdint>
+#include <memory>
+#include <mutex>
+#include <ostream>
+#include <string>
+#include <unordered_set>
+#include <vector>
+
+namespace {
+  struct LuaTraceEvent {
+    const char* name;
+    const char* category;
+    uint64_t timestampUS;
+    char phase; // 'B'egin or 'E'nd
+  };
+
+  struct LuaTraceThreadBuffer {
+    unsigned int threadID;
+    std::vector<LuaTraceEvent> events;
+    uint64_t droppedCount;
+  };
+
+  // Bounds memory if someone forgets to turn tracing off.
+  static const size_t kMaxEventsPerThread = 1024 * 1024;
+
+  // Every thread that ever recorded an event owns one buffer here (buffers are never freed).
+  static std::mutex sBuffersMutex;
+  static std::vector<std::unique_ptr<LuaTraceThreadBuffer>> sBuffers;
+  static thread_local LuaTraceThreadBuffer* tThreadBuffer = nullptr;
+
+  static std::mutex sNamesMutex;
+  static std::unordered_set<std::string> sNames;
+
+  static const std::chrono::steady_clock::time_point sTraceEpoch = std::chrono::steady_clock::now();
+
+  static LuaTraceThreadBuffer& GetThreadBuffer()
+  {
+    if(tThreadBuffer == nullptr) {
+      std::lock_guard<std::mutex> lock(sBuffersMutex);
+      std::unique_ptr<LuaTraceThreadBuffer> buffer(new LuaTraceThreadBuffer());
+      buffer->threadID = (unsigned int)sBuffers.size() + 1;
+      buffer->droppedCount = 0;
+      tThreadBuffer = buffer.get();
+      sBuffers.push_back(std::move(buffer));
+    }
+    return *tThreadBuffer;
+  }
+
+  static void RecordEvent(const char* name, const char* category, char phase)
+  {
+    LuaTraceThreadBuffer& buffer = GetThreadBuffer();
+    if(buffer.events.size() >= kMaxEventsPerThread) {
+      buffer.droppedCount++;
+      return;
+    }
+    const auto elapsed = std::chrono::steady_clock::now() - sTraceEpoch;
+    const uint64_t timestampUS = (uint64_t)std::chrono::duration_cast<std::chrono::microseconds>(elapsed).count();
+    buffer.events.push_back(LuaTraceEvent{name, category, timestampUS, phase});
+  }
+
+  static void WriteJSONString(std::ostream& stream, const char* str)
+  {
+    stream << '"';
+    for(const char* cur = str; *cur != '\0'; ++cur) {
+      const unsigned char c = (unsigned char)*cur;
+      if(c == '"' || c == '\\') {
+        stream << '\\' << *cur;
+      }
+      else if(c < 0x20) {
+        stream << ' ';
+      }
+      else {
+        stream << *cur;
+      }
+    }
+    stream << '"';
+  }
+
+  static void LuaTraceGCHook(void* ud, int event, int begin)
+  {
+    if(!Anki::Util::LuaTraceRecorder::IsEnabled()) {
+      return;
+    }
+    const char* name = "GC";
+    switch(event) {
+      case LUA_GCEVSTEP:   name = "GC step"; break;
+      case LUA_GCEVATOMIC: name = "GC atomic"; break;
+      case LUA_GCEVFULL:   name = "GC full"; break;
+      default: break;
+    }
+    RecordEvent(name, "gc", begin ? 'B' : 'E');
+  }
+} // anonymous namespace
+
+namespace Anki{ namespace Util {
+
+  std::atomic<bool> LuaTraceRecorder::sEnabled(false);
+
+  void LuaTraceRecorder::SetEnabled(bool enabled)
+  {
+    sEnabled.store(enabled, std::memory_order_relaxed);
+  }
+
+  void LuaTraceRecorder::Begin(const char* name, const char* category)
+  {
+    RecordEvent(name, category, 'B');
+  }
+
+  void LuaTraceRecorder::End(const char* name, const char* category)
+  {
+    RecordEvent(name, category, 'E');
+  }
+
+  const char* LuaTraceRecorder::InternName(const char* name)
+  {
+    std::lock_guard<std::mutex> lock(sNamesMutex);
+    // unordered_set never moves its elements, so the pointer stays valid.
+    return sNames.insert(name).first->c_str();
+  }
+
+  void LuaTraceRecorder::WriteChromeTrace(std::ostream& stream)
+  {
+    std::lock_guard<std::mutex> lock(sBuffersMutex);
+    stream << "{\"traceEvents\":[";
+    bool first = true;
+    for(const auto& buffer : sBuffers) {
+      for(const LuaTraceEvent& event : buffer->events) {
+        stream << (first ? "\n" : ",\n");
+        first = false;
+        stream << "{\"name\":";
+        WriteJSONString(stream, event.name);
+        stream << ",\"cat\":";
+        WriteJSONString(stream, event.category);
+        stream << ",\"ph\":\"" << event.phase << "\",\"ts\":" << event.timestampUS
+               << ",\"pid\":1,\"tid\":" << buffer->threadID << "}";
+      }
+      if(buffer->droppedCount > 0) {
+        PRINT_NAMED_WARNING("LuaTraceRecorder.WriteChromeTrace", "thread %u dropped %llu events",
+                            buffer->threadID, (unsigned long long)buffer->droppedCount);
+      }
+    }
+    stream << "\n]}" << std::endl;
+  }
+
+  void LuaTraceRecorder::Clear()
+  {
+    std::lock_guard<std::mutex> lock(sBuffersMutex);
+    for(const auto& buffer : sBuffers) {
+      buffer->events.clear();
+      buffer->droppedCount = 0;
+    }
+  }
+
+  void LuaTraceRecorder::InstallGCHook(lua_State* state)
+  {
+    lua_setgchook(state, &LuaTraceGCHook, nullptr);
+  }
+
+#pragma mark - Script interface
+  static const char* kScriptCategory = "script";
+
+  // trace.scope(name, f, ...)
+  //  f may not yield: Chrome pairs begin and end events per thread, and a region left open across a yield
+  //  would end after the resume that ran it.  Plain lua_pcall turns such a yield into an error.
+  static int LuaTrace_Scope(lua_State* state)
+  {
+    const char* name = luaL_checkstring(state, 1);
+    luaL_checktype(state, 2, LUA_TFUNCTION);
+    if(LuaTraceRecorder::IsEnabled()) {
+      LuaTraceRecorder::Begin(LuaTraceRecorder::InternName(name), kScriptCategory);
+    }
+    const int status = lua_pcall(state, lua_gettop(state) - 2, LUA_MULTRET, 0);
+    if(LuaTraceRecorder::IsEnabled()) {
+      LuaTraceRecorder::End(LuaTraceRecorder::InternName(lua_tostring(state, 1)), kScriptCategory);
+    }
+    if(status != LUA_OK) {
+      return lua_error(state); // rethrow, error object is on top.
+    }
+    return lua_gettop(state) - 1;
+  }
+
+  // trace.beginScope(name)
+  static int LuaTrace_BeginScope(lua_State* state)
+  {
+    const char* name = luaL_checkstring(state, 1);
+    if(LuaTraceRecorder::IsEnabled()) {
+      LuaTraceRecorder::Begin(LuaTraceRecorder::InternName(name), kScriptCategory);
+    }
+    return 0;
+  }
+
+  // trace.endScope(name)
+  static int LuaTrace_EndScope(lua_State* state)
+  {
+    const char* name = luaL_checkstring(state, 1);
+    if(LuaTraceRecorder::IsEnabled()) {
+      LuaTraceRecorder::End(LuaTraceRecorder::InternName(name), kScriptCategory);
+    }
+    return 0;
+  }
+
+  static const struct luaL_Reg _LuaTraceLib[] = {
+    {"scope", LuaTrace_Scope},
+    {"beginScope", LuaTrace_BeginScope},
+    {"endScope", LuaTrace_EndScope},
+    {NULL, NULL}
+  };
+
+  int LuaTraceRecorder::OpenLibrary(lua_State* state)
+  {
+    luaL_newlib(state, _LuaTraceLib);
+    return 1;
+  }
+
+} }
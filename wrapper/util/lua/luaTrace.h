@@ -0,0 +1,89 @@
+/************************************************************************
+*  LuaTrace.h
+*  BaseStation
+*
+*  Created by Mark Pauley on 7/28/14.
+*  Copyright (c) 2014 Anki. All rights reserved.
+*
+*  Description:
+*  - Optional begin/end event recorder for script work, exported in the
+*    Chrome trace format (load the file in chrome://tracing).
+*  - Records LuaScript::Resume, collector work (via lua_setgchook),
+*    bridge calls (LUA_TRACE_SCOPE) and script regions (trace.scope).
+*  - Events go to a per-thread buffer, so recording never takes a lock.
+*  - While disabled, every trace point costs a single test of a flag.
+*
+************************************************************************/
+
+#ifndef UTIL_LUA_LUATRACE_H_
+#define UTIL_LUA_LUATRACE_H_
+
+#include <atomic>
+#include <iosfwd>
+
+struct lua_State;
+
+namespace Anki{ namespace Util {
+
+  class LuaTraceRecorder {
+  public:
+    static bool IsEnabled() { return sEnabled.load(std::memory_order_relaxed); }
+    static void SetEnabled(bool enabled);
+
+    // name and category must outlive the recorder (string literals, or see InternName).
+    static void Begin(const char* name, const char* category);
+    static void End(const char* name, const char* category);
+
+    // Returns a copy of name that lives as long as the process (for names that come from scripts).
+    static const char* InternName(const char* name);
+
+    // Writes every recorded event, from all threads, as Chrome trace JSON.
+    //  Should not race with recording threads (disable tracing first).
+    static void WriteChromeTrace(std::ostream& stream);
+    // Discards all recorded events.  Same restriction as WriteChromeTrace.
+    static void Clear();
+
+    // Forwards collector work of the given state to the recorder.
+    static void InstallGCHook(lua_State* state);
+
+    // Registers the 'trace' library for scripts:
+    //  trace.scope(name, f, ...)  calls f(...) inside a region named name and returns its results.
+    //                             f may not yield: the region would end after the resume that ran it.
+    //  trace.beginScope(name) / trace.endScope(name)  for regions that don't fit in one function.
+    static int OpenLibrary(lua_State* state);
+
+  private:
+    static std::atomic<bool> sEnabled;
+  };
+
+  // Records a region for the enclosing C++ scope.
+  //  Lua errors longjmp past the destructor, so open it after argument checks.
+  class LuaTraceScope {
+  public:
+    LuaTraceScope(const char* name, const char* category)
+    : name_(name), category_(category), active_(LuaTraceRecorder::IsEnabled())
+    {
+      if(active_) {
+        LuaTraceRecorder::Begin(name_, category_);
+      }
+    }
+    ~LuaTraceScope()
+    {
+      if(active_) {
+        LuaTraceRecorder::End(name_, category_);
+      }
+    }
+  private:
+    const char* name_;
+    const char* category_;
+    bool active_;
+  };
+
+} }
+
+#define LUA_TRACE_SCOPE_CONCAT_(a, b) a##b
+#define LUA_TRACE_SCOPE_CONCAT(a, b) LUA_TRACE_SCOPE_CONCAT_(a, b)
+#define LUA_TRACE_SCOPE(name, category) \
+  Anki::Util::LuaTraceScope LUA_TRACE_SCOPE_CONCAT(luaTraceScope_, __LINE__)((name), (category))
+
+#endif
@@ -13,6 +13,8 @@
 #include <boost/foreach.hpp>
 #include <boost/algorithm/string/predicate.hpp>
 #include <lua/lua.hpp>
+#include <new>
+#include <unordered_map>
 
 namespace {
 static void Lua_PushNextToPTree(lua_State* state,
@@ -32,6 +34,19 @@ template <typename V> static void Lua_PushKeyValueToPTree(lua_State* state,
                                                           const V &value);
 static void Lua_PushPTreeAsValue(lua_State* state,
                                  const boost::property_tree::ptree&);
+
+// Pinned handles for the keys of ptrees pushed into a lua_State.
+//  Config keys come from a small fixed vocabulary, but ptrees can hold arbitrary keys,
+//  so we stop pinning (pinned keys are never collected) once the cache is full.
+class LuaPTreeKeyCache {
+public:
+  static LuaPTreeKeyCache& Get(lua_State* state);
+  // Pushes key onto the lua stack, through a pinned handle when possible.
+  void PushKey(lua_State* state, const std::string& key);
+private:
+  static const size_t kMaxPinnedKeys = 1024;
+  std::unordered_map<std::string, lua_Key> pinnedKeys_;
+};
 } // anonymous namespace, file-local
 
 namespace Anki{ namespace Util {
@@ -93,6 +108,8 @@ void Lua_PushPTreeAsTable(lua_State* state, boost::property_tree::ptree const& t
   assert(childrenLength < INT_MAX);
   lua_createtable(state, (int)arrayLength, (int)childrenLength);
   
+  LuaPTreeKeyCache& keyCache = LuaPTreeKeyCache::Get(state);
+  
   // Lua tables can have hash values as well as arrays
   // So can ptree, so handle both.
   for(const ptree::value_type& kv : tree)
@@ -108,9 +125,9 @@ void Lua_PushPTreeAsTable(lua_State* state, boost::property_tree::ptree const& t
     else
     {
       // push as hash
-      lua_pushstring(state, kv.first.c_str());
+      keyCache.PushKey(state, kv.first);
       Lua_PushPTreeAsValue(state, kv.second);
-      lua_settable(state, -3);
+      lua_rawset(state, -3);
     }
   }
 }
@@ -230,6 +247,47 @@ void Lua_PushNextValueInArrayToPTree(lua_State* state, boost::property_tree::ptr
 
 #pragma mark ptree to Lua table helpers
 
+// The cache lives in a userdata anchored in the registry, and is destroyed along with the lua_State.
+static int LuaPTreeKeyCache_GC(lua_State* state)
+{
+  LuaPTreeKeyCache* cache = static_cast<LuaPTreeKeyCache*>(lua_touserdata(state, 1));
+  cache->~LuaPTreeKeyCache();
+  return 0;
+}
+
+LuaPTreeKeyCache& LuaPTreeKeyCache::Get(lua_State* state)
+{
+  static const char registryTag = 0;
+  lua_rawgetp(state, LUA_REGISTRYINDEX, &registryTag);
+  LuaPTreeKeyCache* cache = static_cast<LuaPTreeKeyCache*>(lua_touserdata(state, -1));
+  lua_pop(state, 1);
+  if(cache == nullptr) {
+    cache = new(lua_newuserdata(state, sizeof(LuaPTreeKeyCache))) LuaPTreeKeyCache();
+    lua_createtable(state, 0, 1);
+    lua_pushcfunction(state, LuaPTreeKeyCache_GC);
+    lua_setfield(state, -2, "__gc");
+    lua_setmetatable(state, -2);
+    lua_rawsetp(state, LUA_REGISTRYINDEX, &registryTag);
+  }
+  return *cache;
+}
+
+void LuaPTreeKeyCache::PushKey(lua_State* state, const std::string& key)
+{
+  auto iter = pinnedKeys_.find(key);
+  if(iter != pinnedKeys_.end()) {
+    lua_pushkey(state, iter->second);
+  }
+  else if(pinnedKeys_.size() < kMaxPinnedKeys && key.find('\0') == std::string::npos) {
+    const lua_Key pinnedKey = lua_pinkey(state, key.c_str());
+    pinnedKeys_.emplace(key, pinnedKey);
+    lua_pushkey(state, pinnedKey);
+  }
+  else {
+    lua_pushlstring(state, key.data(), key.size());
+  }
+}
+
 // Custom translator for bool (only supports std::string)
 struct BoolTranslator
 {